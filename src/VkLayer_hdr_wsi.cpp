@@ -3,188 +3,2534 @@
 #include "frog-color-management-v1-client-protocol.h"
 #include "xx-color-management-v4-client-protocol.h"
 #include "color-management-v1-client-protocol.h"
-
+#include "hdr_wsi_handle_table.h"
+#include "hdr_wsi_record.h"
+#include "hdr_wsi_stats.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cinttypes>
 #include <cmath>
+#include <cstdarg>
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <optional>
+#include <type_traits>
 #include <ranges>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 using namespace std::literals;
 
 namespace HdrLayer
 {
 
-struct ColorDescription {
-    VkSurfaceFormat2KHR surface;
-    frog_color_managed_surface_primaries frogPrimaries;
-    frog_color_managed_surface_transfer_function frogTransferFunction;
-    xx_color_manager_v4_primaries xxPrimaries;
-    xx_color_manager_v4_transfer_function xxTransferFunction;
-    wp_color_manager_v1_primaries primaries;
-    wp_color_manager_v1_transfer_function transferFunction;
-    bool extended_volume;
+static bool GetEnvBool(const char *name)
+{
+    const char *value = getenv(name);
+    return value && value == "1"sv;
+}
+
+static int GetEnvInt(const char *name, int defaultValue)
+{
+    const char *value = getenv(name);
+    return value && *value ? atoi(value) : defaultValue;
+}
+
+// With HDR_WSI_LAZY_PROBE=1, vkCreateWaylandSurfaceKHR only sends the
+// capability probe to the compositor, and it's awaited the first time the
+// result is needed (format queries or swapchain creation).
+static const bool s_lazyProbe = GetEnvBool("HDR_WSI_LAZY_PROBE");
+
+// Image descriptions are created asynchronously, swapchains keep presenting
+// with the previous description until the compositor sent `ready`.
+// HDR_WSI_DESCRIPTION_WAIT_MS lets a present block for up to that long for it,
+// and after HDR_WSI_DESCRIPTION_TIMEOUT_MS the change is given up on. A
+// swapchain without any previous description blocks until then, so its first
+// frames aren't shown untagged.
+static const std::chrono::milliseconds s_descriptionWait{GetEnvInt("HDR_WSI_DESCRIPTION_WAIT_MS", 0)};
+static const std::chrono::milliseconds s_descriptionTimeout{GetEnvInt("HDR_WSI_DESCRIPTION_TIMEOUT_MS", 1000)};
+
+// Dynamic metadata: MaxCLL/MaxFALL changes smaller than
+// HDR_WSI_METADATA_HYSTERESIS percent are ignored, and new descriptions are
+// started at most every HDR_WSI_METADATA_MIN_INTERVAL_MS.
+static const int s_metadataHysteresis = GetEnvInt("HDR_WSI_METADATA_HYSTERESIS", 0);
+static const std::chrono::milliseconds s_metadataMinInterval{GetEnvInt("HDR_WSI_METADATA_MIN_INTERVAL_MS", 0)};
+
+// Swapchains without metadata from the application describe their content as
+// filling the compositor's preferred description (the display's volume). With
+// HDR_WSI_CLAMP_METADATA=1 the application's metadata is also clamped to it,
+// so the compositor doesn't have to tone map content the display can show.
+static const bool s_clampMetadata = GetEnvBool("HDR_WSI_CLAMP_METADATA");
+
+enum LogLevel {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG,
+};
+
+static LogLevel GetEnvLogLevel(const char *name)
+{
+    const char *value = getenv(name);
+    if (!value) {
+        return LOG_INFO;
+    }
+    if (value == "error"sv) {
+        return LOG_ERROR;
+    } else if (value == "warning"sv) {
+        return LOG_WARNING;
+    } else if (value == "debug"sv) {
+        return LOG_DEBUG;
+    }
+    return LOG_INFO;
+}
+
+// HDR_WSI_LOG_LEVEL=error|warning|info|debug sets what's logged to stderr.
+// Apart from errors, at most HDR_WSI_LOG_RATE_LIMIT messages per second are
+// written, and repeated messages are collapsed.
+static const LogLevel s_logLevel = GetEnvLogLevel("HDR_WSI_LOG_LEVEL");
+static const int s_logRateLimit = GetEnvInt("HDR_WSI_LOG_RATE_LIMIT", 50);
+
+// Messages are formatted on the calling thread into a lock-free ring buffer,
+// and written to stderr by a background thread, so logging from a render
+// thread never waits for stderr. The thread is only started by the first
+// message, and joined when the layer is unloaded.
+class Logger
+{
+public:
+    ~Logger()
+    {
+        if (m_thread.joinable()) {
+            m_stop = true;
+            Wake();
+            m_thread.join();
+        }
+    }
+
+    void Write(LogLevel level, const char *format, va_list args)
+    {
+        std::call_once(m_started, [this]() {
+            for (uint64_t i = 0; i < m_slots.size(); i++) {
+                m_slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            m_thread = std::thread([this]() { Run(); });
+        });
+
+        // Bounded multi-producer queue: the slot for position pos is free once
+        // its sequence is pos, and holds a message once it's pos + 1.
+        uint64_t pos = m_tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;) {
+            slot = &m_slots[pos % m_slots.size()];
+            const int64_t diff = int64_t(slot->sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                m_overflows.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        vsnprintf(slot->text, sizeof(slot->text), format, args);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        Wake();
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        LogLevel level;
+        char text[256];
+    };
+
+    void Wake()
+    {
+        m_wakeups.fetch_add(1, std::memory_order_release);
+        m_wakeups.notify_one();
+    }
+
+    void Run()
+    {
+        // Sleeps until a message is queued, so an idle logger costs no wakeups.
+        while (!m_stop) {
+            const uint32_t wakeups = m_wakeups.load(std::memory_order_acquire);
+            Drain();
+            m_wakeups.wait(wakeups, std::memory_order_acquire);
+        }
+        Drain();
+        FlushRepeats();
+        FlushRateLimit();
+    }
+
+    void Drain()
+    {
+        for (;;) {
+            Slot &slot = m_slots[m_head % m_slots.size()];
+            if (slot.sequence.load(std::memory_order_acquire) != m_head + 1) {
+                break;
+            }
+            Print(slot.level, slot.text);
+            slot.sequence.store(m_head + m_slots.size(), std::memory_order_release);
+            m_head++;
+        }
+        if (const uint32_t overflows = m_overflows.exchange(0, std::memory_order_relaxed)) {
+            fprintf(stderr, "[HDR Layer] %u messages dropped, the log buffer was full\n", overflows);
+        }
+    }
+
+    void Print(LogLevel level, const char *text)
+    {
+        if (m_last == text) {
+            m_repeats++;
+            return;
+        }
+        FlushRepeats();
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - m_windowStart >= 1s) {
+            FlushRateLimit();
+            m_windowStart = now;
+            m_windowCount = 0;
+        }
+        if (level != LOG_ERROR && s_logRateLimit > 0 && m_windowCount >= s_logRateLimit) {
+            m_rateLimited++;
+            return;
+        }
+        m_windowCount++;
+
+        fprintf(stderr, "[HDR Layer] %s\n", text);
+        m_last = text;
+    }
+
+    void FlushRepeats()
+    {
+        if (m_repeats) {
+            fprintf(stderr, "[HDR Layer] last message repeated %u times\n", m_repeats);
+            m_repeats = 0;
+        }
+    }
+
+    void FlushRateLimit()
+    {
+        if (m_rateLimited) {
+            fprintf(stderr, "[HDR Layer] %u messages dropped by the rate limit\n", m_rateLimited);
+            m_rateLimited = 0;
+        }
+    }
+
+    std::array<Slot, 256> m_slots;
+    std::atomic<uint64_t> m_tail = 0;
+    std::atomic<uint32_t> m_overflows = 0;
+    std::atomic<uint32_t> m_wakeups = 0;
+    std::once_flag m_started;
+    std::thread m_thread;
+    std::atomic<bool> m_stop = false;
+
+    // only used by the logging thread
+    uint64_t m_head = 0;
+    std::string m_last;
+    uint32_t m_repeats = 0;
+    std::chrono::steady_clock::time_point m_windowStart;
+    int m_windowCount = 0;
+    uint32_t m_rateLimited = 0;
+};
+
+static Logger s_logger;
+
+__attribute__((format(printf, 2, 3)))
+static void Log(LogLevel level, const char *format, ...)
+{
+    if (level > s_logLevel) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    s_logger.Write(level, format, args);
+    va_end(args);
+}
+
+// HDR_WSI_TRACE=<path> writes a Chrome trace event JSON file (for
+// chrome://tracing or Perfetto) with the time spent in the layer. It's written
+// while the process runs, in the JSON array format, which stays loadable if
+// the process dies before the closing bracket.
+static const char *const s_tracePath = getenv("HDR_WSI_TRACE");
+
+struct TraceEvent {
+    const char *name;
+    // protocol of the surface, or nullptr
+    const char *protocol;
+    uint64_t id;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
+
+// Events are recorded into fixed-size per-thread ring buffers, so tracing
+// neither adds contention between threads nor allocates on the traced
+// threads. A background thread writes them out every second, or as soon as a
+// buffer is half full; events that find their buffer full are dropped.
+class Tracer
+{
+public:
+    ~Tracer()
+    {
+        if (m_thread.joinable()) {
+            {
+                std::unique_lock lock{m_wakeMutex};
+                m_stop = true;
+            }
+            m_wake.notify_one();
+            m_thread.join();
+        }
+        std::unique_lock lock{m_mutex};
+        if (m_file) {
+            FlushLocked();
+            fprintf(m_file, "\n]\n");
+            fclose(m_file);
+        }
+    }
+
+    void Record(const TraceEvent &event)
+    {
+        thread_local ThreadBuffer *t_buffer = nullptr;
+        if (!t_buffer) {
+            std::call_once(m_started, [this]() { Start(); });
+            std::unique_lock lock{m_mutex};
+            if (!m_file) {
+                return;
+            }
+            t_buffer = m_buffers.emplace_back(std::make_unique<ThreadBuffer>()).get();
+            t_buffer->tid = uint32_t(m_buffers.size());
+        }
+
+        // single producer, the flush is the only consumer
+        const uint64_t written = t_buffer->written.load(std::memory_order_relaxed);
+        const uint64_t pending = written - t_buffer->flushed.load(std::memory_order_acquire);
+        if (pending >= t_buffer->events.size()) {
+            t_buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        t_buffer->events[written % t_buffer->events.size()] = event;
+        t_buffer->written.store(written + 1, std::memory_order_release);
+        if (pending + 1 == t_buffer->events.size() / 2) {
+            m_wake.notify_one();
+        }
+    }
+
+    // Writes out all events recorded so far.
+    void Flush()
+    {
+        std::unique_lock lock{m_mutex};
+        if (m_file) {
+            FlushLocked();
+        }
+    }
+
+private:
+    struct ThreadBuffer {
+        uint32_t tid;
+        std::array<TraceEvent, 4096> events;
+        std::atomic<uint64_t> written = 0;
+        std::atomic<uint64_t> flushed = 0;
+        std::atomic<uint32_t> dropped = 0;
+    };
+
+    void Start()
+    {
+        std::unique_lock lock{m_mutex};
+        m_file = fopen(s_tracePath, "w");
+        if (!m_file) {
+            Log(LOG_ERROR, "can't write trace to %s", s_tracePath);
+            return;
+        }
+        fprintf(m_file, "[\n");
+        m_thread = std::thread([this]() { Run(); });
+    }
+
+    void Run()
+    {
+        std::unique_lock lock{m_wakeMutex};
+        while (!m_stop) {
+            m_wake.wait_for(lock, 1s);
+            lock.unlock();
+            Flush();
+            lock.lock();
+        }
+    }
+
+    void FlushLocked()
+    {
+        const auto toUs = [this](std::chrono::steady_clock::time_point time) {
+            return std::chrono::duration<double, std::micro>(time - m_start).count();
+        };
+        for (const auto &buffer : m_buffers) {
+            const uint64_t written = buffer->written.load(std::memory_order_acquire);
+            uint64_t flushed = buffer->flushed.load(std::memory_order_relaxed);
+            for (; flushed != written; flushed++) {
+                const TraceEvent &event = buffer->events[flushed % buffer->events.size()];
+                fprintf(m_file, "%s{\"name\":\"%s\",\"cat\":\"hdr_wsi\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"id\":\"0x%" PRIx64 "\"",
+                        m_separator, event.name, toUs(event.start), toUs(event.end) - toUs(event.start), int(getpid()), buffer->tid, event.id);
+                if (event.protocol) {
+                    fprintf(m_file, ",\"protocol\":\"%s\"", event.protocol);
+                }
+                fprintf(m_file, "}}");
+                m_separator = ",\n";
+            }
+            buffer->flushed.store(flushed, std::memory_order_release);
+            if (const uint32_t dropped = buffer->dropped.exchange(0, std::memory_order_relaxed)) {
+                Log(LOG_WARNING, "%u trace events of thread %u dropped, its buffer was full", dropped, buffer->tid);
+            }
+        }
+        fflush(m_file);
+    }
+
+    const std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+    std::once_flag m_started;
+
+    // guards the file and the list of buffers
+    std::mutex m_mutex;
+    FILE *m_file = nullptr;
+    const char *m_separator = "";
+    std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+
+    std::thread m_thread;
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+};
+
+static Tracer s_tracer;
+
+template <typename Handle>
+static uint64_t HandleId(Handle handle)
+{
+    if constexpr (std::is_pointer_v<Handle>) {
+        return uint64_t(reinterpret_cast<uintptr_t>(handle));
+    } else {
+        return uint64_t(handle);
+    }
+}
+
+// Records the time from its construction to its destruction, if tracing is
+// enabled. Without HDR_WSI_TRACE it doesn't even read the clock.
+class TraceSpan
+{
+public:
+    template <typename Handle>
+    TraceSpan(const char *name, Handle handle, const char *protocol = nullptr)
+    {
+        if (s_tracePath) {
+            m_event = TraceEvent{
+                .name = name,
+                .protocol = protocol,
+                .id = HandleId(handle),
+                .start = std::chrono::steady_clock::now(),
+            };
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    ~TraceSpan()
+    {
+        if (m_event.name) {
+            m_event.end = std::chrono::steady_clock::now();
+            s_tracer.Record(m_event);
+        }
+    }
+
+    // for ids and protocols only known once the traced call progressed
+    template <typename Handle>
+    void SetId(Handle handle)
+    {
+        m_event.id = HandleId(handle);
+    }
+
+    void SetProtocol(const char *protocol)
+    {
+        m_event.protocol = protocol;
+    }
+
+private:
+    TraceEvent m_event = {};
+};
+
+// For spans that don't match a scope, like asynchronous roundtrips.
+template <typename Handle>
+static void TraceComplete(const char *name, Handle handle, std::chrono::steady_clock::time_point start)
+{
+    if (s_tracePath) {
+        s_tracer.Record(TraceEvent{
+            .name = name,
+            .id = HandleId(handle),
+            .start = start,
+            .end = std::chrono::steady_clock::now(),
+        });
+    }
+}
+
+// HDR_WSI_RECORD=<path> writes a binary log of the calls the layer handles for
+// HDR surfaces and swapchains, with their arguments and timing, see
+// hdr_wsi_record.h and hdr-wsi-dump.
+static const char *const s_recordPath = getenv("HDR_WSI_RECORD");
+
+// Records are written as calls return, under a lock, with one write each.
+class Recorder
+{
+public:
+    ~Recorder()
+    {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    void Write(HdrWsiRecord::Type type, std::chrono::steady_clock::time_point start,
+               std::span<const std::byte> payload, std::span<const std::byte> tail)
+    {
+        const auto end = std::chrono::steady_clock::now();
+        static thread_local const uint32_t t_thread = m_threads++;
+
+        const HdrWsiRecord::RecordHeader header = {
+            .type = type,
+            .size = uint32_t(payload.size() + tail.size()),
+            .timeNs = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_start).count()),
+            .durationNs = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()),
+            .thread = t_thread,
+        };
+
+        std::unique_lock lock{m_mutex};
+        if (!m_opened) {
+            m_opened = true;
+            Open();
+        }
+        if (m_fd < 0) {
+            return;
+        }
+        // Written unbuffered, so the log is complete up to the last call when
+        // the application crashes or exits without running destructors
+        iovec parts[] = {
+            {const_cast<HdrWsiRecord::RecordHeader *>(&header), sizeof(header)},
+            {const_cast<std::byte *>(payload.data()), payload.size()},
+            {const_cast<std::byte *>(tail.data()), tail.size()},
+        };
+        WriteAll(parts);
+    }
+
+private:
+    void Open()
+    {
+        m_fd = open(s_recordPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0) {
+            Log(LOG_ERROR, "can't record calls to %s", s_recordPath);
+            return;
+        }
+        const HdrWsiRecord::FileHeader header = {
+            .magic = HdrWsiRecord::s_magic,
+            .version = HdrWsiRecord::s_version,
+            .pid = uint32_t(getpid()),
+        };
+        iovec parts[] = {{const_cast<HdrWsiRecord::FileHeader *>(&header), sizeof(header)}};
+        WriteAll(parts);
+        Log(LOG_INFO, "recording calls to %s", s_recordPath);
+    }
+
+    void WriteAll(std::span<iovec> parts)
+    {
+        while (!parts.empty()) {
+            const ssize_t written = writev(m_fd, parts.data(), int(parts.size()));
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0) {
+                Log(LOG_ERROR, "can't write to %s, recording stopped", s_recordPath);
+                close(m_fd);
+                m_fd = -1;
+                return;
+            }
+            // writev may stop short, continue after what was written
+            size_t skip = size_t(written);
+            while (!parts.empty() && skip >= parts.front().iov_len) {
+                skip -= parts.front().iov_len;
+                parts = parts.subspan(1);
+            }
+            if (!parts.empty()) {
+                parts.front().iov_base = static_cast<std::byte *>(parts.front().iov_base) + skip;
+                parts.front().iov_len -= skip;
+            }
+        }
+    }
+
+    const std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+    std::atomic<uint32_t> m_threads = 0;
+    std::mutex m_mutex;
+    bool m_opened = false;
+    int m_fd = -1;
+};
+
+static Recorder s_recorder;
+
+// Records a call of the layer when it goes out of scope, if HDR_WSI_RECORD is
+// set. The caller fills in the payload, and the tail for variable length
+// records.
+template <typename Payload>
+class RecordedCall
+{
+public:
+    explicit RecordedCall(HdrWsiRecord::Type type)
+        : m_type(type)
+    {
+        if (s_recordPath) {
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    RecordedCall(const RecordedCall &) = delete;
+    RecordedCall &operator=(const RecordedCall &) = delete;
+
+    ~RecordedCall()
+    {
+        if (s_recordPath && !m_discarded) {
+            s_recorder.Write(m_type, m_start, std::as_bytes(std::span(&payload, 1)), std::as_bytes(std::span(tail)));
+        }
+    }
+
+    // For calls that turn out not to involve an HDR surface or swapchain,
+    // which aren't recorded.
+    void Discard()
+    {
+        m_discarded = true;
+    }
+
+    Payload payload = {};
+    std::vector<uint64_t> tail;
+
+private:
+    HdrWsiRecord::Type m_type;
+    bool m_discarded = false;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// HDR_WSI_STATS=1 publishes counters in a shared memory segment, for
+// hdr-wsi-stats or other monitoring tools. See hdr_wsi_stats.h for the layout.
+static const bool s_statsEnabled = GetEnvBool("HDR_WSI_STATS");
+
+class StatsPublisher
+{
+public:
+    ~StatsPublisher()
+    {
+        if (m_segment) {
+            munmap(m_segment, sizeof(HdrWsiStats::Segment));
+            shm_unlink(m_name);
+        }
+    }
+
+    // The segment is created by the first counter update, nullptr if
+    // statistics are disabled or it couldn't be created.
+    HdrWsiStats::Segment *Segment()
+    {
+        if (!s_statsEnabled) {
+            return nullptr;
+        }
+        std::call_once(m_created, [this]() { Create(); });
+        return m_segment;
+    }
+
+    HdrWsiStats::SwapchainStats *AddSwapchain(uint64_t swapchain, uint64_t surface, VkColorSpaceKHR colorSpace)
+    {
+        auto segment = Segment();
+        if (!segment) {
+            return nullptr;
+        }
+        for (auto &slot : segment->swapchains) {
+            uint64_t expected = 0;
+            // slots are zeroed when released, so only the identity is left to fill in
+            if (slot.swapchain.compare_exchange_strong(expected, swapchain, std::memory_order_relaxed)) {
+                slot.surface.store(surface, std::memory_order_relaxed);
+                slot.colorSpace.store(uint32_t(colorSpace), std::memory_order_relaxed);
+                return &slot;
+            }
+        }
+        Log(LOG_WARNING, "no statistics slot left for swapchain 0x%" PRIx64, swapchain);
+        return nullptr;
+    }
+
+    void RemoveSwapchain(HdrWsiStats::SwapchainStats *stats)
+    {
+        if (!stats) {
+            return;
+        }
+        for (auto counter : {&HdrWsiStats::SwapchainStats::surface, &HdrWsiStats::SwapchainStats::presents,
+                             &HdrWsiStats::SwapchainStats::descriptionUpdates, &HdrWsiStats::SwapchainStats::descriptionRequests,
+                             &HdrWsiStats::SwapchainStats::failedDescriptions, &HdrWsiStats::SwapchainStats::blockedNs,
+                             &HdrWsiStats::SwapchainStats::suppressedMetadataUpdates, &HdrWsiStats::SwapchainStats::lastDescLatencyFrames,
+                             &HdrWsiStats::SwapchainStats::maxDescLatencyFrames}) {
+            (stats->*counter).store(0, std::memory_order_relaxed);
+        }
+        stats->colorSpace.store(0, std::memory_order_relaxed);
+        stats->swapchain.store(0, std::memory_order_release);
+    }
+
+private:
+    void Create()
+    {
+        HdrWsiStats::SegmentName(m_name, uint32_t(getpid()));
+        // A segment left behind by an earlier process with the same pid is
+        // replaced, never reused: its counters and slots would carry over, and
+        // anyone could have created it. O_EXCL fails if the name was taken again
+        // in between.
+        shm_unlink(m_name);
+        int fd = shm_open(m_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            Log(LOG_ERROR, "can't create statistics segment %s", m_name);
+            return;
+        }
+        void *memory = MAP_FAILED;
+        if (ftruncate(fd, sizeof(HdrWsiStats::Segment)) == 0) {
+            memory = mmap(nullptr, sizeof(HdrWsiStats::Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (memory == MAP_FAILED) {
+            Log(LOG_ERROR, "can't map statistics segment %s", m_name);
+            shm_unlink(m_name);
+            return;
+        }
+
+        // a new segment is zero-filled, which is a valid state for all the counters
+        m_segment = static_cast<HdrWsiStats::Segment *>(memory);
+        m_segment->version = HdrWsiStats::s_version;
+        m_segment->pid = uint32_t(getpid());
+        m_segment->maxSwapchains = HdrWsiStats::s_maxSwapchains;
+        std::atomic_thread_fence(std::memory_order_release);
+        m_segment->magic = HdrWsiStats::s_magic;
+        Log(LOG_INFO, "publishing statistics in %s", m_name);
+    }
+
+    std::once_flag m_created;
+    char m_name[64] = {};
+    HdrWsiStats::Segment *m_segment = nullptr;
 };
 
-static std::vector<ColorDescription> s_ExtraHDRSurfaceFormats = {
-    ColorDescription{
-        .surface = {
-            .surfaceFormat = {
-                VK_FORMAT_A2B10G10R10_UNORM_PACK32,
-                VK_COLOR_SPACE_HDR10_ST2084_EXT,
-            }
+static StatsPublisher s_stats;
+
+static void CountStat(HdrWsiStats::SwapchainStats *stats, std::atomic<uint64_t> HdrWsiStats::SwapchainStats::*counter, uint64_t value = 1)
+{
+    if (stats) {
+        (stats->*counter).fetch_add(value, std::memory_order_relaxed);
+    }
+}
+
+static void SetStat(HdrWsiStats::SwapchainStats *stats, std::atomic<uint64_t> HdrWsiStats::SwapchainStats::*gauge, uint64_t value)
+{
+    if (stats) {
+        (stats->*gauge).store(value, std::memory_order_relaxed);
+    }
+}
+
+static void CountStat(std::atomic<uint64_t> HdrWsiStats::Segment::*counter, int64_t value = 1)
+{
+    if (auto segment = s_stats.Segment()) {
+        (segment->*counter).fetch_add(uint64_t(value), std::memory_order_relaxed);
+    }
+}
+
+// Adds a call, and the time until Stop or its destruction, to the entry
+// point's counters. Doesn't read the clock without HDR_WSI_STATS.
+class EntryPointTimer
+{
+public:
+    explicit EntryPointTimer(HdrWsiStats::EntryPoint entryPoint)
+        : m_segment(s_stats.Segment())
+        , m_entryPoint(entryPoint)
+    {
+        if (m_segment) {
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    EntryPointTimer(const EntryPointTimer &) = delete;
+    EntryPointTimer &operator=(const EntryPointTimer &) = delete;
+
+    ~EntryPointTimer()
+    {
+        Stop();
+    }
+
+    void SetEntryPoint(HdrWsiStats::EntryPoint entryPoint)
+    {
+        m_entryPoint = entryPoint;
+    }
+
+    // Returns the time counted, zero if statistics are disabled or the timer
+    // was already stopped.
+    std::chrono::nanoseconds Stop()
+    {
+        if (!m_segment) {
+            return 0ns;
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+        auto &stats = m_segment->entryPoints[m_entryPoint];
+        stats.calls.fetch_add(1, std::memory_order_relaxed);
+        stats.ns.fetch_add(uint64_t(elapsed.count()), std::memory_order_relaxed);
+        m_segment = nullptr;
+        return elapsed;
+    }
+
+private:
+    HdrWsiStats::Segment *m_segment;
+    HdrWsiStats::EntryPoint m_entryPoint;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+static void CountRequests(uint32_t count = 1)
+{
+    CountStat(&HdrWsiStats::Segment::requests, count);
+}
+
+// Each time the layer blocks reading the compositor's events
+static void CountCompositorWait()
+{
+    CountStat(&HdrWsiStats::Segment::compositorWaits);
+}
+
+struct ColorDescription {
+    VkSurfaceFormat2KHR surface;
+    frog_color_managed_surface_primaries frogPrimaries;
+    frog_color_managed_surface_transfer_function frogTransferFunction;
+    xx_color_manager_v4_primaries xxPrimaries;
+    xx_color_manager_v4_transfer_function xxTransferFunction;
+    wp_color_manager_v1_primaries primaries;
+    wp_color_manager_v1_transfer_function transferFunction;
+    bool extended_volume;
+    // Windows-style scRGB, which color-management-v1 has a description for
+    bool scrgb;
+    // CIE xy (red, green, blue, white), sent with set_primaries if the
+    // compositor lacks the named primaries
+    std::array<float, 8> chromaticities;
+    // Exponent of the transfer function if it's a pure power curve, sent with
+    // set_tf_power if the compositor lacks the named one. DCI-P3's gamma 2.6
+    // has no named transfer function at all.
+    float tfPower = 0.0f;
+    bool hasNamedTf = true;
+};
+
+static constexpr std::array<float, 8> s_bt709Chromaticities = {0.640f, 0.330f, 0.300f, 0.600f, 0.150f, 0.060f, 0.3127f, 0.3290f};
+static constexpr std::array<float, 8> s_bt2020Chromaticities = {0.708f, 0.292f, 0.170f, 0.797f, 0.131f, 0.046f, 0.3127f, 0.3290f};
+static constexpr std::array<float, 8> s_displayP3Chromaticities = {0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.3127f, 0.3290f};
+static constexpr std::array<float, 8> s_dciP3Chromaticities = {0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.314f, 0.351f};
+
+// Colorspaces frog-color-management-v1 has no names for are tagged with its
+// UNDEFINED primaries and transfer function, and not exposed on it.
+static constexpr std::array s_ExtraHDRSurfaceFormats = {
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+                VK_COLOR_SPACE_HDR10_ST2084_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC2020,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_ST2084_PQ,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_ST2084_PQ,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_bt2020Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2R10G10B10_UNORM_PACK32,
+                VK_COLOR_SPACE_HDR10_ST2084_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC2020,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_ST2084_PQ,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_ST2084_PQ,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_bt2020Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_R16G16B16A16_SFLOAT,
+                VK_COLOR_SPACE_EXTENDED_SRGB_LINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC709,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_SCRGB_LINEAR,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_SRGB,
+        // xx has no windows_scrgb, wp only uses these when it isn't advertised
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_SRGB,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR,
+        .extended_volume = true,
+        .scrgb = true,
+        .chromaticities = s_bt709Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_R16G16B16A16_SFLOAT,
+                VK_COLOR_SPACE_BT709_LINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC709,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_SCRGB_LINEAR,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_SRGB,
+        // xx has no windows_scrgb, wp only uses these when it isn't advertised
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_SRGB,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR,
+        .extended_volume = true,
+        .scrgb = true,
+        .chromaticities = s_bt709Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_R16G16B16A16_SFLOAT,
+                VK_COLOR_SPACE_BT2020_LINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC2020,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_SCRGB_LINEAR,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_bt2020Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_R16G16B16A16_SFLOAT,
+                VK_COLOR_SPACE_DISPLAY_P3_LINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_DISPLAY_P3,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_DISPLAY_P3,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_displayP3Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+                VK_COLOR_SPACE_BT709_NONLINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_SRGB,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_BT709,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_SRGB,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_BT1886,
+        .extended_volume = true,
+        .scrgb = false,
+        .chromaticities = s_bt709Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2R10G10B10_UNORM_PACK32,
+                VK_COLOR_SPACE_BT709_NONLINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_SRGB,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_BT709,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_SRGB,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_BT1886,
+        .extended_volume = true,
+        .scrgb = false,
+        .chromaticities = s_bt709Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+                VK_COLOR_SPACE_HDR10_HLG_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_HLG,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_HLG,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_bt2020Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2R10G10B10_UNORM_PACK32,
+                VK_COLOR_SPACE_HDR10_HLG_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_HLG,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_HLG,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_bt2020Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+                VK_COLOR_SPACE_DISPLAY_P3_NONLINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_DISPLAY_P3,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_SRGB,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_DISPLAY_P3,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_SRGB,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_displayP3Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2R10G10B10_UNORM_PACK32,
+                VK_COLOR_SPACE_DISPLAY_P3_NONLINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_DISPLAY_P3,
+        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_SRGB,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_DISPLAY_P3,
+        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_SRGB,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_displayP3Chromaticities,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+                VK_COLOR_SPACE_DCI_P3_NONLINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_DCI_P3,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_DCI_P3,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_dciP3Chromaticities,
+        .tfPower = 2.6f,
+        .hasNamedTf = false,
+    },
+    ColorDescription{
+        .surface = {
+            .surfaceFormat = {
+                VK_FORMAT_A2R10G10B10_UNORM_PACK32,
+                VK_COLOR_SPACE_DCI_P3_NONLINEAR_EXT,
+            }
+        },
+        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_DCI_P3,
+        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_DCI_P3,
+        .extended_volume = false,
+        .scrgb = false,
+        .chromaticities = s_dciP3Chromaticities,
+        .tfPower = 2.6f,
+        .hasNamedTf = false,
+    },
+};
+
+// The colorspaces of VK_EXT_swapchain_colorspace have consecutive values, so
+// the description of a swapchain's colorspace is a table lookup.
+static constexpr uint32_t s_ColorSpaceBase = VK_COLOR_SPACE_DISPLAY_P3_NONLINEAR_EXT;
+static constexpr uint32_t s_ColorSpaceCount = VK_COLOR_SPACE_EXTENDED_SRGB_NONLINEAR_EXT - s_ColorSpaceBase + 1;
+
+static constexpr auto s_ColorSpaceDescriptions = [] {
+    std::array<const ColorDescription *, s_ColorSpaceCount> descriptions{};
+    for (const auto &desc : s_ExtraHDRSurfaceFormats) {
+        // multiple VkFormats share the description of a colorspace
+        auto &entry = descriptions[desc.surface.surfaceFormat.colorSpace - s_ColorSpaceBase];
+        if (!entry) {
+            entry = &desc;
+        }
+    }
+    return descriptions;
+}();
+
+static constexpr const ColorDescription *FindColorDescription(VkColorSpaceKHR colorSpace)
+{
+    const uint32_t index = uint32_t(colorSpace) - s_ColorSpaceBase;
+    return index < s_ColorSpaceDescriptions.size() ? s_ColorSpaceDescriptions[index] : nullptr;
+}
+
+static_assert(FindColorDescription(VK_COLOR_SPACE_HDR10_ST2084_EXT)->transferFunction == WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ);
+static_assert(!FindColorDescription(VK_COLOR_SPACE_SRGB_NONLINEAR_KHR));
+
+// HDR_WSI_ICC_PROFILE=<path> tags sRGB swapchains, which are otherwise left
+// untagged, with that ICC profile, for applications rendering for a
+// calibrated display.
+static const char *const s_iccProfilePath = getenv("HDR_WSI_ICC_PROFILE");
+
+// xx-color-management-v4 allows at most 4 MiB, color-management-v1 more
+static constexpr uint32_t s_maxIccProfileSize = 4 << 20;
+
+// The profile is read once into a sealed memfd, which the ICC descriptions of
+// all displays are created from. Sending it only passes the fd, the compositor
+// maps the same memory.
+class IccProfile
+{
+public:
+    ~IccProfile()
+    {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    // Returns the memfd, or -1 without a usable profile. Loads the profile on
+    // first use.
+    int Fd()
+    {
+        std::call_once(m_loaded, [this] {
+            Load();
+        });
+        return m_fd;
+    }
+
+    // valid once Fd returned the memfd
+    uint32_t Size() const
+    {
+        return m_size;
+    }
+
+private:
+    void Load()
+    {
+        if (!s_iccProfilePath || !*s_iccProfilePath) {
+            return;
+        }
+        int file = open(s_iccProfilePath, O_RDONLY | O_CLOEXEC);
+        if (file < 0) {
+            Log(LOG_ERROR, "can't open the ICC profile %s", s_iccProfilePath);
+            return;
+        }
+        struct stat info;
+        if (fstat(file, &info) != 0 || info.st_size <= 0 || info.st_size > s_maxIccProfileSize) {
+            Log(LOG_ERROR, "the ICC profile %s is empty or larger than %u bytes", s_iccProfilePath, s_maxIccProfileSize);
+            close(file);
+            return;
+        }
+
+        std::vector<std::byte> data(size_t(info.st_size));
+        const bool read = ReadAll(file, data);
+        close(file);
+        if (!read) {
+            Log(LOG_ERROR, "can't read the ICC profile %s", s_iccProfilePath);
+            return;
+        }
+
+        int fd = memfd_create("hdr-wsi-icc-profile", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0 || !WriteAll(fd, data)
+            || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            Log(LOG_ERROR, "can't create a sealed memfd for the ICC profile");
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        m_fd = fd;
+        m_size = uint32_t(data.size());
+        Log(LOG_INFO, "tagging sRGB swapchains with the ICC profile %s", s_iccProfilePath);
+    }
+
+    static bool ReadAll(int fd, std::span<std::byte> data)
+    {
+        while (!data.empty()) {
+            const ssize_t count = read(fd, data.data(), data.size());
+            if (count <= 0) {
+                return false;
+            }
+            data = data.subspan(size_t(count));
+        }
+        return true;
+    }
+
+    static bool WriteAll(int fd, std::span<const std::byte> data)
+    {
+        while (!data.empty()) {
+            const ssize_t count = write(fd, data.data(), data.size());
+            if (count <= 0) {
+                return false;
+            }
+            data = data.subspan(size_t(count));
+        }
+        return true;
+    }
+
+    std::once_flag m_loaded;
+    int m_fd = -1;
+    uint32_t m_size = 0;
+};
+
+static IccProfile s_iccProfile;
+
+enum DescStatus {
+    WAITING,
+    READY,
+    FAILED,
+};
+
+// Everything that makes up a parametric image description, in protocol units.
+// This is the key of the per-display image description cache.
+struct ImageDescriptionParams {
+    uint32_t primaries;
+    uint32_t transferFunction;
+    uint32_t maxCll;
+    uint32_t maxFall;
+    bool hasMastering;
+    std::array<int32_t, 8> masteringPrimaries;
+    uint32_t masteringMinLuminance;
+    uint32_t masteringMaxLuminance;
+    bool hasLuminances;
+    uint32_t minLuminance;
+    uint32_t maxLuminance;
+    uint32_t referenceLuminance;
+    // set_primaries with these instead of the named primaries
+    bool customPrimaries;
+    std::array<int32_t, 8> primaryValues;
+    // set_tf_power with this exponent × 10000 instead of the named transfer
+    // function, if non-zero
+    uint32_t tfPower;
+    // the compositor's scRGB description, or one of the ICC profile,
+    // everything else is unused
+    bool windowsScrgb;
+    bool icc;
+
+    bool operator==(const ImageDescriptionParams &other) const = default;
+};
+
+struct CachedImageDescription {
+    ImageDescriptionParams params;
+    DescStatus status;
+    xx_image_description_v4 *xxDescription;
+    wp_image_description_v1 *description;
+};
+
+// Games usually only switch between a handful of metadata sets
+static constexpr size_t s_maxCachedImageDescriptions = 16;
+
+static void DestroyImageDescription(const CachedImageDescription &entry)
+{
+    if (entry.xxDescription) {
+        xx_image_description_v4_destroy(entry.xxDescription);
+        CountRequests();
+    }
+    if (entry.description) {
+        wp_image_description_v1_destroy(entry.description);
+        CountRequests();
+    }
+}
+
+// Features, primaries and transfer functions announced by a color manager.
+// All protocol enums are small, unknown (future) values are ignored.
+using CapabilitySet = std::bitset<32>;
+
+static void AddCapability(CapabilitySet &capabilities, uint32_t value)
+{
+    if (value < capabilities.size()) {
+        capabilities[value] = true;
+    }
+}
+
+// Threading model: every display, surface and swapchain entry has its own
+// lock, taken by the HandleTable lookups, so work on different objects runs
+// concurrently. Nested locks are taken in the order swapchain, surface,
+// display.
+// - Swapchain: everything in HdrSwapchainData, SetHdrMetadataEXT and
+//   QueuePresentKHR on the same swapchain serialize on it.
+// - Surface: initialization and the format cache. The fields a present uses
+//   (display, hdrDisplay, colorSurface) are fixed once the surface is
+//   initialized, so presents read them through HdrSwapchainData::hdrSurface
+//   without locking.
+// - Display: the event queue, the capabilities and the description cache.
+//   Listeners run while it's held, but waiting for the compositor happens
+//   without it, see DispatchQueueTimeout.
+// Presents that change nothing take neither the surface's nor the display's
+// lock: they only compare serials, see UpdatePreferred.
+
+// A counter bumped under an object's lock and compared without it. Copies
+// take the current value, so the objects holding one stay movable.
+class Serial
+{
+public:
+    Serial() = default;
+    Serial(const Serial &other)
+        : m_value{other.load()}
+    {
+    }
+    Serial &operator=(const Serial &other)
+    {
+        m_value.store(other.load(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    uint32_t load() const { return m_value.load(std::memory_order_acquire); }
+    void bump() { m_value.fetch_add(1, std::memory_order_release); }
+
+private:
+    std::atomic<uint32_t> m_value = 0;
+};
+
+// The info events of a description the compositor prefers, until `done`.
+// Chromaticities are CIE xy (red, green, blue, white), luminances in cd/m².
+struct PreferredInfo {
+    // of the description, see PreferredSnapshot
+    uint32_t identity;
+    std::array<float, 8> primaries;
+    std::array<float, 8> targetPrimaries;
+    bool hasTargetPrimaries;
+    float minLuminance;
+    float maxLuminance;
+    float targetMinLuminance;
+    float targetMaxLuminance;
+    bool hasTargetLuminance;
+    float targetMaxCll;
+    float targetMaxFall;
+};
+
+// A running read of an image description the compositor sent: wait for it to
+// be ready, then read it with get_information. Only the objects of the
+// surface's (or output's) protocol are used.
+struct DescriptionQuery {
+    xx_image_description_v4 *xxDescription = nullptr;
+    xx_image_description_info_v4 *xxInfo = nullptr;
+    wp_image_description_v1 *description = nullptr;
+    wp_image_description_info_v1 *info = nullptr;
+    PreferredInfo pending;
+};
+
+// A description the compositor preferred, as HDR metadata. The identity of a
+// description only changes with its contents, so the same one doesn't have
+// to be read again when a surface moves back to an output it was on before,
+// or when another surface moves there.
+struct PreferredSnapshot {
+    uint32_t identity;
+    VkHdrMetadataEXT metadata;
+};
+
+// Most setups have a few outputs, each with its own description
+static constexpr size_t s_maxPreferredSnapshots = 8;
+
+struct HdrDisplayData;
+
+// An output whose description is read into the snapshots as soon as it
+// changes, so surfaces moving there find it without a roundtrip. Guarded by
+// the display's lock.
+struct OutputData {
+    HdrDisplayData *hdrDisplay;
+    // of the wl_output global
+    uint32_t name;
+    wl_output *output;
+    xx_color_management_output_v4 *xxColorOutput = nullptr;
+    wp_color_management_output_v1 *colorOutput = nullptr;
+    DescriptionQuery query;
+};
+
+// Color management globals and capabilities are per wl_display, so they are
+// bound once and shared between all surfaces (and VkInstances) using it.
+struct HdrDisplayData {
+    uint32_t refCount = 0;
+
+    wl_event_queue *queue = nullptr;
+    wl_display *displayWrapper = nullptr;
+    wl_registry *registry = nullptr;
+    wl_callback *probeCallback = nullptr;
+    bool probed = false;
+    std::chrono::steady_clock::time_point probeStart;
+    // start of the probe's current roundtrip, for tracing
+    std::chrono::steady_clock::time_point roundtripStart;
+
+    frog_color_management_factory_v1 *frogColorManagement = nullptr;
+    xx_color_manager_v4 *xxColorManager = nullptr;
+    wp_color_manager_v1 *colorManager = nullptr;
+
+    // indexed by the protocol's enum values
+    CapabilitySet xxSupportedFeatures;
+    CapabilitySet xxSupportedPrimaries;
+    CapabilitySet xxSupportedTransferFunctions;
+
+    CapabilitySet supportedFeatures;
+    CapabilitySet supportedPrimaries;
+    CapabilitySet supportedTransferFunctions;
+    // bumped whenever the compositor announces a capability, read without
+    // the display's lock to validate the surface format caches
+    Serial capabilitiesSerial;
+
+    // most recently used first
+    std::list<CachedImageDescription> imageDescriptions;
+    std::list<PreferredSnapshot> preferredSnapshots;
+
+    // The outputs are tracked with the backend's protocol, so the registry
+    // stays bound after the probe if one is used, see TracksOutputs.
+    std::list<OutputData> outputs;
+};
+using HdrDisplay = HandleTable<wl_display *, HdrDisplayData>;
+
+struct SurfaceFormatCache {
+    VkPhysicalDevice physicalDevice;
+    uint32_t capabilitiesSerial;
+    bool supportsPassthrough;
+    // the driver's formats, followed by the HDR formats added by the layer
+    std::vector<VkSurfaceFormatKHR> formats;
+    size_t driverFormatCount;
+};
+
+using AnyColorSurface = std::variant<
+    std::monostate,
+    frog_color_managed_surface *,
+    xx_color_management_surface_v4 *,
+    wp_color_management_surface_v1 *>;
+
+struct HdrSurfaceData {
+    VkInstance instance;
+    std::vector<SurfaceFormatCache> formatCache;
+
+    wl_display *display;
+    // nullptr once the compositor turned out to lack color management
+    HdrDisplayData *hdrDisplay;
+    bool initialized = false;
+
+    wl_surface *surface;
+    // the object of the protocol the surface's backend uses
+    AnyColorSurface colorSurface;
+    // whether the backend reports the compositor's preferred description,
+    // fixed once the surface is initialized
+    bool tracksPreferred = false;
+
+    // The compositor's preferred description as HDR metadata, and a serial
+    // bumped when it changes. Written by the protocol's listeners, so these
+    // and the objects of the running query are guarded by the display's lock,
+    // only the serial can be compared without it.
+    std::optional<VkHdrMetadataEXT> preferredMetadata;
+    Serial preferredSerial;
+    xx_color_management_feedback_surface_v4 *xxFeedback = nullptr;
+    wp_color_management_surface_feedback_v1 *feedback = nullptr;
+    DescriptionQuery query;
+};
+using HdrSurface = HandleTable<VkSurfaceKHR, HdrSurfaceData>;
+
+static VkHdrMetadataEXT MakePreferredMetadata(const std::array<float, 8> &primaries, float minLuminance, float maxLuminance, float maxCll, float maxFall)
+{
+    return VkHdrMetadataEXT{
+        .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+        .displayPrimaryRed = {primaries[0], primaries[1]},
+        .displayPrimaryGreen = {primaries[2], primaries[3]},
+        .displayPrimaryBlue = {primaries[4], primaries[5]},
+        .whitePoint = {primaries[6], primaries[7]},
+        .maxLuminance = maxLuminance,
+        .minLuminance = minLuminance,
+        .maxContentLightLevel = maxCll > 0.0f ? maxCll : maxLuminance,
+        .maxFrameAverageLightLevel = maxFall > 0.0f ? maxFall : maxLuminance,
+    };
+}
+
+// Called with the display locked.
+static void SetPreferredMetadata(HdrSurfaceData *hdrSurface, const VkHdrMetadataEXT &metadata)
+{
+    hdrSurface->preferredMetadata = metadata;
+    hdrSurface->preferredSerial.bump();
+    Log(LOG_DEBUG, "compositor prefers luminance %f - %f nits, MaxCLL %f nits, MaxFALL %f nits",
+        metadata.minLuminance, metadata.maxLuminance, metadata.maxContentLightLevel, metadata.maxFrameAverageLightLevel);
+}
+
+// Called with the display locked. Returns nullptr for unknown descriptions.
+static const VkHdrMetadataEXT *FindPreferredSnapshot(HdrDisplayData *hdrDisplay, uint32_t identity)
+{
+    auto &snapshots = hdrDisplay->preferredSnapshots;
+    auto it = std::ranges::find(snapshots, identity, &PreferredSnapshot::identity);
+    if (it == snapshots.end()) {
+        return nullptr;
+    }
+    snapshots.splice(snapshots.begin(), snapshots, it);
+    return &snapshots.front().metadata;
+}
+
+// Called with the display locked.
+static void StorePreferredSnapshot(HdrDisplayData *hdrDisplay, uint32_t identity, const VkHdrMetadataEXT &metadata)
+{
+    if (FindPreferredSnapshot(hdrDisplay, identity)) {
+        return;
+    }
+    auto &snapshots = hdrDisplay->preferredSnapshots;
+    snapshots.push_front(PreferredSnapshot{identity, metadata});
+    if (snapshots.size() > s_maxPreferredSnapshots) {
+        snapshots.pop_back();
+    }
+}
+
+static constexpr xx_image_description_v4_listener s_xxImageDescriptionListener {
+    .failed = [](void *userData, xx_image_description_v4 *descr, uint32_t cause, const char *reason) {
+        Log(LOG_ERROR, "creating image description failed! %s", reason);
+        *reinterpret_cast<DescStatus *>(userData) = FAILED;
+    },
+    .ready = [](void *userData, xx_image_description_v4 *descr, uint32_t id) {
+        *reinterpret_cast<DescStatus *>(userData) = READY;
+    },
+};
+static constexpr wp_image_description_v1_listener s_imageDescriptionListener {
+    .failed = [](void *userData, wp_image_description_v1 *descr, uint32_t cause, const char *reason) {
+        Log(LOG_ERROR, "creating image description failed! %s", reason);
+        *reinterpret_cast<DescStatus *>(userData) = FAILED;
+    },
+    .ready = [](void *userData, wp_image_description_v1 *descr, uint32_t id) {
+        *reinterpret_cast<DescStatus *>(userData) = READY;
+    },
+};
+
+// The parametric color management protocols. xx-color-management-v4 is the
+// experimental version of color-management-v1, so both are driven by the same
+// code, with the protocol specific names, units and objects looked up here.
+struct XxColorManagement {
+    using ColorSurface = xx_color_management_surface_v4;
+    using Primaries = xx_color_manager_v4_primaries;
+    using TransferFunction = xx_color_manager_v4_transfer_function;
+
+    static constexpr auto manager = &HdrDisplayData::xxColorManager;
+    static constexpr auto supportedFeatures = &HdrDisplayData::xxSupportedFeatures;
+    static constexpr auto supportedPrimaries = &HdrDisplayData::xxSupportedPrimaries;
+    static constexpr auto supportedTransferFunctions = &HdrDisplayData::xxSupportedTransferFunctions;
+    static constexpr auto formatPrimaries = &ColorDescription::xxPrimaries;
+    static constexpr auto formatTransferFunction = &ColorDescription::xxTransferFunction;
+    static constexpr auto description = &CachedImageDescription::xxDescription;
+
+    static constexpr uint32_t featureParametric = XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC;
+    static constexpr uint32_t featureIcc = XX_COLOR_MANAGER_V4_FEATURE_ICC_V2_V4;
+    static constexpr uint32_t featureMasteringPrimaries = XX_COLOR_MANAGER_V4_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES;
+    static constexpr uint32_t featureLuminances = XX_COLOR_MANAGER_V4_FEATURE_SET_LUMINANCES;
+    static constexpr uint32_t featureSetPrimaries = XX_COLOR_MANAGER_V4_FEATURE_SET_PRIMARIES;
+    static constexpr uint32_t featureSetTfPower = XX_COLOR_MANAGER_V4_FEATURE_SET_TF_POWER;
+    static constexpr uint32_t featureExtendedTargetVolume = XX_COLOR_MANAGER_V4_FEATURE_EXTENDED_TARGET_VOLUME;
+    static constexpr bool hasWindowsScrgb = false;
+    static constexpr uint32_t renderIntent = XX_COLOR_MANAGER_V4_RENDER_INTENT_PERCEPTUAL;
+    static constexpr double primaryUnit = 10'000.0;
+    static constexpr const char *name = "xx-color-management-v4";
+
+    static constexpr auto getSurface = xx_color_manager_v4_get_surface;
+    static constexpr auto destroySurface = xx_color_management_surface_v4_destroy;
+    static constexpr auto setImageDescription = xx_color_management_surface_v4_set_image_description;
+    static constexpr auto unsetImageDescription = xx_color_management_surface_v4_unset_image_description;
+
+    static constexpr auto createParametricCreator = xx_color_manager_v4_new_parametric_creator;
+    static constexpr auto setPrimariesNamed = xx_image_description_creator_params_v4_set_primaries_named;
+    static constexpr auto setTfNamed = xx_image_description_creator_params_v4_set_tf_named;
+    static constexpr auto setPrimaries = xx_image_description_creator_params_v4_set_primaries;
+    static constexpr auto setTfPower = xx_image_description_creator_params_v4_set_tf_power;
+    static constexpr auto createIccCreator = xx_color_manager_v4_new_icc_creator;
+    static constexpr auto setIccFile = xx_image_description_creator_icc_v4_set_icc_file;
+    static constexpr auto createIcc = xx_image_description_creator_icc_v4_create;
+    static constexpr auto setMaxFall = xx_image_description_creator_params_v4_set_max_fall;
+    static constexpr auto setMaxCll = xx_image_description_creator_params_v4_set_max_cll;
+    static constexpr auto setMasteringLuminance = xx_image_description_creator_params_v4_set_mastering_luminance;
+    static constexpr auto setMasteringDisplayPrimaries = xx_image_description_creator_params_v4_set_mastering_display_primaries;
+    static constexpr auto setLuminances = xx_image_description_creator_params_v4_set_luminances;
+    static constexpr auto create = xx_image_description_creator_params_v4_create;
+    static constexpr auto addListener = xx_image_description_v4_add_listener;
+    static constexpr auto listener = &s_xxImageDescriptionListener;
+
+    using FeedbackListener = xx_color_management_feedback_surface_v4_listener;
+    using DescriptionListener = xx_image_description_v4_listener;
+    using InfoListener = xx_image_description_info_v4_listener;
+    static constexpr auto feedback = &HdrSurfaceData::xxFeedback;
+    static constexpr auto queryDescription = &DescriptionQuery::xxDescription;
+    static constexpr auto queryInfo = &DescriptionQuery::xxInfo;
+    static constexpr auto getFeedback = xx_color_manager_v4_get_feedback_surface;
+    static constexpr auto destroyFeedback = xx_color_management_feedback_surface_v4_destroy;
+    static constexpr auto addFeedbackListener = xx_color_management_feedback_surface_v4_add_listener;
+    static constexpr auto getPreferred = xx_color_management_feedback_surface_v4_get_preferred;
+    static constexpr auto destroyDescription = xx_image_description_v4_destroy;
+    static constexpr auto getInformation = xx_image_description_v4_get_information;
+    static constexpr auto addInfoListener = xx_image_description_info_v4_add_listener;
+    static constexpr auto destroyInfo = xx_image_description_info_v4_destroy;
+
+    using OutputListener = xx_color_management_output_v4_listener;
+    static constexpr auto colorOutput = &OutputData::xxColorOutput;
+    static constexpr auto getOutput = xx_color_manager_v4_get_output;
+    static constexpr auto destroyOutput = xx_color_management_output_v4_destroy;
+    static constexpr auto addOutputListener = xx_color_management_output_v4_add_listener;
+    static constexpr auto getOutputDescription = xx_color_management_output_v4_get_image_description;
+};
+
+struct WpColorManagement {
+    using ColorSurface = wp_color_management_surface_v1;
+    using Primaries = wp_color_manager_v1_primaries;
+    using TransferFunction = wp_color_manager_v1_transfer_function;
+
+    static constexpr auto manager = &HdrDisplayData::colorManager;
+    static constexpr auto supportedFeatures = &HdrDisplayData::supportedFeatures;
+    static constexpr auto supportedPrimaries = &HdrDisplayData::supportedPrimaries;
+    static constexpr auto supportedTransferFunctions = &HdrDisplayData::supportedTransferFunctions;
+    static constexpr auto formatPrimaries = &ColorDescription::primaries;
+    static constexpr auto formatTransferFunction = &ColorDescription::transferFunction;
+    static constexpr auto description = &CachedImageDescription::description;
+
+    static constexpr uint32_t featureParametric = WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC;
+    static constexpr uint32_t featureIcc = WP_COLOR_MANAGER_V1_FEATURE_ICC_V2_V4;
+    static constexpr uint32_t featureMasteringPrimaries = WP_COLOR_MANAGER_V1_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES;
+    static constexpr uint32_t featureLuminances = WP_COLOR_MANAGER_V1_FEATURE_SET_LUMINANCES;
+    static constexpr uint32_t featureSetPrimaries = WP_COLOR_MANAGER_V1_FEATURE_SET_PRIMARIES;
+    static constexpr uint32_t featureSetTfPower = WP_COLOR_MANAGER_V1_FEATURE_SET_TF_POWER;
+    static constexpr uint32_t featureExtendedTargetVolume = WP_COLOR_MANAGER_V1_FEATURE_EXTENDED_TARGET_VOLUME;
+    static constexpr bool hasWindowsScrgb = true;
+    static constexpr uint32_t featureWindowsScrgb = WP_COLOR_MANAGER_V1_FEATURE_WINDOWS_SCRGB;
+    static constexpr uint32_t renderIntent = WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL;
+    static constexpr double primaryUnit = 1'000'000.0;
+    static constexpr const char *name = "color-management-v1";
+
+    static constexpr auto getSurface = wp_color_manager_v1_get_surface;
+    static constexpr auto destroySurface = wp_color_management_surface_v1_destroy;
+    static constexpr auto setImageDescription = wp_color_management_surface_v1_set_image_description;
+    static constexpr auto unsetImageDescription = wp_color_management_surface_v1_unset_image_description;
+
+    static constexpr auto createParametricCreator = wp_color_manager_v1_create_parametric_creator;
+    static constexpr auto setPrimariesNamed = wp_image_description_creator_params_v1_set_primaries_named;
+    static constexpr auto setTfNamed = wp_image_description_creator_params_v1_set_tf_named;
+    static constexpr auto setPrimaries = wp_image_description_creator_params_v1_set_primaries;
+    static constexpr auto setTfPower = wp_image_description_creator_params_v1_set_tf_power;
+    static constexpr auto createIccCreator = wp_color_manager_v1_create_icc_creator;
+    static constexpr auto setIccFile = wp_image_description_creator_icc_v1_set_icc_file;
+    static constexpr auto createIcc = wp_image_description_creator_icc_v1_create;
+    static constexpr auto setMaxFall = wp_image_description_creator_params_v1_set_max_fall;
+    static constexpr auto setMaxCll = wp_image_description_creator_params_v1_set_max_cll;
+    static constexpr auto setMasteringLuminance = wp_image_description_creator_params_v1_set_mastering_luminance;
+    static constexpr auto setMasteringDisplayPrimaries = wp_image_description_creator_params_v1_set_mastering_display_primaries;
+    static constexpr auto setLuminances = wp_image_description_creator_params_v1_set_luminances;
+    static constexpr auto create = wp_image_description_creator_params_v1_create;
+    static constexpr auto createWindowsScrgb = wp_color_manager_v1_create_windows_scrgb;
+    static constexpr auto addListener = wp_image_description_v1_add_listener;
+    static constexpr auto listener = &s_imageDescriptionListener;
+
+    using FeedbackListener = wp_color_management_surface_feedback_v1_listener;
+    using DescriptionListener = wp_image_description_v1_listener;
+    using InfoListener = wp_image_description_info_v1_listener;
+    static constexpr auto feedback = &HdrSurfaceData::feedback;
+    static constexpr auto queryDescription = &DescriptionQuery::description;
+    static constexpr auto queryInfo = &DescriptionQuery::info;
+    static constexpr auto getFeedback = wp_color_manager_v1_get_surface_feedback;
+    static constexpr auto destroyFeedback = wp_color_management_surface_feedback_v1_destroy;
+    static constexpr auto addFeedbackListener = wp_color_management_surface_feedback_v1_add_listener;
+    // the backend only handles parametric descriptions
+    static constexpr auto getPreferred = wp_color_management_surface_feedback_v1_get_preferred_parametric;
+    static constexpr auto destroyDescription = wp_image_description_v1_destroy;
+    static constexpr auto getInformation = wp_image_description_v1_get_information;
+    static constexpr auto addInfoListener = wp_image_description_info_v1_add_listener;
+    static constexpr auto destroyInfo = wp_image_description_info_v1_destroy;
+
+    using OutputListener = wp_color_management_output_v1_listener;
+    static constexpr auto colorOutput = &OutputData::colorOutput;
+    static constexpr auto getOutput = wp_color_manager_v1_get_output;
+    static constexpr auto destroyOutput = wp_color_management_output_v1_destroy;
+    static constexpr auto addOutputListener = wp_color_management_output_v1_add_listener;
+    static constexpr auto getOutputDescription = wp_color_management_output_v1_get_image_description;
+};
+
+static ImageDescriptionParams MakeImageDescriptionParams(
+    uint32_t primaries,
+    uint32_t transferFunction,
+    const VkHdrMetadataEXT &metadata,
+    double primaryUnit,
+    bool hasMastering,
+    bool hasLuminances)
+{
+    const auto primary = [primaryUnit](float value) {
+        return int32_t(std::round(value * primaryUnit));
+    };
+
+    // Zeroed metadata, as before the application set any, leaves out the
+    // metadata so it's the base description for the primaries and TF.
+    ImageDescriptionParams params = {
+        .primaries = primaries,
+        .transferFunction = transferFunction,
+        .maxCll = uint32_t(std::round(metadata.maxContentLightLevel)),
+        .maxFall = uint32_t(std::round(metadata.maxFrameAverageLightLevel)),
+    };
+    if (hasMastering && metadata.maxLuminance > metadata.minLuminance) {
+        params.hasMastering = true;
+        params.masteringPrimaries = {
+            primary(metadata.displayPrimaryRed.x),
+            primary(metadata.displayPrimaryRed.y),
+            primary(metadata.displayPrimaryGreen.x),
+            primary(metadata.displayPrimaryGreen.y),
+            primary(metadata.displayPrimaryBlue.x),
+            primary(metadata.displayPrimaryBlue.y),
+            primary(metadata.whitePoint.x),
+            primary(metadata.whitePoint.y),
+        };
+        params.masteringMinLuminance = uint32_t(std::round(metadata.minLuminance * 10'000.0));
+        params.masteringMaxLuminance = uint32_t(std::round(metadata.maxLuminance));
+    }
+    if (hasLuminances) {
+        // NOTE that this assumes that this is Windows-style scRGB
+        params.hasLuminances = true;
+        params.minLuminance = 0;
+        params.maxLuminance = 80;
+        params.referenceLuminance = 203;
+    }
+    return params;
+}
+
+template <typename Protocol>
+static void CreateImageDescription(HdrDisplayData *hdrDisplay, CachedImageDescription &entry)
+{
+    const ImageDescriptionParams &params = entry.params;
+    if (params.icc) {
+        const auto creator = Protocol::createIccCreator(hdrDisplay->*Protocol::manager);
+        Protocol::setIccFile(creator, s_iccProfile.Fd(), 0, s_iccProfile.Size());
+        entry.*Protocol::description = Protocol::createIcc(creator);
+        Protocol::addListener(entry.*Protocol::description, Protocol::listener, &entry.status);
+        CountRequests(3);
+        return;
+    }
+    if constexpr (Protocol::hasWindowsScrgb) {
+        if (params.windowsScrgb) {
+            entry.*Protocol::description = Protocol::createWindowsScrgb(hdrDisplay->*Protocol::manager);
+            Protocol::addListener(entry.*Protocol::description, Protocol::listener, &entry.status);
+            CountRequests();
+            return;
+        }
+    }
+
+    const auto &mastering = params.masteringPrimaries;
+    // creator, primaries, transfer function and create
+    uint32_t requests = 4;
+    const auto creator = Protocol::createParametricCreator(hdrDisplay->*Protocol::manager);
+    if (params.customPrimaries) {
+        const auto &primaries = params.primaryValues;
+        Protocol::setPrimaries(creator,
+                               primaries[0], primaries[1],
+                               primaries[2], primaries[3],
+                               primaries[4], primaries[5],
+                               primaries[6], primaries[7]);
+    } else {
+        Protocol::setPrimariesNamed(creator, params.primaries);
+    }
+    if (params.tfPower) {
+        Protocol::setTfPower(creator, params.tfPower);
+    } else {
+        Protocol::setTfNamed(creator, params.transferFunction);
+    }
+    if (params.maxFall) {
+        Protocol::setMaxFall(creator, params.maxFall);
+        requests++;
+    }
+    if (params.maxCll) {
+        Protocol::setMaxCll(creator, params.maxCll);
+        requests++;
+    }
+    if (params.hasMastering) {
+        requests += 2;
+        Protocol::setMasteringLuminance(creator, params.masteringMinLuminance, params.masteringMaxLuminance);
+        Protocol::setMasteringDisplayPrimaries(creator,
+                                               mastering[0], mastering[1],
+                                               mastering[2], mastering[3],
+                                               mastering[4], mastering[5],
+                                               mastering[6], mastering[7]);
+    }
+    if (params.hasLuminances) {
+        Protocol::setLuminances(creator, params.minLuminance, params.maxLuminance, params.referenceLuminance);
+        requests++;
+    }
+    entry.*Protocol::description = Protocol::create(creator);
+    Protocol::addListener(entry.*Protocol::description, Protocol::listener, &entry.status);
+    CountRequests(requests);
+}
+
+// Dispatches the events already sent by the compositor for the display's
+// queue, waiting at most timeout for new ones to arrive, or until they do if
+// timeout is negative. The display is only locked while dispatching, so
+// presents to other surfaces of it can go on while this one waits.
+static int DispatchQueueTimeout(wl_display *display, std::chrono::milliseconds timeout)
+{
+    wl_event_queue *queue;
+    {
+        auto hdrDisplay = HdrDisplay::get(display);
+        queue = hdrDisplay->queue;
+        while (wl_display_prepare_read_queue(display, queue) != 0) {
+            if (wl_display_dispatch_queue_pending(display, queue) < 0) {
+                return -1;
+            }
+        }
+    }
+    wl_display_flush(display);
+
+    pollfd pfd = {
+        .fd = wl_display_get_fd(display),
+        .events = POLLIN,
+    };
+    // a zero timeout only picks up what already arrived
+    if (timeout > 0ms) {
+        CountCompositorWait();
+    }
+    if (poll(&pfd, 1, int(timeout.count())) > 0) {
+        if (wl_display_read_events(display) < 0) {
+            return -1;
+        }
+    } else {
+        wl_display_cancel_read(display);
+    }
+
+    auto hdrDisplay = HdrDisplay::get(display);
+    return wl_display_dispatch_queue_pending(display, queue);
+}
+
+// Evicts the least recently used descriptions that aren't still waiting
+// for the compositor.
+static void TrimImageDescriptionCache(std::list<CachedImageDescription> &cache)
+{
+    auto it = cache.end();
+    while (cache.size() > s_maxCachedImageDescriptions && it != cache.begin()) {
+        --it;
+        // the scRGB and ICC descriptions are created once and used by all
+        // swapchains that can, see GetImageDescriptionParams
+        if (it->status != WAITING && !it->params.windowsScrgb && !it->params.icc) {
+            DestroyImageDescription(*it);
+            it = cache.erase(it);
+        }
+    }
+}
+
+// Returns the cache entry for params, moved to the front of the cache.
+// New descriptions are requested from the compositor without waiting for them,
+// and reported in created.
+static std::list<CachedImageDescription>::iterator FindOrCreateImageDescription(HdrDisplayData *hdrDisplay, const ImageDescriptionParams &params, bool *created = nullptr)
+{
+    auto &cache = hdrDisplay->imageDescriptions;
+
+    auto it = std::ranges::find(cache, params, &CachedImageDescription::params);
+    if (it != cache.end()) {
+        cache.splice(cache.begin(), cache, it);
+        return it;
+    }
+    if (created) {
+        *created = true;
+    }
+
+    it = cache.emplace(cache.begin(), CachedImageDescription{
+        .params = params,
+        .status = WAITING,
+    });
+    if (hdrDisplay->colorManager) {
+        CreateImageDescription<WpColorManagement>(hdrDisplay, *it);
+    } else {
+        CreateImageDescription<XxColorManagement>(hdrDisplay, *it);
+    }
+    TrimImageDescriptionCache(cache);
+    return it;
+}
+
+// A description change requested by a present, see QueuePresentKHR.
+struct PresentDescription {
+    VkSwapchainKHR swapchain;
+    wl_display *display;
+    ImageDescriptionParams params;
+    // sets the created description on the surface, see ParametricBackend
+    void (*setImageDescription)(HdrSurfaceData *hdrSurface, const CachedImageDescription &entry);
+};
+
+// Requests the description for params from the compositor, unless it's
+// already in the display's cache. Returns true if it wasn't.
+static bool RequestImageDescription(HdrSurfaceData *hdrSurface, const ImageDescriptionParams &params)
+{
+    auto hdrDisplay = HdrDisplay::get(hdrSurface->display);
+    bool created = false;
+    FindOrCreateImageDescription(hdrDisplay.get(), params, &created);
+    return created;
+}
+
+// Flushes the requests of all descriptions, once per display, and waits at
+// most maxWait for the compositor to answer all of them.
+static void WaitForImageDescriptions(std::span<const PresentDescription> descriptions, std::chrono::milliseconds maxWait)
+{
+    const auto deadline = std::chrono::steady_clock::now() + maxWait;
+    for (auto it = descriptions.begin(); it != descriptions.end(); ++it) {
+        wl_display *display = it->display;
+        const bool handled = std::any_of(descriptions.begin(), it, [display](const PresentDescription &description) {
+            return description.display == display;
+        });
+        if (handled) {
+            continue;
+        }
+
+        const auto isWaiting = [&descriptions, display]() {
+            auto hdrDisplay = HdrDisplay::get(display);
+            const auto &cache = hdrDisplay->imageDescriptions;
+            return std::ranges::any_of(descriptions, [display, &cache](const PresentDescription &description) {
+                if (description.display != display) {
+                    return false;
+                }
+                const auto entry = std::ranges::find(cache, description.params, &CachedImageDescription::params);
+                return entry != cache.end() && entry->status == WAITING;
+            });
+        };
+
+        wl_display_flush(display);
+        while (isWaiting()) {
+            const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (DispatchQueueTimeout(display, std::max(remaining, 0ms)) < 0
+                || std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+        }
+    }
+}
+
+// Sets the description for params on the surface if the compositor created it.
+// Returns WAITING if the surface has to keep its previous description for now.
+static DescStatus ApplyImageDescription(HdrSurfaceData *hdrSurface, const PresentDescription &description)
+{
+    auto hdrDisplay = HdrDisplay::get(hdrSurface->display);
+    auto &cache = hdrDisplay->imageDescriptions;
+
+    const auto it = std::ranges::find(cache, description.params, &CachedImageDescription::params);
+    if (it == cache.end()) {
+        // evicted in the meantime, the next present requests it again
+        return WAITING;
+    }
+
+    switch (it->status) {
+    case WAITING:
+        break;
+    case FAILED:
+        DestroyImageDescription(*it);
+        cache.erase(it);
+        return FAILED;
+    case READY:
+        description.setImageDescription(hdrSurface, *it);
+        break;
+    }
+    return it->status;
+}
+
+// Starts creating the description for params ahead of the first present
+// that needs it.
+static void PrewarmImageDescription(HdrSurfaceData *hdrSurface, const ImageDescriptionParams &params)
+{
+    auto hdrDisplay = HdrDisplay::get(hdrSurface->display);
+    FindOrCreateImageDescription(hdrDisplay.get(), params);
+    wl_display_flush(hdrSurface->display);
+}
+
+// Gives up on a description the compositor never answered for.
+static void DropImageDescription(HdrSurfaceData *hdrSurface, const ImageDescriptionParams &params)
+{
+    auto hdrDisplay = HdrDisplay::get(hdrSurface->display);
+    auto &cache = hdrDisplay->imageDescriptions;
+
+    const auto it = std::ranges::find(cache, params, &CachedImageDescription::params);
+    if (it != cache.end() && it->status == WAITING) {
+        DestroyImageDescription(*it);
+        cache.erase(it);
+    }
+}
+
+// Each color management protocol has a backend, chosen once per surface in
+// InitColorSurface, with the state its swapchains need. Backends provide:
+// - CreateColorSurface / DestroyColorSurface: the per-surface protocol object,
+//   and tracking the compositor's preferred description if it can
+// - SupportsFormat: whether a format of s_ExtraHDRSurfaceFormats can be exposed
+// - SupportsExtendedTargetVolume: whether mastering primaries may lie outside
+//   the swapchain's container primaries
+// - CreateSwapchainState: the swapchain state for a VkColorSpaceKHR
+// - Prewarm: starts creating what the first present will need
+// - UpdateDescription: sends the swapchain's color description on present,
+//   returns false if it needs an image description from the compositor first
+struct FrogBackend {
+    using ColorSurface = frog_color_managed_surface;
+    static constexpr const char *name = "frog-color-management-v1";
+
+    struct SwapchainState {
+        using Backend = FrogBackend;
+        frog_color_managed_surface_primaries primaries;
+        frog_color_managed_surface_transfer_function transferFunction;
+    };
+
+    static constexpr struct frog_color_managed_surface_listener color_surface_interface_listener {
+      .preferred_metadata = [](void *data,
+                               struct frog_color_managed_surface *frog_color_managed_surface,
+                               uint32_t transfer_function,
+                               uint32_t output_display_primary_red_x,
+                               uint32_t output_display_primary_red_y,
+                               uint32_t output_display_primary_green_x,
+                               uint32_t output_display_primary_green_y,
+                               uint32_t output_display_primary_blue_x,
+                               uint32_t output_display_primary_blue_y,
+                               uint32_t output_white_point_x,
+                               uint32_t output_white_point_y,
+                               uint32_t max_luminance,
+                               uint32_t min_luminance,
+                               uint32_t max_full_frame_luminance) {
+          const std::array<float, 8> primaries = {
+              float(output_display_primary_red_x / 10000.0),
+              float(output_display_primary_red_y / 10000.0),
+              float(output_display_primary_green_x / 10000.0),
+              float(output_display_primary_green_y / 10000.0),
+              float(output_display_primary_blue_x / 10000.0),
+              float(output_display_primary_blue_y / 10000.0),
+              float(output_white_point_x / 10000.0),
+              float(output_white_point_y / 10000.0),
+          };
+          SetPreferredMetadata(static_cast<HdrSurfaceData *>(data),
+                               MakePreferredMetadata(primaries, float(min_luminance / 10000.0), float(max_luminance), 0.0f, float(max_full_frame_luminance)));
+      },
+    };
+
+    static ColorSurface *CreateColorSurface(HdrSurfaceData *hdrSurface)
+    {
+        auto colorSurface = frog_color_management_factory_v1_get_color_managed_surface(hdrSurface->hdrDisplay->frogColorManagement, hdrSurface->surface);
+        frog_color_managed_surface_add_listener(colorSurface, &color_surface_interface_listener, hdrSurface);
+        CountRequests();
+        hdrSurface->tracksPreferred = true;
+        wl_display_flush(hdrSurface->display);
+        return colorSurface;
+    }
+
+    static void DestroyColorSurface(HdrSurfaceData *hdrSurface)
+    {
+        frog_color_managed_surface_destroy(std::get<ColorSurface *>(hdrSurface->colorSurface));
+        CountRequests();
+    }
+
+    static bool SupportsFormat(const HdrDisplayData *hdrDisplay, const ColorDescription &desc)
+    {
+        return desc.frogPrimaries != FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED
+            && desc.frogTransferFunction != FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED;
+    }
+
+    static bool SupportsExtendedTargetVolume(const HdrDisplayData *hdrDisplay)
+    {
+        return false;
+    }
+
+    static SwapchainState CreateSwapchainState(VkColorSpaceKHR colorSpace)
+    {
+        // alpha mode is ignored
+        if (const ColorDescription *desc = FindColorDescription(colorSpace)) {
+            return SwapchainState{
+                .primaries = desc->frogPrimaries,
+                .transferFunction = desc->frogTransferFunction,
+            };
+        }
+        if (colorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+            Log(LOG_WARNING, "Unknown color space, assuming untagged");
+        }
+        return SwapchainState{
+            .primaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED,
+            .transferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED,
+        };
+    }
+
+    static void Prewarm(HdrSurfaceData *hdrSurface, const SwapchainState &state, const VkHdrMetadataEXT &metadata)
+    {
+    }
+
+    static bool UpdateDescription(HdrSurfaceData *hdrSurface, const SwapchainState &state, const VkHdrMetadataEXT &metadata, PresentDescription &description)
+    {
+        auto colorSurface = std::get<ColorSurface *>(hdrSurface->colorSurface);
+        frog_color_managed_surface_set_known_container_color_volume(colorSurface, state.primaries);
+        frog_color_managed_surface_set_known_transfer_function(colorSurface, state.transferFunction);
+        frog_color_managed_surface_set_hdr_metadata(colorSurface,
+                                                    uint32_t(round(metadata.displayPrimaryRed.x * 10000.0)),
+                                                    uint32_t(round(metadata.displayPrimaryRed.y * 10000.0)),
+                                                    uint32_t(round(metadata.displayPrimaryGreen.x * 10000.0)),
+                                                    uint32_t(round(metadata.displayPrimaryGreen.y * 10000.0)),
+                                                    uint32_t(round(metadata.displayPrimaryBlue.x * 10000.0)),
+                                                    uint32_t(round(metadata.displayPrimaryBlue.y * 10000.0)),
+                                                    uint32_t(round(metadata.whitePoint.x * 10000.0)),
+                                                    uint32_t(round(metadata.whitePoint.y * 10000.0)),
+                                                    uint32_t(round(metadata.maxLuminance)),
+                                                    uint32_t(round(metadata.minLuminance * 10000.0)),
+                                                    uint32_t(round(metadata.maxContentLightLevel)),
+                                                    uint32_t(round(metadata.maxFrameAverageLightLevel)));
+        CountRequests(3);
+        return true;
+    }
+};
+
+template <typename Protocol>
+struct ParametricBackend {
+    using ColorSurface = typename Protocol::ColorSurface;
+    static constexpr const char *name = Protocol::name;
+
+    struct SwapchainState {
+        using Backend = ParametricBackend;
+        typename Protocol::Primaries primaries;
+        typename Protocol::TransferFunction transferFunction;
+        // nullptr if untagged
+        const ColorDescription *desc;
+        bool untagged;
+        // untagged sRGB, which gets the ICC profile if there's one
+        bool srgb;
+    };
+
+    // The preferred description is queried with a feedback surface: on each
+    // preferred_changed, get the description, wait for it to be ready and read
+    // it with get_information. The outputs' descriptions are read the same
+    // way whenever they change. Every description read is kept in the
+    // display's snapshots, so a surface moving to an output that was seen
+    // before is retagged without a query, as compositors usually prefer the
+    // description of the surface's primary output.
+    // The listeners run with the display locked.
+    static std::array<float, 8> ToChromaticities(std::array<int32_t, 8> values)
+    {
+        std::array<float, 8> chromaticities;
+        std::ranges::transform(values, chromaticities.begin(), [](int32_t value) {
+            return float(value / Protocol::primaryUnit);
+        });
+        return chromaticities;
+    }
+
+    // Owner is the HdrSurfaceData or OutputData whose query this is.
+    template <typename Owner>
+    static constexpr typename Protocol::InfoListener s_infoListener = {
+        .done = [](void *data, auto *) {
+            auto owner = static_cast<Owner *>(data);
+            DescriptionQuery &query = owner->query;
+            // done is a destructor event, the info object is gone
+            Protocol::destroyInfo(std::exchange(query.*Protocol::queryInfo, nullptr));
+            Protocol::destroyDescription(std::exchange(query.*Protocol::queryDescription, nullptr));
+            CountRequests();
+
+            const PreferredInfo &info = query.pending;
+            const VkHdrMetadataEXT metadata = MakePreferredMetadata(
+                info.hasTargetPrimaries ? info.targetPrimaries : info.primaries,
+                info.hasTargetLuminance ? info.targetMinLuminance : info.minLuminance,
+                info.hasTargetLuminance ? info.targetMaxLuminance : info.maxLuminance,
+                info.targetMaxCll,
+                info.targetMaxFall);
+            // ICC based output descriptions carry no luminances
+            if (metadata.maxLuminance > 0.0f) {
+                StorePreferredSnapshot(owner->hdrDisplay, info.identity, metadata);
+            }
+            if constexpr (std::is_same_v<Owner, HdrSurfaceData>) {
+                SetPreferredMetadata(owner, metadata);
+            }
+        },
+        .icc_file = [](void *, auto *, int32_t icc, uint32_t) {
+            close(icc);
+        },
+        .primaries = [](void *data, auto *, int32_t r_x, int32_t r_y, int32_t g_x, int32_t g_y, int32_t b_x, int32_t b_y, int32_t w_x, int32_t w_y) {
+            static_cast<Owner *>(data)->query.pending.primaries = ToChromaticities({r_x, r_y, g_x, g_y, b_x, b_y, w_x, w_y});
+        },
+        .primaries_named = [](void *, auto *, uint32_t) {},
+        .tf_power = [](void *, auto *, uint32_t) {},
+        .tf_named = [](void *, auto *, uint32_t) {},
+        .luminances = [](void *data, auto *, uint32_t min_lum, uint32_t max_lum, uint32_t reference_lum) {
+            auto &info = static_cast<Owner *>(data)->query.pending;
+            info.minLuminance = float(min_lum / 10000.0);
+            info.maxLuminance = float(max_lum);
+        },
+        .target_primaries = [](void *data, auto *, int32_t r_x, int32_t r_y, int32_t g_x, int32_t g_y, int32_t b_x, int32_t b_y, int32_t w_x, int32_t w_y) {
+            auto &info = static_cast<Owner *>(data)->query.pending;
+            info.targetPrimaries = ToChromaticities({r_x, r_y, g_x, g_y, b_x, b_y, w_x, w_y});
+            info.hasTargetPrimaries = true;
+        },
+        .target_luminance = [](void *data, auto *, uint32_t min_lum, uint32_t max_lum) {
+            auto &info = static_cast<Owner *>(data)->query.pending;
+            info.targetMinLuminance = float(min_lum / 10000.0);
+            info.targetMaxLuminance = float(max_lum);
+            info.hasTargetLuminance = true;
+        },
+        .target_max_cll = [](void *data, auto *, uint32_t max_cll) {
+            static_cast<Owner *>(data)->query.pending.targetMaxCll = float(max_cll);
+        },
+        .target_max_fall = [](void *data, auto *, uint32_t max_fall) {
+            static_cast<Owner *>(data)->query.pending.targetMaxFall = float(max_fall);
+        },
+    };
+
+    template <typename Owner>
+    static constexpr typename Protocol::DescriptionListener s_queryListener = {
+        .failed = [](void *data, auto *, uint32_t cause, const char *reason) {
+            Log(LOG_WARNING, "can't get the compositor's %s image description: %s",
+                std::is_same_v<Owner, HdrSurfaceData> ? "preferred" : "output", reason);
+            auto owner = static_cast<Owner *>(data);
+            Protocol::destroyDescription(std::exchange(owner->query.*Protocol::queryDescription, nullptr));
+            CountRequests();
         },
-        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC2020,
-        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_ST2084_PQ,
-        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
-        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_ST2084_PQ,
-        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
-        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ,
-        .extended_volume = false,
-    },
-    ColorDescription{
-        .surface = {
-            .surfaceFormat = {
-                VK_FORMAT_A2R10G10B10_UNORM_PACK32,
-                VK_COLOR_SPACE_HDR10_ST2084_EXT,
+        .ready = [](void *data, auto *description, uint32_t identity) {
+            auto owner = static_cast<Owner *>(data);
+            DescriptionQuery &query = owner->query;
+            if (const VkHdrMetadataEXT *snapshot = FindPreferredSnapshot(owner->hdrDisplay, identity)) {
+                Protocol::destroyDescription(std::exchange(query.*Protocol::queryDescription, nullptr));
+                CountRequests();
+                if constexpr (std::is_same_v<Owner, HdrSurfaceData>) {
+                    SetPreferredMetadata(owner, *snapshot);
+                }
+                return;
             }
+            query.pending = PreferredInfo{.identity = identity};
+            auto info = Protocol::getInformation(description);
+            Protocol::addInfoListener(info, &s_infoListener<Owner>, data);
+            query.*Protocol::queryInfo = info;
+            CountRequests();
         },
-        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC2020,
-        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_ST2084_PQ,
-        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020,
-        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_ST2084_PQ,
-        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020,
-        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ,
-        .extended_volume = false,
-    },
-    ColorDescription{
-        .surface = {
-            .surfaceFormat = {
-                VK_FORMAT_R16G16B16A16_SFLOAT,
-                VK_COLOR_SPACE_EXTENDED_SRGB_LINEAR_EXT,
+    };
+
+    // Stops a query that's still running.
+    static void CancelQuery(DescriptionQuery &query)
+    {
+        if (auto info = std::exchange(query.*Protocol::queryInfo, nullptr)) {
+            Protocol::destroyInfo(info);
+        }
+        if (auto description = std::exchange(query.*Protocol::queryDescription, nullptr)) {
+            Protocol::destroyDescription(description);
+            CountRequests();
+        }
+    }
+
+    // Reads the description getDescription returns for object into owner.
+    template <typename Owner, typename Object, typename GetDescription>
+    static void StartQuery(Owner *owner, Object *object, GetDescription getDescription)
+    {
+        CancelQuery(owner->query);
+        auto description = getDescription(object);
+        Protocol::addListener(description, &s_queryListener<Owner>, owner);
+        owner->query.*Protocol::queryDescription = description;
+        CountRequests();
+    }
+
+    static void RequestPreferred(HdrSurfaceData *hdrSurface)
+    {
+        StartQuery(hdrSurface, hdrSurface->*Protocol::feedback, Protocol::getPreferred);
+    }
+
+    static constexpr typename Protocol::FeedbackListener s_feedbackListener = {
+        .preferred_changed = [](void *data, auto *, auto... identity) {
+            auto hdrSurface = static_cast<HdrSurfaceData *>(data);
+            // color-management-v1 also sends the identity of the new
+            // description, so a known one is applied right away
+            if constexpr (sizeof...(identity) > 0) {
+                if (const VkHdrMetadataEXT *snapshot = FindPreferredSnapshot(hdrSurface->hdrDisplay, identity...)) {
+                    CancelQuery(hdrSurface->query);
+                    SetPreferredMetadata(hdrSurface, *snapshot);
+                    return;
+                }
             }
+            RequestPreferred(hdrSurface);
         },
-        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC709,
-        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_SCRGB_LINEAR,
-        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_SRGB,
-         // TODO this isn't ideal, replace it with a future windows scRGB TF
-        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR,
-        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_SRGB,
-        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR,
-        .extended_volume = true,
-    },
-    ColorDescription{
-        .surface = {
-            .surfaceFormat = {
-                VK_FORMAT_R16G16B16A16_SFLOAT,
-                VK_COLOR_SPACE_BT709_LINEAR_EXT,
-            }
+    };
+
+    static constexpr typename Protocol::OutputListener s_outputListener = {
+        .image_description_changed = [](void *data, auto *) {
+            auto output = static_cast<OutputData *>(data);
+            StartQuery(output, output->*Protocol::colorOutput, Protocol::getOutputDescription);
         },
-        .frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC709,
-        .frogTransferFunction = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_SCRGB_LINEAR,
-        .xxPrimaries = XX_COLOR_MANAGER_V4_PRIMARIES_SRGB,
-         // TODO this isn't ideal, replace it with a future windows scRGB TF
-        .xxTransferFunction = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR,
-        .primaries = WP_COLOR_MANAGER_V1_PRIMARIES_SRGB,
-        .transferFunction = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR,
-        .extended_volume = true,
-    },
-    // ColorDescription{
-    //     .surface = {
-    //         .surfaceFormat = {
-    //             VK_FORMAT_R16G16B16A16_SFLOAT,
-    //             VK_COLOR_SPACE_BT2020_LINEAR_EXT,
-    //         }
-    //     },
-    //     .primaries_cicp = 9,
-    //     .tf_cicp = 8,
-    //     .extended_volume = false,
-    // },
-    // ColorDescription{
-    //     .surface = {
-    //         .surfaceFormat = {
-    //             VK_FORMAT_R16G16B16A16_SFLOAT,
-    //             VK_COLOR_SPACE_DISPLAY_P3_LINEAR_EXT,
-    //         }
-    //     },
-    //     .primaries_cicp = 13,
-    //     .tf_cicp = 8,
-    //     .extended_volume = false,
-    // },
-    // ColorDescription{
-    //     .surface = {
-    //         .surfaceFormat = {
-    //             VK_FORMAT_A2B10G10R10_UNORM_PACK32,
-    //             VK_COLOR_SPACE_BT709_NONLINEAR_EXT,
-    //         }
-    //     },
-    //     .primaries_cicp = 6,
-    //     .tf_cicp = 6,
-    //     .extended_volume = true,
-    // },
-    // ColorDescription{
-    //     .surface = {
-    //         .surfaceFormat = {
-    //             VK_FORMAT_A2R10G10B10_UNORM_PACK32,
-    //             VK_COLOR_SPACE_BT709_NONLINEAR_EXT,
-    //         }
-    //     },
-    //     .primaries_cicp = 6,
-    //     .tf_cicp = 6,
-    //     .extended_volume = true,
-    // },
-};
+    };
 
-struct HdrSurfaceData {
-    VkInstance instance;
-    bool supportsPassthrough = false;
+    // Called with the display locked.
+    static void TrackOutput(OutputData *output)
+    {
+        auto colorOutput = Protocol::getOutput(output->hdrDisplay->*Protocol::manager, output->output);
+        Protocol::addOutputListener(colorOutput, &s_outputListener, output);
+        output->*Protocol::colorOutput = colorOutput;
+        CountRequests();
+        StartQuery(output, colorOutput, Protocol::getOutputDescription);
+    }
 
-    wl_display *display;
-    wl_event_queue *queue;
-    frog_color_management_factory_v1 *frogColorManagement;
-    xx_color_manager_v4 *xxColorManager;
-    wp_color_manager_v1 *colorManager;
+    // Called with the display locked, does nothing for outputs tracked with
+    // the other protocol.
+    static void UntrackOutput(OutputData *output)
+    {
+        CancelQuery(output->query);
+        if (auto colorOutput = std::exchange(output->*Protocol::colorOutput, nullptr)) {
+            Protocol::destroyOutput(colorOutput);
+            CountRequests();
+        }
+    }
 
-    std::vector<xx_color_manager_v4_feature> xxSupportedFeatures;
-    std::vector<xx_color_manager_v4_primaries> xxSupportedPrimaries;
-    std::vector<xx_color_manager_v4_transfer_function> xxSupportedTransferFunctions;
+    static ColorSurface *CreateColorSurface(HdrSurfaceData *hdrSurface)
+    {
+        HdrDisplayData *hdrDisplay = hdrSurface->hdrDisplay;
+        if (!(hdrDisplay->*Protocol::supportedFeatures)[Protocol::featureParametric]) {
+            Log(LOG_WARNING, "wayland compositor is lacking support for parametric image descriptions");
+            return nullptr;
+        }
+        auto colorSurface = Protocol::getSurface(hdrDisplay->*Protocol::manager, hdrSurface->surface);
+        {
+            auto lockedDisplay = HdrDisplay::get(hdrSurface->display);
+            auto feedback = Protocol::getFeedback(hdrDisplay->*Protocol::manager, hdrSurface->surface);
+            Protocol::addFeedbackListener(feedback, &s_feedbackListener, hdrSurface);
+            hdrSurface->*Protocol::feedback = feedback;
+            RequestPreferred(hdrSurface);
+        }
+        CountRequests(2);
+        hdrSurface->tracksPreferred = true;
+        wl_display_flush(hdrSurface->display);
+        return colorSurface;
+    }
 
-    std::vector<wp_color_manager_v1_feature> supportedFeatures;
-    std::vector<wp_color_manager_v1_primaries> supportedPrimaries;
-    std::vector<wp_color_manager_v1_transfer_function> supportedTransferFunctions;
+    static void DestroyColorSurface(HdrSurfaceData *hdrSurface)
+    {
+        {
+            auto lockedDisplay = HdrDisplay::get(hdrSurface->display);
+            CancelQuery(hdrSurface->query);
+            Protocol::destroyFeedback(std::exchange(hdrSurface->*Protocol::feedback, nullptr));
+        }
+        Protocol::destroySurface(std::get<ColorSurface *>(hdrSurface->colorSurface));
+        CountRequests(2);
+    }
 
-    wl_surface *surface;
-    frog_color_managed_surface *frogColorSurface;
-    xx_color_management_surface_v4 *xxColorSurface;
-    wp_color_management_surface_v1 *colorSurface;
+    // Whether the compositor's own scRGB description is available.
+    static bool HasWindowsScrgb(const HdrDisplayData *hdrDisplay)
+    {
+        if constexpr (Protocol::hasWindowsScrgb) {
+            return (hdrDisplay->*Protocol::supportedFeatures)[Protocol::featureWindowsScrgb];
+        }
+        return false;
+    }
+
+    // Named primaries and transfer functions are preferred, as compositors
+    // can recognize them. Without them the description falls back to
+    // set_primaries and set_tf_power, if the compositor supports those.
+    static bool HasNamedPrimaries(const HdrDisplayData *hdrDisplay, const ColorDescription &desc)
+    {
+        return (hdrDisplay->*Protocol::supportedPrimaries)[desc.*Protocol::formatPrimaries];
+    }
+
+    static bool HasNamedTransferFunction(const HdrDisplayData *hdrDisplay, const ColorDescription &desc)
+    {
+        return desc.hasNamedTf && (hdrDisplay->*Protocol::supportedTransferFunctions)[desc.*Protocol::formatTransferFunction];
+    }
+
+    static bool SupportsFormat(const HdrDisplayData *hdrDisplay, const ColorDescription &desc)
+    {
+        if (desc.scrgb && HasWindowsScrgb(hdrDisplay)) {
+            return true;
+        }
+        const auto &features = hdrDisplay->*Protocol::supportedFeatures;
+        return (HasNamedPrimaries(hdrDisplay, desc) || features[Protocol::featureSetPrimaries])
+            && (HasNamedTransferFunction(hdrDisplay, desc) || (desc.tfPower > 0.0f && features[Protocol::featureSetTfPower]));
+    }
+
+    static bool SupportsExtendedTargetVolume(const HdrDisplayData *hdrDisplay)
+    {
+        return (hdrDisplay->*Protocol::supportedFeatures)[Protocol::featureExtendedTargetVolume];
+    }
+
+    static SwapchainState CreateSwapchainState(VkColorSpaceKHR colorSpace)
+    {
+        if (const ColorDescription *desc = FindColorDescription(colorSpace)) {
+            return SwapchainState{
+                .primaries = desc->*Protocol::formatPrimaries,
+                .transferFunction = desc->*Protocol::formatTransferFunction,
+                .desc = desc,
+                .untagged = false,
+            };
+        }
+        if (colorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+            Log(LOG_WARNING, "Unknown colorspace %d, assuming untagged", colorSpace);
+        }
+        return SwapchainState{
+            .untagged = true,
+            .srgb = colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
+        };
+    }
+
+    static bool UsesIccProfile(const HdrDisplayData *hdrDisplay, const SwapchainState &state)
+    {
+        return state.srgb && (hdrDisplay->*Protocol::supportedFeatures)[Protocol::featureIcc] && s_iccProfile.Fd() >= 0;
+    }
+
+    static ImageDescriptionParams GetImageDescriptionParams(const HdrDisplayData *hdrDisplay, const SwapchainState &state, const VkHdrMetadataEXT &metadata)
+    {
+        const ColorDescription &desc = *state.desc;
+        // The compositor's scRGB description is the one it has a fast path
+        // for. It can't carry HDR metadata, the compositor brings its own.
+        if (desc.scrgb && HasWindowsScrgb(hdrDisplay)) {
+            return ImageDescriptionParams{.windowsScrgb = true};
+        }
+
+        const auto &features = hdrDisplay->*Protocol::supportedFeatures;
+        auto params = MakeImageDescriptionParams(state.primaries,
+                                                 state.transferFunction,
+                                                 metadata,
+                                                 Protocol::primaryUnit,
+                                                 features[Protocol::featureMasteringPrimaries],
+                                                 features[Protocol::featureLuminances] && desc.scrgb);
+        const bool customPrimaries = !HasNamedPrimaries(hdrDisplay, desc) && features[Protocol::featureSetPrimaries];
+        const bool customTransferFunction = !HasNamedTransferFunction(hdrDisplay, desc) && desc.tfPower > 0.0f && features[Protocol::featureSetTfPower];
+
+        if (customPrimaries) {
+            params.customPrimaries = true;
+            std::ranges::transform(desc.chromaticities, params.primaryValues.begin(), [](float value) {
+                return int32_t(std::round(value * Protocol::primaryUnit));
+            });
+        }
+        if (customTransferFunction) {
+            params.tfPower = uint32_t(std::round(desc.tfPower * 10'000.0));
+        }
+        return params;
+    }
+
+    static void Prewarm(HdrSurfaceData *hdrSurface, const SwapchainState &state, const VkHdrMetadataEXT &metadata)
+    {
+        if (!state.untagged) {
+            PrewarmImageDescription(hdrSurface, GetImageDescriptionParams(hdrSurface->hdrDisplay, state, metadata));
+        } else if (UsesIccProfile(hdrSurface->hdrDisplay, state)) {
+            PrewarmImageDescription(hdrSurface, ImageDescriptionParams{.icc = true});
+        }
+    }
+
+    static bool UpdateDescription(HdrSurfaceData *hdrSurface, const SwapchainState &state, const VkHdrMetadataEXT &metadata, PresentDescription &description)
+    {
+        if (state.untagged) {
+            if (UsesIccProfile(hdrSurface->hdrDisplay, state)) {
+                description.params = ImageDescriptionParams{.icc = true};
+                description.setImageDescription = SetImageDescription;
+                return false;
+            }
+            Protocol::unsetImageDescription(std::get<ColorSurface *>(hdrSurface->colorSurface));
+            CountRequests();
+            return true;
+        }
+        description.params = GetImageDescriptionParams(hdrSurface->hdrDisplay, state, metadata);
+        description.setImageDescription = SetImageDescription;
+        return false;
+    }
+
+    static void SetImageDescription(HdrSurfaceData *hdrSurface, const CachedImageDescription &entry)
+    {
+        Protocol::setImageDescription(std::get<ColorSurface *>(hdrSurface->colorSurface), entry.*Protocol::description, Protocol::renderIntent);
+        CountRequests();
+    }
 };
-VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrSurface, VkSurfaceKHR);
 
-struct HdrSwapchainData {
-    VkSurfaceKHR surface;
-    frog_color_managed_surface_primaries frogPrimaries;
-    frog_color_managed_surface_transfer_function tf;
+using XxBackend = ParametricBackend<XxColorManagement>;
+using WpBackend = ParametricBackend<WpColorManagement>;
+
+// Maps the color surface objects to their backend
+template <typename ColorSurface>
+struct BackendOf;
+template <>
+struct BackendOf<frog_color_managed_surface> { using Type = FrogBackend; };
+template <>
+struct BackendOf<xx_color_management_surface_v4> { using Type = XxBackend; };
+template <>
+struct BackendOf<wp_color_management_surface_v1> { using Type = WpBackend; };
+
+// Calls f(backend, colorSurface) with the backend of the surface's protocol,
+// unless the surface has no color management object.
+template <typename F>
+static void VisitColorSurface(const AnyColorSurface &colorSurface, F &&f)
+{
+    std::visit([&f](auto object) {
+        if constexpr (!std::is_same_v<decltype(object), std::monostate>) {
+            f(typename BackendOf<std::remove_pointer_t<decltype(object)>>::Type{}, object);
+        }
+    }, colorSurface);
+}
 
-    xx_color_manager_v4_primaries xxPrimaries;
-    xx_color_manager_v4_transfer_function xxTransferFunction;
-    bool xxUntagged = false;
+// The protocol the surface uses, or nullptr, for tracing
+static const char *ProtocolName(const AnyColorSurface &colorSurface)
+{
+    const char *name = nullptr;
+    VisitColorSurface(colorSurface, [&name](auto backend, auto *) {
+        name = decltype(backend)::name;
+    });
+    return name;
+}
 
-    wp_color_manager_v1_primaries primaries;
-    wp_color_manager_v1_transfer_function transferFunction;
-    bool untagged = false;
+struct HdrSwapchainData {
+    VkSurfaceKHR surface;
+    // the surface's entry, surfaces outlive their swapchains
+    HdrSurfaceData *hdrSurface;
+    VkColorSpaceKHR colorSpace;
+    // the state of the surface's backend
+    std::variant<FrogBackend::SwapchainState, XxBackend::SwapchainState, WpBackend::SwapchainState> state;
 
     VkHdrMetadataEXT metadata;
+    // whether the application set any metadata
+    bool hasMetadata = false;
     bool desc_dirty;
-};
-VKROOTS_DEFINE_SYNCHRONIZED_MAP_TYPE(HdrSwapchain, VkSwapchainKHR);
 
-enum DescStatus {
-    WAITING,
-    READY,
-    FAILED,
+    uint64_t presentCount = 0;
+    // set while a description change is waiting for the compositor
+    bool descPending = false;
+    // whether the surface has a description from this swapchain or the old one
+    bool descApplied = false;
+    uint64_t descChangeFrame = 0;
+    std::chrono::steady_clock::time_point descChangeTime;
+    std::chrono::steady_clock::time_point descAppliedTime;
+    // how many presents description changes took to land
+    uint64_t lastDescLatencyFrames = 0;
+    uint64_t maxDescLatencyFrames = 0;
+
+    // accepted updates, the suppressed ones aren't counted
+    uint64_t metadataUpdates = 0;
+    // identical to the current metadata, or within the hysteresis
+    uint64_t suppressedMetadataUpdates = 0;
+    // replaced by a newer update before they were sent
+    uint64_t coalescedMetadataUpdates = 0;
+
+    // this swapchain's slot in the HDR_WSI_STATS segment, if any
+    HdrWsiStats::SwapchainStats *stats = nullptr;
+
+    // copy of the surface's preferred description, see UpdatePreferred
+    std::optional<VkHdrMetadataEXT> preferredMetadata;
+    uint32_t preferredSerial = 0;
 };
+using HdrSwapchain = HandleTable<VkSwapchainKHR, HdrSwapchainData>;
 
 class VkInstanceOverrides
 {
@@ -196,68 +2542,105 @@ public:
         const VkAllocationCallbacks *pAllocator,
         VkSurfaceKHR *pSurface)
     {
-        auto queue = wl_display_create_queue(pCreateInfo->display);
-        wl_registry *registry = wl_display_get_registry(pCreateInfo->display);
-        wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(registry), queue);
-
+        EntryPointTimer timer(HdrWsiStats::CREATE_WAYLAND_SURFACE);
+        TraceSpan span("vkCreateWaylandSurfaceKHR", pCreateInfo->surface);
+        RecordedCall<HdrWsiRecord::CreateWaylandSurface> record(HdrWsiRecord::CREATE_WAYLAND_SURFACE);
         VkResult res = pDispatch->CreateWaylandSurfaceKHR(instance, pCreateInfo, pAllocator, pSurface);
+        record.payload = {
+            .display = HandleId(pCreateInfo->display),
+            .wlSurfaceId = wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(pCreateInfo->surface)),
+            .result = res,
+        };
         if (res != VK_SUCCESS) {
             return res;
         }
+        record.payload.surface = HandleId(*pSurface);
+        span.SetId(*pSurface);
 
-        auto hdrSurface = HdrSurface::create(*pSurface, HdrSurfaceData{
-            .instance = instance,
-            .supportsPassthrough = false,
-            .display = pCreateInfo->display,
-            .queue = queue,
-            .frogColorManagement = nullptr,
-            .xxColorManager = nullptr,
-            .colorManager = nullptr,
-            .surface = pCreateInfo->surface,
-            .frogColorSurface = nullptr,
-            .xxColorSurface = nullptr,
-            .colorSurface = nullptr,
-        });
+        bool isHdrSurface = true;
+        {
+            auto hdrSurface = HdrSurface::create(*pSurface, HdrSurfaceData{
+                .instance = instance,
+                .display = pCreateInfo->display,
+                .hdrDisplay = AcquireHdrDisplay(pCreateInfo->display),
+                .surface = pCreateInfo->surface,
+            });
+            if (!s_lazyProbe) {
+                isHdrSurface = InitColorSurface(hdrSurface.get());
+                span.SetProtocol(ProtocolName(hdrSurface->colorSurface));
+            }
+        }
+        if (!isHdrSurface) {
+            HdrSurface::remove(*pSurface);
+            record.Discard();
+        }
+        return VK_SUCCESS;
+    }
 
-        wl_registry_add_listener(registry, &s_registryListener, reinterpret_cast<void *>(hdrSurface.get()));
-        wl_display_dispatch_queue(pCreateInfo->display, queue);
-        wl_display_roundtrip_queue(pCreateInfo->display, queue); // get globals
-        wl_display_roundtrip_queue(pCreateInfo->display, queue); // get features/supported_cicps/etc
-        wl_registry_destroy(registry);
+    // Waits for the capability probe of the surface's display if necessary and
+    // creates the per-surface color management object.
+    // Returns false if the compositor doesn't support HDR on this surface.
+    static bool InitColorSurface(HdrSurfaceData *hdrSurface)
+    {
+        if (hdrSurface->initialized) {
+            return hdrSurface->hdrDisplay != nullptr;
+        }
+        hdrSurface->initialized = true;
 
-        if (!hdrSurface->frogColorManagement && !hdrSurface->xxColorManager && !hdrSurface->colorManager) {
-            fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for color management protocols..\n");
+        FinishProbe(hdrSurface->display);
 
-            HdrSurface::remove(*pSurface);
-            return VK_SUCCESS;
-        }
+        HdrDisplayData *hdrDisplay = hdrSurface->hdrDisplay;
+        if (!hdrDisplay->frogColorManagement && !hdrDisplay->xxColorManager && !hdrDisplay->colorManager) {
+            Log(LOG_WARNING, "wayland compositor is lacking support for color management protocols..");
 
-        if (hdrSurface->frogColorManagement) {
-            frog_color_managed_surface *frogColorSurface = frog_color_management_factory_v1_get_color_managed_surface(hdrSurface->frogColorManagement, pCreateInfo->surface);
-            frog_color_managed_surface_add_listener(frogColorSurface, &color_surface_interface_listener, nullptr);
-            wl_display_flush(hdrSurface->display);
+            ReleaseHdrDisplay(hdrSurface->display);
+            hdrSurface->hdrDisplay = nullptr;
+            return false;
+        }
 
-            hdrSurface->frogColorSurface = frogColorSurface;
-        } else if (hdrSurface->colorManager) {
-            const bool hasParametric = std::ranges::find(hdrSurface->supportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC) != hdrSurface->supportedFeatures.end();
-            if (!hasParametric) {
-                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for parametric image descriptions\n");
-                HdrSurface::remove(*pSurface);
-                return VK_SUCCESS;
-            }
-            hdrSurface->colorSurface = wp_color_manager_v1_get_surface(hdrSurface->colorManager, pCreateInfo->surface);
+        bool created;
+        if (hdrDisplay->frogColorManagement) {
+            created = CreateColorSurface<FrogBackend>(hdrSurface);
+        } else if (hdrDisplay->colorManager) {
+            created = CreateColorSurface<WpBackend>(hdrSurface);
         } else {
-            const bool hasParametric = std::ranges::find(hdrSurface->xxSupportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC) != hdrSurface->xxSupportedFeatures.end();
-            if (!hasParametric) {
-                fprintf(stderr, "[HDR Layer] wayland compositor is lacking support for parametric image descriptions\n");
-                HdrSurface::remove(*pSurface);
-                return VK_SUCCESS;
+            created = CreateColorSurface<XxBackend>(hdrSurface);
+        }
+        if (!created) {
+            ReleaseHdrDisplay(hdrSurface->display);
+            hdrSurface->hdrDisplay = nullptr;
+            return false;
+        }
+
+        CountStat(&HdrWsiStats::Segment::hdrSurfaces);
+        Log(LOG_INFO, "Created HDR surface");
+        return true;
+    }
+
+    // Looks up a surface and initializes it if necessary. Like in
+    // CreateWaylandSurfaceKHR, a surface without color management is removed,
+    // so the entry points go back to the fast path once no HDR surface is left.
+    static HdrSurface::Object GetColorSurface(VkSurfaceKHR surface)
+    {
+        {
+            auto hdrSurface = HdrSurface::get(surface);
+            if (!hdrSurface || InitColorSurface(hdrSurface.get())) {
+                return hdrSurface;
             }
-            hdrSurface->xxColorSurface = xx_color_manager_v4_get_surface(hdrSurface->xxColorManager, pCreateInfo->surface);
         }
+        HdrSurface::remove(surface);
+        return {};
+    }
 
-        fprintf(stderr, "[HDR Layer] Created HDR surface\n");
-        return VK_SUCCESS;
+    template <typename Backend>
+    static bool CreateColorSurface(HdrSurfaceData *hdrSurface)
+    {
+        auto colorSurface = Backend::CreateColorSurface(hdrSurface);
+        if (!colorSurface) {
+            return false;
+        }
+        hdrSurface->colorSurface = colorSurface;
+        return true;
     }
 
     static VkResult GetPhysicalDeviceSurfaceFormatsKHR(
@@ -267,88 +2650,152 @@ public:
         uint32_t *pSurfaceFormatCount,
         VkSurfaceFormatKHR *pSurfaceFormats)
     {
-        auto hdrSurface = HdrSurface::get(surface);
-        if (!hdrSurface)
+        if (HdrSurface::empty()) {
             return pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, pSurfaceFormatCount, pSurfaceFormats);
+        }
 
-        uint32_t count = 0;
-        auto result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &count, nullptr);
-        if (result != VK_SUCCESS) {
-            return result;
+        EntryPointTimer timer(HdrWsiStats::GET_SURFACE_FORMATS);
+        TraceSpan span("vkGetPhysicalDeviceSurfaceFormatsKHR", surface);
+        auto hdrSurface = GetColorSurface(surface);
+        if (!hdrSurface)
+            return pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, pSurfaceFormatCount, pSurfaceFormats);
+        span.SetProtocol(ProtocolName(hdrSurface->colorSurface));
+        CountStat(&HdrWsiStats::Segment::formatQueries);
+        RecordedCall<HdrWsiRecord::GetSurfaceFormats> record(HdrWsiRecord::GET_SURFACE_FORMATS);
+
+        const SurfaceFormatCache *surfaceFormats = nullptr;
+        auto result = GetSurfaceFormats(pDispatch, physicalDevice, surface, hdrSurface.get(), &surfaceFormats);
+        if (result == VK_SUCCESS) {
+            result = vkroots::helpers::array(surfaceFormats->formats, pSurfaceFormatCount, pSurfaceFormats);
         }
-        std::vector<VkSurfaceFormatKHR> formats(count);
-        result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &count, formats.data());
-        if (result != VK_SUCCESS) {
-            return result;
+        record.payload = {
+            .surface = HandleId(surface),
+            .variant = 1,
+            .formatCount = *pSurfaceFormatCount,
+            .result = result,
+        };
+        return result;
+    }
+
+    static VkResult GetPhysicalDeviceSurfaceFormats2KHR(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkPhysicalDevice physicalDevice,
+        const VkPhysicalDeviceSurfaceInfo2KHR *pSurfaceInfo,
+        uint32_t *pSurfaceFormatCount,
+        VkSurfaceFormat2KHR *pSurfaceFormats)
+    {
+        if (HdrSurface::empty()) {
+            return pDispatch->GetPhysicalDeviceSurfaceFormats2KHR(physicalDevice, pSurfaceInfo, pSurfaceFormatCount, pSurfaceFormats);
         }
 
-        hdrSurface->supportsPassthrough = std::ranges::any_of(formats, [](const VkSurfaceFormatKHR fmt) {
-            return fmt.colorSpace == VK_COLOR_SPACE_PASS_THROUGH_EXT;
-        });
+        EntryPointTimer timer(HdrWsiStats::GET_SURFACE_FORMATS2);
+        TraceSpan span("vkGetPhysicalDeviceSurfaceFormats2KHR", pSurfaceInfo->surface);
+        auto hdrSurface = GetColorSurface(pSurfaceInfo->surface);
+        if (!hdrSurface) {
+            return pDispatch->GetPhysicalDeviceSurfaceFormats2KHR(physicalDevice, pSurfaceInfo, pSurfaceFormatCount, pSurfaceFormats);
+        }
+        span.SetProtocol(ProtocolName(hdrSurface->colorSurface));
+        CountStat(&HdrWsiStats::Segment::formatQueries);
+        RecordedCall<HdrWsiRecord::GetSurfaceFormats> record(HdrWsiRecord::GET_SURFACE_FORMATS);
+
+        const SurfaceFormatCache *surfaceFormats = nullptr;
+        auto result = GetSurfaceFormats(pDispatch, physicalDevice, pSurfaceInfo->surface, hdrSurface.get(), &surfaceFormats);
+        if (result == VK_SUCCESS) {
+            result = CopySurfaceFormats2(pDispatch, physicalDevice, pSurfaceInfo, surfaceFormats, pSurfaceFormatCount, pSurfaceFormats);
+        }
+        record.payload = {
+            .surface = HandleId(pSurfaceInfo->surface),
+            .variant = 2,
+            .formatCount = *pSurfaceFormatCount,
+            .result = result,
+        };
+        return result;
+    }
 
-        std::vector<VkSurfaceFormatKHR> extraFormats = {};
-        for (const auto &desc : s_ExtraHDRSurfaceFormats) {
-            const bool alreadySupportsColorspace = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
-                return desc.surface.surfaceFormat.format == fmt.format
-                    && desc.surface.surfaceFormat.colorSpace == fmt.colorSpace;
-            });
-            if (alreadySupportsColorspace) {
-                continue;
-            }
-            bool hasFormat = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
-                return desc.surface.surfaceFormat.format == fmt.format;
-            });
-            if (hdrSurface->xxColorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedPrimaries, desc.xxPrimaries) != hdrSurface->xxSupportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedTransferFunctions, desc.xxTransferFunction) != hdrSurface->xxSupportedTransferFunctions.end();
-            }
-            if (hdrSurface->colorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->supportedPrimaries, desc.primaries) != hdrSurface->supportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->supportedTransferFunctions, desc.transferFunction) != hdrSurface->supportedTransferFunctions.end();
+    // Answers a vkGetPhysicalDeviceSurfaceFormats2KHR query for an HDR surface
+    static VkResult CopySurfaceFormats2(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkPhysicalDevice physicalDevice,
+        const VkPhysicalDeviceSurfaceInfo2KHR *pSurfaceInfo,
+        const SurfaceFormatCache *surfaceFormats,
+        uint32_t *pSurfaceFormatCount,
+        VkSurfaceFormat2KHR *pSurfaceFormats)
+    {
+        // Extension structs in the query or in the output have to be handled
+        // by the driver, only plain queries can be answered from the cache
+        const bool hasExtensionStructs = pSurfaceInfo->pNext
+            || (pSurfaceFormats && std::ranges::any_of(std::span(pSurfaceFormats, *pSurfaceFormatCount), [](const VkSurfaceFormat2KHR &fmt) {
+                   return fmt.pNext != nullptr;
+               }));
+        if (!hasExtensionStructs) {
+            const uint32_t count = uint32_t(surfaceFormats->formats.size());
+            if (!pSurfaceFormats) {
+                *pSurfaceFormatCount = count;
+                return VK_SUCCESS;
             }
-            if (hasFormat) {
-                fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc.surface.surfaceFormat.format, desc.surface.surfaceFormat.colorSpace);
-                extraFormats.push_back(desc.surface.surfaceFormat);
+            const uint32_t outCount = std::min(*pSurfaceFormatCount, count);
+            for (uint32_t i = 0; i < outCount; i++) {
+                pSurfaceFormats[i].surfaceFormat = surfaceFormats->formats[i];
             }
+            *pSurfaceFormatCount = outCount;
+            return outCount < count ? VK_INCOMPLETE : VK_SUCCESS;
+        }
+
+        std::vector<VkSurfaceFormat2KHR> extraFormats = {};
+        for (size_t i = surfaceFormats->driverFormatCount; i < surfaceFormats->formats.size(); i++) {
+            extraFormats.push_back(VkSurfaceFormat2KHR{
+                .sType = VK_STRUCTURE_TYPE_SURFACE_FORMAT_2_KHR,
+                .surfaceFormat = surfaceFormats->formats[i],
+            });
         }
 
         return vkroots::helpers::append(
-                   pDispatch->GetPhysicalDeviceSurfaceFormatsKHR,
+                   pDispatch->GetPhysicalDeviceSurfaceFormats2KHR,
                    extraFormats,
                    pSurfaceFormatCount,
                    pSurfaceFormats,
                    physicalDevice,
-                   surface);
+                   pSurfaceInfo);
     }
 
-    static VkResult GetPhysicalDeviceSurfaceFormats2KHR(
+    // Returns the driver's formats for the surface, followed by the HDR
+    // formats the compositor supports. The list is cached per physical device
+    // and only rebuilt when the compositor capabilities change.
+    static VkResult GetSurfaceFormats(
         const vkroots::VkInstanceDispatch *pDispatch,
         VkPhysicalDevice physicalDevice,
-        const VkPhysicalDeviceSurfaceInfo2KHR *pSurfaceInfo,
-        uint32_t *pSurfaceFormatCount,
-        VkSurfaceFormat2KHR *pSurfaceFormats)
+        VkSurfaceKHR surface,
+        HdrSurfaceData *hdrSurface,
+        const SurfaceFormatCache **ppSurfaceFormats)
     {
-        auto hdrSurface = HdrSurface::get(pSurfaceInfo->surface);
-        if (!hdrSurface) {
-            return pDispatch->GetPhysicalDeviceSurfaceFormats2KHR(physicalDevice, pSurfaceInfo, pSurfaceFormatCount, pSurfaceFormats);
+        const uint32_t capabilitiesSerial = hdrSurface->hdrDisplay->capabilitiesSerial.load();
+        auto cache = std::ranges::find_if(hdrSurface->formatCache, [physicalDevice](const SurfaceFormatCache &entry) {
+            return entry.physicalDevice == physicalDevice;
+        });
+        if (cache != hdrSurface->formatCache.end() && cache->capabilitiesSerial == capabilitiesSerial) {
+            *ppSurfaceFormats = &*cache;
+            return VK_SUCCESS;
         }
 
         uint32_t count = 0;
-        auto result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, pSurfaceInfo->surface, &count, nullptr);
+        auto result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &count, nullptr);
         if (result != VK_SUCCESS) {
             return result;
         }
         std::vector<VkSurfaceFormatKHR> formats(count);
-        result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, pSurfaceInfo->surface, &count, formats.data());
+        result = pDispatch->GetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &count, formats.data());
         if (result != VK_SUCCESS) {
             return result;
         }
+        formats.resize(count);
 
-        hdrSurface->supportsPassthrough = std::ranges::any_of(formats, [](const VkSurfaceFormatKHR fmt) {
+        const bool supportsPassthrough = std::ranges::any_of(formats, [](const VkSurfaceFormatKHR fmt) {
             return fmt.colorSpace == VK_COLOR_SPACE_PASS_THROUGH_EXT;
         });
 
-        std::vector<VkSurfaceFormat2KHR> extraFormats = {};
+        std::vector<VkSurfaceFormatKHR> extraFormats = {};
+        // the listeners fill in the capabilities under the display's lock
+        auto hdrDisplay = HdrDisplay::get(hdrSurface->display);
         for (const auto &desc : s_ExtraHDRSurfaceFormats) {
             const bool alreadySupportsColorspace = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
                 return desc.surface.surfaceFormat.format == fmt.format
@@ -360,27 +2807,42 @@ public:
             bool hasFormat = std::ranges::any_of(formats, [&desc](const VkSurfaceFormatKHR fmt) {
                 return desc.surface.surfaceFormat.format == fmt.format;
             });
-            if (hdrSurface->xxColorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedPrimaries, desc.xxPrimaries) != hdrSurface->xxSupportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->xxSupportedTransferFunctions, desc.xxTransferFunction) != hdrSurface->xxSupportedTransferFunctions.end();
-            }
-            if (hdrSurface->colorSurface) {
-                hasFormat &= std::ranges::find(hdrSurface->supportedPrimaries, desc.primaries) != hdrSurface->supportedPrimaries.end();
-                hasFormat &= std::ranges::find(hdrSurface->supportedTransferFunctions, desc.transferFunction) != hdrSurface->supportedTransferFunctions.end();
-            }
+            VisitColorSurface(hdrSurface->colorSurface, [&](auto backend, auto *) {
+                hasFormat &= decltype(backend)::SupportsFormat(hdrDisplay.get(), desc);
+            });
             if (hasFormat) {
-                fprintf(stderr, "[HDR Layer] Enabling format: %u colorspace: %u\n", desc.surface.surfaceFormat.format, desc.surface.surfaceFormat.colorSpace);
-                extraFormats.push_back(desc.surface);
+                Log(LOG_DEBUG, "Enabling format: %u colorspace: %u", desc.surface.surfaceFormat.format, desc.surface.surfaceFormat.colorSpace);
+                extraFormats.push_back(desc.surface.surfaceFormat);
             }
         }
 
-        return vkroots::helpers::append(
-                   pDispatch->GetPhysicalDeviceSurfaceFormats2KHR,
-                   extraFormats,
-                   pSurfaceFormatCount,
-                   pSurfaceFormats,
-                   physicalDevice,
-                   pSurfaceInfo);
+        const size_t driverFormatCount = formats.size();
+        formats.insert(formats.end(), extraFormats.begin(), extraFormats.end());
+
+        if (cache == hdrSurface->formatCache.end()) {
+            cache = hdrSurface->formatCache.emplace(hdrSurface->formatCache.end());
+        }
+        *cache = SurfaceFormatCache{
+            .physicalDevice = physicalDevice,
+            .capabilitiesSerial = capabilitiesSerial,
+            .supportsPassthrough = supportsPassthrough,
+            .formats = std::move(formats),
+            .driverFormatCount = driverFormatCount,
+        };
+        *ppSurfaceFormats = &*cache;
+        return VK_SUCCESS;
+    }
+
+    static void DestroyInstance(
+        const vkroots::VkInstanceDispatch *pDispatch,
+        VkInstance instance,
+        const VkAllocationCallbacks *pAllocator)
+    {
+        // the application may not unload the layer or exit cleanly
+        if (s_tracePath) {
+            s_tracer.Flush();
+        }
+        pDispatch->DestroyInstance(instance, pAllocator);
     }
 
     static void DestroySurfaceKHR(
@@ -389,28 +2851,29 @@ public:
         VkSurfaceKHR surface,
         const VkAllocationCallbacks *pAllocator)
     {
+        if (HdrSurface::empty()) {
+            pDispatch->DestroySurfaceKHR(instance, surface, pAllocator);
+            return;
+        }
+
+        RecordedCall<HdrWsiRecord::DestroySurface> record(HdrWsiRecord::DESTROY_SURFACE);
+        record.payload.surface = HandleId(surface);
+        wl_display *display = nullptr;
         if (auto state = HdrSurface::get(surface)) {
-            if (state->frogColorSurface) {
-                frog_color_managed_surface_destroy(state->frogColorSurface);
-            }
-            if (state->frogColorManagement) {
-                frog_color_management_factory_v1_destroy(state->frogColorManagement);
-            }
-            if (state->xxColorSurface) {
-                xx_color_management_surface_v4_destroy(state->xxColorSurface);
-            }
-            if (state->xxColorManager) {
-                xx_color_manager_v4_destroy(state->xxColorManager);
-            }
-            if (state->colorSurface) {
-                wp_color_management_surface_v1_destroy(state->colorSurface);
-            }
-            if (state->colorManager) {
-                wp_color_manager_v1_destroy(state->colorManager);
+            VisitColorSurface(state->colorSurface, [&state](auto backend, auto *) {
+                decltype(backend)::DestroyColorSurface(state.get());
+                CountStat(&HdrWsiStats::Segment::hdrSurfaces, -1);
+            });
+            if (state->hdrDisplay) {
+                display = state->display;
             }
-            wl_event_queue_destroy(state->queue);
+        } else {
+            record.Discard();
         }
         HdrSurface::remove(surface);
+        if (display) {
+            ReleaseHdrDisplay(display);
+        }
         pDispatch->DestroySurfaceKHR(instance, surface, pAllocator);
     }
 
@@ -448,34 +2911,191 @@ public:
     }
 
 private:
-    static constexpr struct frog_color_managed_surface_listener color_surface_interface_listener {
-      .preferred_metadata = [](void *data,
-                               struct frog_color_managed_surface *frog_color_managed_surface,
-                               uint32_t transfer_function,
-                               uint32_t output_display_primary_red_x,
-                               uint32_t output_display_primary_red_y,
-                               uint32_t output_display_primary_green_x,
-                               uint32_t output_display_primary_green_y,
-                               uint32_t output_display_primary_blue_x,
-                               uint32_t output_display_primary_blue_y,
-                               uint32_t output_white_point_x,
-                               uint32_t output_white_point_y,
-                               uint32_t max_luminance,
-                               uint32_t min_luminance,
-                               uint32_t max_full_frame_luminance){}
-    };
+    // Returns the shared color management state for display. On first use
+    // this sends the capability probe to the compositor without waiting for
+    // the answer, see FinishProbe.
+    // Entries are never erased from the map, a released display is only reset,
+    // so the returned pointer stays valid until the matching ReleaseHdrDisplay.
+    static HdrDisplayData *AcquireHdrDisplay(wl_display *display)
+    {
+        // entries are created once per wl_display and never removed, so
+        // this only has to write to the table the first time
+        if (!HdrDisplay::get(display)) {
+            HdrDisplay::create(display, HdrDisplayData{});
+        }
+
+        auto hdrDisplay = HdrDisplay::get(display);
+        if (hdrDisplay->refCount++ > 0) {
+            return hdrDisplay.get();
+        }
+
+        hdrDisplay->probeStart = std::chrono::steady_clock::now();
+        hdrDisplay->roundtripStart = hdrDisplay->probeStart;
+        hdrDisplay->queue = wl_display_create_queue(display);
+        hdrDisplay->displayWrapper = reinterpret_cast<wl_display *>(wl_proxy_create_wrapper(display));
+        wl_proxy_set_queue(reinterpret_cast<wl_proxy *>(hdrDisplay->displayWrapper), hdrDisplay->queue);
+
+        hdrDisplay->registry = wl_display_get_registry(hdrDisplay->displayWrapper);
+        wl_registry_add_listener(hdrDisplay->registry, &s_registryListener, reinterpret_cast<void *>(hdrDisplay.get()));
+        hdrDisplay->probeCallback = wl_display_sync(hdrDisplay->displayWrapper);
+        wl_callback_add_listener(hdrDisplay->probeCallback, &s_probeGlobalsListener, reinterpret_cast<void *>(hdrDisplay.get()));
+        CountRequests(2);
+        wl_display_flush(display);
+
+        return hdrDisplay.get();
+    }
+
+    // Blocks until the compositor answered the capability probe of display.
+    // Like any other wait for the compositor it doesn't hold the display's
+    // lock, see DispatchQueueTimeout.
+    static void FinishProbe(wl_display *display)
+    {
+        {
+            auto hdrDisplay = HdrDisplay::get(display);
+            if (!hdrDisplay->displayWrapper) {
+                return;
+            }
+        }
+
+        TraceSpan span("wait for color management probe", display);
+        const auto waitStart = std::chrono::steady_clock::now();
+        for (;;) {
+            {
+                auto hdrDisplay = HdrDisplay::get(display);
+                if (hdrDisplay->probed || !hdrDisplay->displayWrapper) {
+                    break;
+                }
+            }
+            CountCompositorWait();
+            if (DispatchQueueTimeout(display, -1ms) < 0) {
+                Log(LOG_ERROR, "querying color management support failed");
+                break;
+            }
+        }
+
+        auto hdrDisplay = HdrDisplay::get(display);
+        // another surface of the display finished the probe while we waited
+        if (!hdrDisplay->displayWrapper) {
+            return;
+        }
+        const auto probeEnd = std::chrono::steady_clock::now();
+        DestroyProbe(hdrDisplay.get());
+        if (TracksOutputs(hdrDisplay.get())) {
+            for (auto &output : hdrDisplay->outputs) {
+                TrackOutput(&output);
+            }
+            wl_display_flush(display);
+        } else {
+            ReleaseOutputs(hdrDisplay.get());
+        }
+
+        const auto toMs = [](std::chrono::steady_clock::duration duration) {
+            return std::chrono::duration<double, std::milli>(duration).count();
+        };
+        Log(LOG_DEBUG, "color management probe took %.3f ms, %.3f ms of it blocking",
+            toMs(probeEnd - hdrDisplay->probeStart), toMs(probeEnd - waitStart));
+    }
+
+    // Keeps the registry, see ReleaseOutputs.
+    static void DestroyProbe(HdrDisplayData *hdrDisplay)
+    {
+        hdrDisplay->probed = true;
+        if (hdrDisplay->probeCallback) {
+            wl_callback_destroy(hdrDisplay->probeCallback);
+            hdrDisplay->probeCallback = nullptr;
+        }
+        if (hdrDisplay->displayWrapper) {
+            wl_proxy_wrapper_destroy(hdrDisplay->displayWrapper);
+            hdrDisplay->displayWrapper = nullptr;
+        }
+    }
+
+    // Whether the outputs' descriptions are read into the preferred
+    // snapshots: only the parametric backends query preferred descriptions.
+    static bool TracksOutputs(const HdrDisplayData *hdrDisplay)
+    {
+        if (hdrDisplay->frogColorManagement) {
+            return false;
+        }
+        if (hdrDisplay->colorManager) {
+            return hdrDisplay->supportedFeatures[WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC];
+        }
+        return hdrDisplay->xxColorManager && hdrDisplay->xxSupportedFeatures[XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC];
+    }
+
+    // with the protocol InitColorSurface picks
+    static void TrackOutput(OutputData *output)
+    {
+        if (output->hdrDisplay->colorManager) {
+            WpBackend::TrackOutput(output);
+        } else {
+            XxBackend::TrackOutput(output);
+        }
+    }
+
+    static void DestroyOutput(OutputData &output)
+    {
+        WpBackend::UntrackOutput(&output);
+        XxBackend::UntrackOutput(&output);
+        wl_output_destroy(output.output);
+    }
+
+    // Stops watching outputs, and the registry for new ones.
+    static void ReleaseOutputs(HdrDisplayData *hdrDisplay)
+    {
+        for (auto &output : hdrDisplay->outputs) {
+            DestroyOutput(output);
+        }
+        hdrDisplay->outputs.clear();
+        if (hdrDisplay->registry) {
+            wl_registry_destroy(hdrDisplay->registry);
+            hdrDisplay->registry = nullptr;
+        }
+    }
+
+    static void ReleaseHdrDisplay(wl_display *display)
+    {
+        auto hdrDisplay = HdrDisplay::get(display);
+        if (!hdrDisplay || --hdrDisplay->refCount > 0) {
+            return;
+        }
+
+        DestroyProbe(hdrDisplay.get());
+        ReleaseOutputs(hdrDisplay.get());
+
+        for (const auto &entry : hdrDisplay->imageDescriptions) {
+            DestroyImageDescription(entry);
+        }
+        if (hdrDisplay->frogColorManagement) {
+            frog_color_management_factory_v1_destroy(hdrDisplay->frogColorManagement);
+        }
+        if (hdrDisplay->xxColorManager) {
+            xx_color_manager_v4_destroy(hdrDisplay->xxColorManager);
+        }
+        if (hdrDisplay->colorManager) {
+            wp_color_manager_v1_destroy(hdrDisplay->colorManager);
+        }
+        wl_event_queue_destroy(hdrDisplay->queue);
+        *hdrDisplay.get() = HdrDisplayData{};
+    }
 
     static constexpr xx_color_manager_v4_listener s_xxColorManagerListener {
         .supported_intent = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t render_intent) {
         },
         .supported_feature = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t feature) {
-            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedFeatures.push_back(xx_color_manager_v4_feature(feature));
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            AddCapability(hdrDisplay->xxSupportedFeatures, feature);
+            hdrDisplay->capabilitiesSerial.bump();
         },
         .supported_tf_named = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t tf) {
-            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedTransferFunctions.push_back(xx_color_manager_v4_transfer_function(tf));
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            AddCapability(hdrDisplay->xxSupportedTransferFunctions, tf);
+            hdrDisplay->capabilitiesSerial.bump();
         },
         .supported_primaries_named = [](void *data, xx_color_manager_v4 *xx_color_manager_v4, uint32_t primaries) {
-            reinterpret_cast<HdrSurfaceData *>(data)->xxSupportedPrimaries.push_back(xx_color_manager_v4_primaries(primaries));
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            AddCapability(hdrDisplay->xxSupportedPrimaries, primaries);
+            hdrDisplay->capabilitiesSerial.bump();
         },
     };
 
@@ -483,55 +3103,273 @@ private:
         .supported_intent = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t render_intent) {
         },
         .supported_feature = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t feature) {
-            reinterpret_cast<HdrSurfaceData *>(data)->supportedFeatures.push_back(wp_color_manager_v1_feature(feature));
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            AddCapability(hdrDisplay->supportedFeatures, feature);
+            hdrDisplay->capabilitiesSerial.bump();
         },
         .supported_tf_named = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t tf) {
-            reinterpret_cast<HdrSurfaceData *>(data)->supportedTransferFunctions.push_back(wp_color_manager_v1_transfer_function(tf));
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            AddCapability(hdrDisplay->supportedTransferFunctions, tf);
+            hdrDisplay->capabilitiesSerial.bump();
         },
         .supported_primaries_named = [](void *data, wp_color_manager_v1 *wp_color_manager_v4, uint32_t primaries) {
-            reinterpret_cast<HdrSurfaceData *>(data)->supportedPrimaries.push_back(wp_color_manager_v1_primaries(primaries));
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            AddCapability(hdrDisplay->supportedPrimaries, primaries);
+            hdrDisplay->capabilitiesSerial.bump();
         },
         .done = [](void *data, wp_color_manager_v1 *wp_color_manager_v4) {
         },
     };
 
+    // The first sync returns after all globals were announced and bound, the
+    // second one after the bound managers sent their supported features.
+    static constexpr wl_callback_listener s_probeCapabilitiesListener = {
+        .done = [](void *data, wl_callback *callback, uint32_t callbackData) {
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            TraceComplete("color management capabilities roundtrip", hdrDisplay->displayWrapper, hdrDisplay->roundtripStart);
+            wl_callback_destroy(callback);
+            hdrDisplay->probeCallback = nullptr;
+            hdrDisplay->probed = true;
+        },
+    };
+
+    static constexpr wl_callback_listener s_probeGlobalsListener = {
+        .done = [](void *data, wl_callback *callback, uint32_t callbackData) {
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            TraceComplete("color management globals roundtrip", hdrDisplay->displayWrapper, hdrDisplay->roundtripStart);
+            hdrDisplay->roundtripStart = std::chrono::steady_clock::now();
+            wl_callback_destroy(callback);
+            hdrDisplay->probeCallback = wl_display_sync(hdrDisplay->displayWrapper);
+            wl_callback_add_listener(hdrDisplay->probeCallback, &s_probeCapabilitiesListener, data);
+        },
+    };
+
     static constexpr wl_registry_listener s_registryListener = {
         .global = [](void *data, wl_registry * registry, uint32_t name, const char *interface, uint32_t version)
         {
-            auto surface = reinterpret_cast<HdrSurfaceData *>(data);
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+
+            if (interface == "wl_output"sv) {
+                auto &output = hdrDisplay->outputs.emplace_back(OutputData{
+                    .hdrDisplay = hdrDisplay,
+                    .name = name,
+                    .output = reinterpret_cast<wl_output *>(wl_registry_bind(registry, name, &wl_output_interface, 1)),
+                });
+                // outputs announced during the probe are tracked once it's
+                // known which protocol the surfaces use, see FinishProbe
+                if (!hdrDisplay->displayWrapper) {
+                    TrackOutput(&output);
+                }
+                return;
+            }
+            // the managers are bound once, by the probe
+            if (!hdrDisplay->displayWrapper) {
+                return;
+            }
 
             if (interface == "frog_color_management_factory_v1"sv) {
-                surface->frogColorManagement = reinterpret_cast<frog_color_management_factory_v1 *>(wl_registry_bind(registry, name, &frog_color_management_factory_v1_interface, 1));
+                hdrDisplay->frogColorManagement = reinterpret_cast<frog_color_management_factory_v1 *>(wl_registry_bind(registry, name, &frog_color_management_factory_v1_interface, 1));
             } else if (interface == "xx_color_manager_v4"sv) {
-                surface->xxColorManager = reinterpret_cast<xx_color_manager_v4 *>(wl_registry_bind(registry, name, &xx_color_manager_v4_interface, 1));
-                xx_color_manager_v4_add_listener(surface->xxColorManager, &s_xxColorManagerListener, surface);
+                hdrDisplay->xxColorManager = reinterpret_cast<xx_color_manager_v4 *>(wl_registry_bind(registry, name, &xx_color_manager_v4_interface, 1));
+                xx_color_manager_v4_add_listener(hdrDisplay->xxColorManager, &s_xxColorManagerListener, hdrDisplay);
             } else if (interface == "wp_color_manager_v1"sv) {
-                surface->colorManager = reinterpret_cast<wp_color_manager_v1 *>(wl_registry_bind(registry, name, &wp_color_manager_v1_interface, 1));
-                wp_color_manager_v1_add_listener(surface->colorManager, &s_colorManagerListener, surface);
+                hdrDisplay->colorManager = reinterpret_cast<wp_color_manager_v1 *>(wl_registry_bind(registry, name, &wp_color_manager_v1_interface, 1));
+                wp_color_manager_v1_add_listener(hdrDisplay->colorManager, &s_colorManagerListener, hdrDisplay);
+            }
+        },
+        .global_remove = [](void *data, wl_registry * registry, uint32_t name) {
+            auto hdrDisplay = reinterpret_cast<HdrDisplayData *>(data);
+            auto &outputs = hdrDisplay->outputs;
+            if (auto it = std::ranges::find(outputs, name, &OutputData::name); it != outputs.end()) {
+                DestroyOutput(*it);
+                outputs.erase(it);
             }
         },
-        .global_remove = [](void *data, wl_registry * registry, uint32_t name) {},
     };
 };
 
-static constexpr xx_image_description_v4_listener s_xxImageDescriptionListener {
-    .failed = [](void *userData, xx_image_description_v4 *descr, uint32_t cause, const char *reason) {
-        fprintf(stderr, "[HDR Layer] creating image description failed! %s", reason);
-        *reinterpret_cast<bool *>(userData) = true;
-    },
-    .ready = [](void *userData, xx_image_description_v4 *descr, uint32_t id) {
-        *reinterpret_cast<bool *>(userData) = true;
-    },
-};
-static constexpr wp_image_description_v1_listener s_imageDescriptionListener {
-    .failed = [](void *userData, wp_image_description_v1 *descr, uint32_t cause, const char *reason) {
-        fprintf(stderr, "[HDR Layer] creating image description failed! %s", reason);
-        *reinterpret_cast<bool *>(userData) = true;
-    },
-    .ready = [](void *userData, wp_image_description_v1 *descr, uint32_t id) {
-        *reinterpret_cast<bool *>(userData) = true;
-    },
-};
+static bool IsSameMetadata(const VkHdrMetadataEXT &a, const VkHdrMetadataEXT &b)
+{
+    return a.displayPrimaryRed.x == b.displayPrimaryRed.x
+        && a.displayPrimaryRed.y == b.displayPrimaryRed.y
+        && a.displayPrimaryGreen.x == b.displayPrimaryGreen.x
+        && a.displayPrimaryGreen.y == b.displayPrimaryGreen.y
+        && a.displayPrimaryBlue.x == b.displayPrimaryBlue.x
+        && a.displayPrimaryBlue.y == b.displayPrimaryBlue.y
+        && a.whitePoint.x == b.whitePoint.x
+        && a.whitePoint.y == b.whitePoint.y
+        && a.maxLuminance == b.maxLuminance
+        && a.minLuminance == b.minLuminance
+        && a.maxContentLightLevel == b.maxContentLightLevel
+        && a.maxFrameAverageLightLevel == b.maxFrameAverageLightLevel;
+}
+
+// Whether b only differs from a in its content light levels, and by less
+// than the configured hysteresis.
+static bool IsWithinHysteresis(const VkHdrMetadataEXT &a, const VkHdrMetadataEXT &b)
+{
+    if (s_metadataHysteresis <= 0) {
+        return false;
+    }
+    VkHdrMetadataEXT masteringOnly = b;
+    masteringOnly.maxContentLightLevel = a.maxContentLightLevel;
+    masteringOnly.maxFrameAverageLightLevel = a.maxFrameAverageLightLevel;
+    if (!IsSameMetadata(a, masteringOnly)) {
+        return false;
+    }
+    const auto isClose = [](float x, float y) {
+        return std::abs(x - y) < std::max(x, y) * s_metadataHysteresis / 100.0f;
+    };
+    return isClose(a.maxContentLightLevel, b.maxContentLightLevel)
+        && isClose(a.maxFrameAverageLightLevel, b.maxFrameAverageLightLevel);
+}
+
+// Moves a CIE xy point that lies outside of the triangle of the container's
+// red, green and blue primaries to the closest point on its edges.
+static VkXYColorEXT ClampToTriangle(VkXYColorEXT point, const std::array<float, 8> &container)
+{
+    const auto vertex = [&container](int i) { return VkXYColorEXT{container[2 * i], container[2 * i + 1]}; };
+    const auto cross = [](VkXYColorEXT a, VkXYColorEXT b, VkXYColorEXT p) {
+        return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+    };
+
+    // inside if on the same side of all edges as the opposite vertex
+    bool inside = true;
+    for (int i = 0; i < 3; i++) {
+        const VkXYColorEXT a = vertex(i), b = vertex((i + 1) % 3), c = vertex((i + 2) % 3);
+        if (cross(a, b, point) * cross(a, b, c) < 0.0f) {
+            inside = false;
+        }
+    }
+    if (inside) {
+        return point;
+    }
+
+    VkXYColorEXT closest = point;
+    float closestDistance = std::numeric_limits<float>::max();
+    for (int i = 0; i < 3; i++) {
+        const VkXYColorEXT a = vertex(i), b = vertex((i + 1) % 3);
+        const float dx = b.x - a.x, dy = b.y - a.y;
+        const float t = std::clamp(((point.x - a.x) * dx + (point.y - a.y) * dy) / (dx * dx + dy * dy), 0.0f, 1.0f);
+        const VkXYColorEXT candidate = {a.x + t * dx, a.y + t * dy};
+        const float distance = (candidate.x - point.x) * (candidate.x - point.x) + (candidate.y - point.y) * (candidate.y - point.y);
+        if (distance < closestDistance) {
+            closest = candidate;
+            closestDistance = distance;
+        }
+    }
+    return closest;
+}
+
+// Clamps the mastering primaries of metadata to the container's primaries,
+// given as CIE xy chromaticities (red, green, blue, white).
+static void ClampToContainer(VkHdrMetadataEXT *metadata, const std::array<float, 8> &container)
+{
+    metadata->displayPrimaryRed = ClampToTriangle(metadata->displayPrimaryRed, container);
+    metadata->displayPrimaryGreen = ClampToTriangle(metadata->displayPrimaryGreen, container);
+    metadata->displayPrimaryBlue = ClampToTriangle(metadata->displayPrimaryBlue, container);
+    metadata->whitePoint = ClampToTriangle(metadata->whitePoint, container);
+}
+
+// The metadata sent to the compositor: the application's, or the preferred
+// description if it didn't set any, see HDR_WSI_CLAMP_METADATA.
+static VkHdrMetadataEXT EffectiveMetadata(const HdrSwapchainData *hdrSwapchain)
+{
+    if (!hdrSwapchain->preferredMetadata) {
+        return hdrSwapchain->metadata;
+    }
+    const VkHdrMetadataEXT &preferred = *hdrSwapchain->preferredMetadata;
+    if (!hdrSwapchain->hasMetadata) {
+        return preferred;
+    }
+    if (!s_clampMetadata) {
+        return hdrSwapchain->metadata;
+    }
+    VkHdrMetadataEXT metadata = hdrSwapchain->metadata;
+    metadata.maxLuminance = std::min(metadata.maxLuminance, preferred.maxLuminance);
+    metadata.minLuminance = std::max(metadata.minLuminance, preferred.minLuminance);
+    metadata.maxContentLightLevel = std::min(metadata.maxContentLightLevel, preferred.maxContentLightLevel);
+    metadata.maxFrameAverageLightLevel = std::min(metadata.maxFrameAverageLightLevel, preferred.maxFrameAverageLightLevel);
+    return metadata;
+}
+
+// Whether the application's event loop read events for the layer's queue
+// that no listener ran for yet. Doesn't take the display's lock.
+static bool HasQueuedEvents(wl_display *display, wl_event_queue *queue)
+{
+    if (wl_display_prepare_read_queue(display, queue) != 0) {
+        return true;
+    }
+    wl_display_cancel_read(display);
+    return false;
+}
+
+// Picks up changes of the surface's preferred description, and marks the
+// swapchain dirty if they change the metadata it sends. The display is only
+// locked if there are events to dispatch or the description changed, so
+// presents to the display's other surfaces don't serialize on it.
+static void UpdatePreferred(HdrSwapchainData *hdrSwapchain)
+{
+    HdrSurfaceData *hdrSurface = hdrSwapchain->hdrSurface;
+    // The application's event loop reads the compositor's events into the
+    // layer's queue too, this only runs the listeners of those already read.
+    // The queue is fixed while the display has surfaces.
+    if (HasQueuedEvents(hdrSurface->display, hdrSurface->hdrDisplay->queue)) {
+        auto hdrDisplay = HdrDisplay::get(hdrSurface->display);
+        wl_display_dispatch_queue_pending(hdrSurface->display, hdrDisplay->queue);
+    }
+    if (hdrSurface->preferredSerial.load() == hdrSwapchain->preferredSerial) {
+        return;
+    }
+
+    auto hdrDisplay = HdrDisplay::get(hdrSurface->display);
+    const VkHdrMetadataEXT previous = EffectiveMetadata(hdrSwapchain);
+    hdrSwapchain->preferredMetadata = hdrSurface->preferredMetadata;
+    hdrSwapchain->preferredSerial = hdrSurface->preferredSerial.load();
+
+    // The target display's gamut can be wider than the swapchain's container,
+    // e.g. for sRGB or scRGB swapchains. Mastering primaries outside of the
+    // container are only allowed with the extended target volume feature.
+    const ColorDescription *desc = FindColorDescription(hdrSwapchain->colorSpace);
+    const bool extendedTargetVolume = std::visit([&](const auto &state) {
+        return std::decay_t<decltype(state)>::Backend::SupportsExtendedTargetVolume(hdrDisplay.get());
+    }, hdrSwapchain->state);
+    if (hdrSwapchain->preferredMetadata && desc && !extendedTargetVolume) {
+        ClampToContainer(&*hdrSwapchain->preferredMetadata, desc->chromaticities);
+    }
+    if (!IsSameMetadata(previous, EffectiveMetadata(hdrSwapchain))) {
+        hdrSwapchain->desc_dirty = true;
+    }
+}
+
+// Whether a metadata change has to wait for a later present, because the
+// previous one was applied too recently.
+static bool IsRateLimited(const HdrSwapchainData *hdrSwapchain)
+{
+    return s_metadataMinInterval.count() > 0
+        && !hdrSwapchain->descPending
+        && std::chrono::steady_clock::now() - hdrSwapchain->descAppliedTime < s_metadataMinInterval;
+}
+
+// Ends the description change of a swapchain that was applied or given up.
+static void FinishDescriptionChange(HdrSwapchainData *hdrSwapchain, DescStatus status)
+{
+    if (status == READY) {
+        const uint64_t frames = hdrSwapchain->presentCount - hdrSwapchain->descChangeFrame;
+        hdrSwapchain->lastDescLatencyFrames = frames;
+        hdrSwapchain->maxDescLatencyFrames = std::max(hdrSwapchain->maxDescLatencyFrames, frames);
+        Log(LOG_DEBUG, "image description applied after %" PRIu64 " frames", frames);
+        SetStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::lastDescLatencyFrames, frames);
+        SetStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::maxDescLatencyFrames, hdrSwapchain->maxDescLatencyFrames);
+        CountStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::descriptionUpdates);
+    } else if (status == FAILED) {
+        CountStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::failedDescriptions);
+    }
+    hdrSwapchain->descPending = false;
+    hdrSwapchain->descApplied = hdrSwapchain->descApplied || status == READY;
+    hdrSwapchain->descAppliedTime = std::chrono::steady_clock::now();
+    hdrSwapchain->desc_dirty = false;
+}
 
 class VkDeviceOverrides
 {
@@ -542,6 +3380,23 @@ public:
         VkSwapchainKHR swapchain,
         const VkAllocationCallbacks *pAllocator)
     {
+        if (HdrSwapchain::empty()) {
+            pDispatch->DestroySwapchainKHR(device, swapchain, pAllocator);
+            return;
+        }
+
+        EntryPointTimer timer(HdrWsiStats::DESTROY_SWAPCHAIN);
+        RecordedCall<HdrWsiRecord::DestroySwapchain> record(HdrWsiRecord::DESTROY_SWAPCHAIN);
+        record.payload.swapchain = HandleId(swapchain);
+        if (auto hdrSwapchain = HdrSwapchain::get(swapchain)) {
+            if (hdrSwapchain->suppressedMetadataUpdates || hdrSwapchain->coalescedMetadataUpdates) {
+                Log(LOG_INFO, "HDR metadata updates: %" PRIu64 " accepted, %" PRIu64 " suppressed, %" PRIu64 " coalesced",
+                    hdrSwapchain->metadataUpdates, hdrSwapchain->suppressedMetadataUpdates, hdrSwapchain->coalescedMetadataUpdates);
+            }
+            s_stats.RemoveSwapchain(hdrSwapchain->stats);
+        } else {
+            record.Discard();
+        }
         HdrSwapchain::remove(swapchain);
         pDispatch->DestroySwapchainKHR(device, swapchain, pAllocator);
     }
@@ -553,119 +3408,112 @@ public:
         const VkAllocationCallbacks *pAllocator,
         VkSwapchainKHR *pSwapchain)
     {
-        auto hdrSurface = HdrSurface::get(pCreateInfo->surface);
+        if (HdrSurface::empty()) {
+            return pDispatch->CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
+        }
+
+        EntryPointTimer timer(HdrWsiStats::CREATE_SWAPCHAIN);
+        TraceSpan span("vkCreateSwapchainKHR", pCreateInfo->surface);
+
+        // Swapchains get recreated all the time while resizing. With the same
+        // colorspace, the HDR state of the old one carries over unchanged, and
+        // the description already set on the wl_surface doesn't need to be re-sent.
+        // The old swapchain is copied before the surface gets locked, keeping
+        // the swapchain -> surface lock order.
+        std::optional<HdrSwapchainData> oldHdrSwapchain;
+        if (auto hdrSwapchain = HdrSwapchain::get(pCreateInfo->oldSwapchain)) {
+            if (hdrSwapchain->surface == pCreateInfo->surface && hdrSwapchain->colorSpace == pCreateInfo->imageColorSpace) {
+                oldHdrSwapchain = *hdrSwapchain.get();
+                // the statistics move on with the new swapchain
+                hdrSwapchain->metadataUpdates = 0;
+                hdrSwapchain->suppressedMetadataUpdates = 0;
+                hdrSwapchain->coalescedMetadataUpdates = 0;
+            }
+        }
+
+        auto hdrSurface = VkInstanceOverrides::GetColorSurface(pCreateInfo->surface);
         if (!hdrSurface)
             return pDispatch->CreateSwapchainKHR(device, pCreateInfo, pAllocator, pSwapchain);
 
-        VkSwapchainCreateInfoKHR swapchainInfo = *pCreateInfo;
+        RecordedCall<HdrWsiRecord::CreateSwapchain> record(HdrWsiRecord::CREATE_SWAPCHAIN);
+        record.payload = {
+            .surface = HandleId(pCreateInfo->surface),
+            .oldSwapchain = HandleId(pCreateInfo->oldSwapchain),
+            .format = uint32_t(pCreateInfo->imageFormat),
+            .colorSpace = uint32_t(pCreateInfo->imageColorSpace),
+            .result = VK_ERROR_INITIALIZATION_FAILED,
+        };
 
-        if (hdrSurface) {
-            // If this is a custom surface, force the colorspace to something the driver won't touch
-            if (hdrSurface->supportsPassthrough) {
-                swapchainInfo.imageColorSpace = VK_COLOR_SPACE_PASS_THROUGH_EXT;
-            } else {
-                swapchainInfo.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
-            }
+        const SurfaceFormatCache *surfaceFormats = nullptr;
+        VkResult result = VkInstanceOverrides::GetSurfaceFormats(pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch,
+                                                                 pDispatch->PhysicalDevice,
+                                                                 pCreateInfo->surface,
+                                                                 hdrSurface.get(),
+                                                                 &surfaceFormats);
+        if (result != VK_SUCCESS) {
+            record.payload.result = result;
+            return result;
+        }
 
-            fprintf(stderr, "[HDR Layer] Creating swapchain for id: %u - format: %s - colorspace: %s\n",
-                    wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(hdrSurface->surface)),
-                    vkroots::helpers::enumString(pCreateInfo->imageFormat),
-                    vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
+        VkSwapchainCreateInfoKHR swapchainInfo = *pCreateInfo;
+
+        // If this is a custom surface, force the colorspace to something the driver won't touch
+        if (surfaceFormats->supportsPassthrough) {
+            swapchainInfo.imageColorSpace = VK_COLOR_SPACE_PASS_THROUGH_EXT;
+        } else {
+            swapchainInfo.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
         }
 
+        Log(LOG_INFO, "Creating swapchain for id: %u - format: %s - colorspace: %s",
+            wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(hdrSurface->surface)),
+            vkroots::helpers::enumString(pCreateInfo->imageFormat),
+            vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
+
         // Check for VkFormat support and return VK_ERROR_INITIALIZATION_FAILED
         // if that VkFormat is unsupported for the underlying surface.
-        {
-            std::vector<VkSurfaceFormatKHR> supportedSurfaceFormats;
-            vkroots::helpers::enumerate(
-                pDispatch->pPhysicalDeviceDispatch->pInstanceDispatch->GetPhysicalDeviceSurfaceFormatsKHR,
-                supportedSurfaceFormats,
-                pDispatch->PhysicalDevice,
-                swapchainInfo.surface);
-
-            bool supportedSwapchainFormat = std::ranges::find_if(supportedSurfaceFormats, [=](VkSurfaceFormatKHR value) {
-                return value.format == swapchainInfo.imageFormat;
-            }) != supportedSurfaceFormats.end();
-
-            if (!supportedSwapchainFormat) {
-                fprintf(stderr, "[HDR Layer] Refusing to make swapchain (unsupported VkFormat) for id: %u - format: %s - colorspace: %s\n",
-                        wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(hdrSurface->surface)),
-                        vkroots::helpers::enumString(pCreateInfo->imageFormat),
-                        vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
-
-                return VK_ERROR_INITIALIZATION_FAILED;
-            }
-        }
-
-        VkResult result = pDispatch->CreateSwapchainKHR(device, &swapchainInfo, pAllocator, pSwapchain);
-        if (hdrSurface && result == VK_SUCCESS) {
-            if (hdrSurface->frogColorSurface) {
-                // alpha mode is ignored
-                frog_color_managed_surface_primaries frogPrimaries = FROG_COLOR_MANAGED_SURFACE_PRIMARIES_UNDEFINED;
-                frog_color_managed_surface_transfer_function tf = FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED;
-                for (auto desc = s_ExtraHDRSurfaceFormats.begin(); desc != s_ExtraHDRSurfaceFormats.end(); ++desc) {
-                    if (desc->surface.surfaceFormat.colorSpace == pCreateInfo->imageColorSpace) {
-                        frogPrimaries = desc->frogPrimaries;
-                        tf = desc->frogTransferFunction;
-                        break;
-                    }
-                }
+        const bool supportedSwapchainFormat = std::ranges::any_of(surfaceFormats->formats, [&swapchainInfo](const VkSurfaceFormatKHR value) {
+            return value.format == swapchainInfo.imageFormat;
+        });
+        if (!supportedSwapchainFormat) {
+            Log(LOG_ERROR, "Refusing to make swapchain (unsupported VkFormat) for id: %u - format: %s - colorspace: %s",
+                wl_proxy_get_id(reinterpret_cast<struct wl_proxy *>(hdrSurface->surface)),
+                vkroots::helpers::enumString(pCreateInfo->imageFormat),
+                vkroots::helpers::enumString(pCreateInfo->imageColorSpace));
 
-                if (frogPrimaries == 0 && tf == 0 && pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-                    fprintf(stderr, "[HDR Layer] Unknown color space, assuming untagged\n");
-                };
+            return VK_ERROR_INITIALIZATION_FAILED;
+        }
 
-                HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                    .surface = pCreateInfo->surface,
-                    .frogPrimaries = frogPrimaries,
-                    .tf = tf,
-                    .desc_dirty = true,
-                });
-            } else if (hdrSurface->colorSurface) {
-                const auto it = std::ranges::find_if(s_ExtraHDRSurfaceFormats, [&pCreateInfo](const ColorDescription &description) {
-                    return description.surface.surfaceFormat.colorSpace == pCreateInfo->imageColorSpace;
-                });
-                if (it != s_ExtraHDRSurfaceFormats.end()) {
-                    const auto &description = *it;
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .primaries = description.primaries,
-                        .transferFunction = description.transferFunction,
-                        .desc_dirty = true,
-                    });
-                } else {
-                    if (pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-                        fprintf(stderr, "[HDR Layer] Unknown colorspace %d, assuming untagged\n", pCreateInfo->imageColorSpace);
-                    }
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .untagged = true,
-                        .desc_dirty = true,
-                    });
-                }
-            } else {
-                const auto it = std::ranges::find_if(s_ExtraHDRSurfaceFormats, [&pCreateInfo](const ColorDescription &description) {
-                    return description.surface.surfaceFormat.colorSpace == pCreateInfo->imageColorSpace;
-                });
-                if (it != s_ExtraHDRSurfaceFormats.end()) {
-                    const auto &description = *it;
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .xxPrimaries = description.xxPrimaries,
-                        .xxTransferFunction = description.xxTransferFunction,
-                        .desc_dirty = true,
-                    });
-                } else {
-                    if (pCreateInfo->imageColorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-                        fprintf(stderr, "[HDR Layer] Unknown colorspace %d, assuming untagged\n", pCreateInfo->imageColorSpace);
-                    }
-                    HdrSwapchain::create(*pSwapchain, HdrSwapchainData{
-                        .surface = pCreateInfo->surface,
-                        .xxUntagged = true,
-                        .desc_dirty = true,
-                    });
-                }
+        result = pDispatch->CreateSwapchainKHR(device, &swapchainInfo, pAllocator, pSwapchain);
+        record.payload.result = result;
+        if (result == VK_SUCCESS) {
+            record.payload.swapchain = HandleId(*pSwapchain);
+            span.SetId(*pSwapchain);
+            span.SetProtocol(ProtocolName(hdrSurface->colorSurface));
+        }
+        if (hdrSurface && result == VK_SUCCESS && oldHdrSwapchain) {
+            oldHdrSwapchain->stats = s_stats.AddSwapchain(HandleId(*pSwapchain), HandleId(pCreateInfo->surface), pCreateInfo->imageColorSpace);
+            HdrSwapchain::create(*pSwapchain, *oldHdrSwapchain);
+        } else if (hdrSurface && result == VK_SUCCESS) {
+            HdrSwapchainData hdrSwapchain = {
+                .surface = pCreateInfo->surface,
+                .hdrSurface = hdrSurface.get(),
+                .colorSpace = pCreateInfo->imageColorSpace,
+                .desc_dirty = true,
+                .stats = s_stats.AddSwapchain(HandleId(*pSwapchain), HandleId(pCreateInfo->surface), pCreateInfo->imageColorSpace),
+            };
+            VisitColorSurface(hdrSurface->colorSurface, [&](auto backend, auto *) {
+                hdrSwapchain.state = decltype(backend)::CreateSwapchainState(pCreateInfo->imageColorSpace);
+            });
+            if (hdrSurface->tracksPreferred) {
+                UpdatePreferred(&hdrSwapchain);
             }
+
+            // The colorspace is known now, so the compositor can already
+            // create the description for the first present
+            std::visit([&](const auto &state) {
+                std::decay_t<decltype(state)>::Backend::Prewarm(hdrSurface.get(), state, EffectiveMetadata(&hdrSwapchain));
+            }, hdrSwapchain.state);
+            HdrSwapchain::create(*pSwapchain, std::move(hdrSwapchain));
         }
         return result;
     }
@@ -678,26 +3526,50 @@ public:
         const VkSwapchainKHR *pSwapchains,
         const VkHdrMetadataEXT *pMetadata)
     {
+        // The layer implements VK_EXT_hdr_metadata itself, the driver never
+        // sees the metadata. Without HDR swapchains there's nothing to keep.
+        if (HdrSwapchain::empty()) {
+            return;
+        }
+
+        EntryPointTimer timer(HdrWsiStats::SET_HDR_METADATA);
         for (uint32_t i = 0; i < swapchainCount; i++) {
+            TraceSpan span("vkSetHdrMetadataEXT", pSwapchains[i]);
+            RecordedCall<HdrWsiRecord::SetHdrMetadata> record(HdrWsiRecord::SET_HDR_METADATA);
+            record.payload = {
+                .swapchain = HandleId(pSwapchains[i]),
+                .displayPrimaryRed = {pMetadata[i].displayPrimaryRed.x, pMetadata[i].displayPrimaryRed.y},
+                .displayPrimaryGreen = {pMetadata[i].displayPrimaryGreen.x, pMetadata[i].displayPrimaryGreen.y},
+                .displayPrimaryBlue = {pMetadata[i].displayPrimaryBlue.x, pMetadata[i].displayPrimaryBlue.y},
+                .whitePoint = {pMetadata[i].whitePoint.x, pMetadata[i].whitePoint.y},
+                .maxLuminance = pMetadata[i].maxLuminance,
+                .minLuminance = pMetadata[i].minLuminance,
+                .maxContentLightLevel = pMetadata[i].maxContentLightLevel,
+                .maxFrameAverageLightLevel = pMetadata[i].maxFrameAverageLightLevel,
+            };
             auto hdrSwapchain = HdrSwapchain::get(pSwapchains[i]);
             if (!hdrSwapchain) {
-                fprintf(stderr, "[HDR Layer] SetHdrMetadataEXT: Swapchain %u does not support HDR.\n", i);
+                Log(LOG_DEBUG, "SetHdrMetadataEXT: Swapchain %u does not support HDR.", i);
+                record.Discard();
                 continue;
             }
 
-            auto hdrSurface = HdrSurface::get(hdrSwapchain->surface);
-            if (!hdrSurface) {
-                fprintf(stderr, "[HDR Layer] SetHdrMetadataEXT: Surface for swapchain %u was already destroyed. (App use after free).\n", i);
-                abort();
-            }
-
             const VkHdrMetadataEXT &metadata = pMetadata[i];
+            if (IsSameMetadata(hdrSwapchain->metadata, metadata) || IsWithinHysteresis(hdrSwapchain->metadata, metadata)) {
+                hdrSwapchain->suppressedMetadataUpdates++;
+                CountStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::suppressedMetadataUpdates);
+                continue;
+            }
 
-            fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: mastering luminance min %f nits, max %f nits\n", metadata.minLuminance, metadata.maxLuminance);
-            fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxContentLightLevel %f nits\n", metadata.maxContentLightLevel);
-            fprintf(stderr, "[HDR Layer] VkHdrMetadataEXT: maxFrameAverageLightLevel %f nits\n", metadata.maxFrameAverageLightLevel);
+            Log(LOG_DEBUG, "VkHdrMetadataEXT: mastering luminance min %f nits, max %f nits, maxContentLightLevel %f nits, maxFrameAverageLightLevel %f nits",
+                metadata.minLuminance, metadata.maxLuminance, metadata.maxContentLightLevel, metadata.maxFrameAverageLightLevel);
 
+            hdrSwapchain->metadataUpdates++;
+            if (hdrSwapchain->desc_dirty && !hdrSwapchain->descPending) {
+                hdrSwapchain->coalescedMetadataUpdates++;
+            }
             hdrSwapchain->metadata = metadata;
+            hdrSwapchain->hasMetadata = true;
             hdrSwapchain->desc_dirty = true;
         }
     }
@@ -707,112 +3579,113 @@ public:
         VkQueue queue,
         const VkPresentInfoKHR *pPresentInfo)
     {
+        // Swapchains are only tracked for HDR surfaces, processes without
+        // any (X11, headless, no color management) go straight to the driver
+        if (HdrSwapchain::empty()) {
+            return pDispatch->QueuePresentKHR(queue, pPresentInfo);
+        }
+
+        EntryPointTimer timer(HdrWsiStats::QUEUE_PRESENT_CLEAN);
+        RecordedCall<HdrWsiRecord::QueuePresent> record(HdrWsiRecord::QUEUE_PRESENT);
+        record.payload.queue = HandleId(queue);
+
+        // The descriptions of all dirty swapchains are requested first, so a
+        // present to multiple swapchains only flushes and waits once
+        std::vector<PresentDescription> descriptions;
+        std::chrono::milliseconds maxWait = s_descriptionWait;
         for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
-            if (auto hdrSwapchain = HdrSwapchain::get(pPresentInfo->pSwapchains[i])) {
-                if (hdrSwapchain->desc_dirty) {
-                    auto hdrSurface = HdrSurface::get(hdrSwapchain->surface);
-                    const auto &metadata = hdrSwapchain->metadata;
-                    if (hdrSurface->frogColorSurface) {
-                        frog_color_managed_surface_set_known_container_color_volume(hdrSurface->frogColorSurface, hdrSwapchain->frogPrimaries);
-                        frog_color_managed_surface_set_known_transfer_function(hdrSurface->frogColorSurface, hdrSwapchain->tf);
-                        frog_color_managed_surface_set_hdr_metadata(hdrSurface->frogColorSurface,
-                                                                    uint32_t(round(metadata.displayPrimaryRed.x * 10000.0)),
-                                                                    uint32_t(round(metadata.displayPrimaryRed.y * 10000.0)),
-                                                                    uint32_t(round(metadata.displayPrimaryGreen.x * 10000.0)),
-                                                                    uint32_t(round(metadata.displayPrimaryGreen.y * 10000.0)),
-                                                                    uint32_t(round(metadata.displayPrimaryBlue.x * 10000.0)),
-                                                                    uint32_t(round(metadata.displayPrimaryBlue.y * 10000.0)),
-                                                                    uint32_t(round(metadata.whitePoint.x * 10000.0)),
-                                                                    uint32_t(round(metadata.whitePoint.y * 10000.0)),
-                                                                    uint32_t(round(metadata.maxLuminance)),
-                                                                    uint32_t(round(metadata.minLuminance * 10000.0)),
-                                                                    uint32_t(round(metadata.maxContentLightLevel)),
-                                                                    uint32_t(round(metadata.maxFrameAverageLightLevel)));
-                    } else if (hdrSurface->colorSurface) {
-                        if (hdrSwapchain->untagged) {
-                            wp_color_management_surface_v1_unset_image_description(hdrSurface->colorSurface);
-                        } else {
-                            constexpr double primaryUnit = 1'000'000.0;
-                            const auto creator = wp_color_manager_v1_create_parametric_creator(hdrSurface->colorManager);
-                            wp_image_description_creator_params_v1_set_primaries_named(creator, hdrSwapchain->primaries);
-                            wp_image_description_creator_params_v1_set_tf_named(creator, hdrSwapchain->transferFunction);
-                            wp_image_description_creator_params_v1_set_max_fall(creator, std::round(metadata.maxFrameAverageLightLevel));
-                            wp_image_description_creator_params_v1_set_max_cll(creator, std::round(metadata.maxContentLightLevel));
-                            const bool hasMasteringPrimaries = std::ranges::find(hdrSurface->supportedFeatures, WP_COLOR_MANAGER_V1_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES) != hdrSurface->supportedFeatures.end();
-                            if (hasMasteringPrimaries) {
-                                wp_image_description_creator_params_v1_set_mastering_luminance(creator, std::round(metadata.minLuminance * 10'000.0), std::round(metadata.maxLuminance));
-                                wp_image_description_creator_params_v1_set_mastering_display_primaries(creator,
-                                                                                                       std::round(metadata.displayPrimaryRed.x * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryRed.y * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryGreen.x * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryGreen.y * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryBlue.x * primaryUnit),
-                                                                                                       std::round(metadata.displayPrimaryBlue.y * primaryUnit),
-                                                                                                       std::round(metadata.whitePoint.x * primaryUnit),
-                                                                                                       std::round(metadata.whitePoint.y * primaryUnit));
-                            }
-                            const bool hasCustomLuminance = std::ranges::find(hdrSurface->supportedFeatures, WP_COLOR_MANAGER_V1_FEATURE_SET_LUMINANCES) != hdrSurface->supportedFeatures.end();
-                            if (hasCustomLuminance && hdrSwapchain->transferFunction == WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR) {
-                                // NOTE that this assumes that this is Windows-style scRGB
-                                wp_image_description_creator_params_v1_set_luminances(creator, 0, 80, 203);
-                            }
-                            const auto imageDescription = wp_image_description_creator_params_v1_create(creator);
-
-                            bool done = false;
-                            wp_image_description_v1_add_listener(imageDescription, &s_imageDescriptionListener, &done);
-                            wl_display_dispatch_queue(hdrSurface->display, hdrSurface->queue);
-                            // In theory the compositor could wait for a while here. In practice it doesn't.
-                            while (!done) {
-                                wl_display_roundtrip_queue(hdrSurface->display, hdrSurface->queue);
-                            }
-                            wp_color_management_surface_v1_set_image_description(hdrSurface->colorSurface, imageDescription, WP_COLOR_MANAGER_V1_RENDER_INTENT_PERCEPTUAL);
-                            wp_image_description_v1_destroy(imageDescription);
-                        }
-                    } else if (hdrSwapchain->xxUntagged) {
-                        xx_color_management_surface_v4_unset_image_description(hdrSurface->xxColorSurface);
-                    } else {
-                        const auto creator = xx_color_manager_v4_new_parametric_creator(hdrSurface->xxColorManager);
-                        xx_image_description_creator_params_v4_set_primaries_named(creator, hdrSwapchain->xxPrimaries);
-                        xx_image_description_creator_params_v4_set_tf_named(creator, hdrSwapchain->xxTransferFunction);
-                        xx_image_description_creator_params_v4_set_max_fall(creator, std::round(metadata.maxFrameAverageLightLevel));
-                        xx_image_description_creator_params_v4_set_max_cll(creator, std::round(metadata.maxContentLightLevel));
-                        const bool hasMasteringPrimaries = std::ranges::find(hdrSurface->xxSupportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES) != hdrSurface->xxSupportedFeatures.end();
-                        if (hasMasteringPrimaries) {
-                            xx_image_description_creator_params_v4_set_mastering_luminance(creator, std::round(metadata.minLuminance * 10'000.0), std::round(metadata.maxLuminance));
-                            xx_image_description_creator_params_v4_set_mastering_display_primaries(creator,
-                                std::round(metadata.displayPrimaryRed.x * 10000.0),
-                                std::round(metadata.displayPrimaryRed.y * 10000.0),
-                                std::round(metadata.displayPrimaryGreen.x * 10000.0),
-                                std::round(metadata.displayPrimaryGreen.y * 10000.0),
-                                std::round(metadata.displayPrimaryBlue.x * 10000.0),
-                                std::round(metadata.displayPrimaryBlue.y * 10000.0),
-                                std::round(metadata.whitePoint.x * 10000.0),
-                                std::round(metadata.whitePoint.y * 10000.0)
-                            );
-                        }
-                        const bool hasCustomLuminance = std::ranges::find(hdrSurface->xxSupportedFeatures, XX_COLOR_MANAGER_V4_FEATURE_SET_LUMINANCES) != hdrSurface->xxSupportedFeatures.end();
-                        if (hasCustomLuminance && hdrSwapchain->xxTransferFunction == XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR) {
-                            // NOTE that this assumes that this is Windows-style scRGB
-                            xx_image_description_creator_params_v4_set_luminances(creator, 0, 80, 203);
-                        }
-                        const auto imageDescription = xx_image_description_creator_params_v4_create(creator);
-
-                        bool done = false;
-                        xx_image_description_v4_add_listener(imageDescription, &s_xxImageDescriptionListener, &done);
-                        wl_display_dispatch_queue(hdrSurface->display, hdrSurface->queue);
-                        // In theory the compositor could wait for a while here. In practice it doesn't.
-                        while (!done) {
-                            wl_display_roundtrip_queue(hdrSurface->display, hdrSurface->queue);
-                        }
-                        xx_color_management_surface_v4_set_image_description(hdrSurface->xxColorSurface, imageDescription, XX_COLOR_MANAGER_V4_RENDER_INTENT_PERCEPTUAL);
-                        xx_image_description_v4_destroy(imageDescription);
-                    }
-                    hdrSwapchain->desc_dirty = false;
+            auto hdrSwapchain = HdrSwapchain::get(pPresentInfo->pSwapchains[i]);
+            if (!hdrSwapchain) {
+                continue;
+            }
+            if (s_recordPath) {
+                record.tail.push_back(HandleId(pPresentInfo->pSwapchains[i]));
+            }
+            hdrSwapchain->presentCount++;
+            CountStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::presents);
+            if (hdrSwapchain->hdrSurface->tracksPreferred) {
+                UpdatePreferred(hdrSwapchain.get());
+            }
+            if (!hdrSwapchain->desc_dirty || IsRateLimited(hdrSwapchain.get())) {
+                continue;
+            }
+            timer.SetEntryPoint(HdrWsiStats::QUEUE_PRESENT_DIRTY);
+
+            HdrSurfaceData *hdrSurface = hdrSwapchain->hdrSurface;
+            if (!hdrSwapchain->descPending) {
+                hdrSwapchain->descPending = true;
+                hdrSwapchain->descChangeFrame = hdrSwapchain->presentCount;
+                hdrSwapchain->descChangeTime = std::chrono::steady_clock::now();
+            }
+
+            PresentDescription description = {
+                .swapchain = pPresentInfo->pSwapchains[i],
+                .display = hdrSurface->display,
+            };
+            const bool updated = std::visit([&](const auto &state) {
+                using Backend = typename std::decay_t<decltype(state)>::Backend;
+                TraceSpan span("update image description", description.swapchain, Backend::name);
+                return Backend::UpdateDescription(hdrSurface, state, EffectiveMetadata(hdrSwapchain.get()), description);
+            }, hdrSwapchain->state);
+            if (updated) {
+                FinishDescriptionChange(hdrSwapchain.get(), READY);
+            } else {
+                TraceSpan span("request image description", description.swapchain, ProtocolName(hdrSurface->colorSurface));
+                if (RequestImageDescription(hdrSurface, description.params)) {
+                    CountStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::descriptionRequests);
+                }
+                descriptions.push_back(description);
+                // without an earlier description to keep, the frame would go
+                // out untagged
+                if (!hdrSwapchain->descApplied) {
+                    maxWait = std::max(maxWait, s_descriptionTimeout);
+                }
+            }
+        }
+
+        if (!descriptions.empty()) {
+            const auto waitStart = std::chrono::steady_clock::now();
+            {
+                TraceSpan span("wait for image descriptions", queue);
+                WaitForImageDescriptions(descriptions, maxWait);
+            }
+            const auto blocked = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - waitStart);
+
+            for (const auto &description : descriptions) {
+                auto hdrSwapchain = HdrSwapchain::get(description.swapchain);
+                if (!hdrSwapchain) {
+                    continue;
+                }
+                CountStat(hdrSwapchain->stats, &HdrWsiStats::SwapchainStats::blockedNs, uint64_t(blocked.count()));
+                HdrSurfaceData *hdrSurface = hdrSwapchain->hdrSurface;
+                TraceSpan span("apply image description", description.swapchain, ProtocolName(hdrSurface->colorSurface));
+                DescStatus status = ApplyImageDescription(hdrSurface, description);
+                if (status == WAITING && std::chrono::steady_clock::now() - hdrSwapchain->descChangeTime > s_descriptionTimeout) {
+                    Log(LOG_WARNING, "compositor didn't create image description in time, keeping the previous one");
+                    DropImageDescription(hdrSurface, description.params);
+                    status = FAILED;
+                }
+                if (status != WAITING) {
+                    FinishDescriptionChange(hdrSwapchain.get(), status);
                 }
             }
         }
 
-        return pDispatch->QueuePresentKHR(queue, pPresentInfo);
+        // the driver's part of the present isn't the layer's overhead
+        const auto overhead = std::chrono::duration_cast<std::chrono::microseconds>(timer.Stop());
+        if (auto segment = s_stats.Segment()) {
+            const auto bucket = std::min<size_t>(std::bit_width(uint64_t(overhead.count())), HdrWsiStats::s_histogramBuckets - 1);
+            segment->presentOverhead[bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // only the HDR swapchains of the present are recorded
+        record.payload.swapchainCount = uint32_t(record.tail.size());
+        if (record.tail.empty()) {
+            record.Discard();
+        }
+        const VkResult result = pDispatch->QueuePresentKHR(queue, pPresentInfo);
+        record.payload.result = result;
+        return result;
     }
 };
 }
@@ -820,6 +3693,3 @@ public:
 VKROOTS_DEFINE_LAYER_INTERFACES(HdrLayer::VkInstanceOverrides,
                                 vkroots::NoOverrides,
                                 HdrLayer::VkDeviceOverrides);
-
-VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrSurface);
-VKROOTS_IMPLEMENT_SYNCHRONIZED_MAP_TYPE(HdrLayer::HdrSwapchain);
@@ -0,0 +1,183 @@
+// hdr-wsi-dump: prints a call log written by the layer with
+// HDR_WSI_RECORD=<path>, see hdr_wsi_record.h.
+
+#include "hdr_wsi_record.h"
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+struct TypeSummary {
+    uint64_t calls = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+};
+
+template <typename Payload>
+static bool ReadPayload(const std::vector<std::byte> &data, Payload &payload)
+{
+    if (data.size() < sizeof(Payload)) {
+        return false;
+    }
+    memcpy(&payload, data.data(), sizeof(Payload));
+    return true;
+}
+
+static void PrintRecord(const HdrWsiRecord::RecordHeader &header, const std::vector<std::byte> &data)
+{
+    printf("%14.6f ms %5u %-38s %10.3f us ",
+           double(header.timeNs) / 1e6, header.thread, HdrWsiRecord::s_typeNames[header.type], double(header.durationNs) / 1e3);
+
+    switch (header.type) {
+    case HdrWsiRecord::CREATE_WAYLAND_SURFACE:
+        if (HdrWsiRecord::CreateWaylandSurface payload; ReadPayload(data, payload)) {
+            printf("surface 0x%" PRIx64 " wl_display 0x%" PRIx64 " wl_surface %u result %d",
+                   payload.surface, payload.display, payload.wlSurfaceId, payload.result);
+        }
+        break;
+    case HdrWsiRecord::DESTROY_SURFACE:
+        if (HdrWsiRecord::DestroySurface payload; ReadPayload(data, payload)) {
+            printf("surface 0x%" PRIx64, payload.surface);
+        }
+        break;
+    case HdrWsiRecord::GET_SURFACE_FORMATS:
+        if (HdrWsiRecord::GetSurfaceFormats payload; ReadPayload(data, payload)) {
+            printf("surface 0x%" PRIx64 " variant %u formats %u result %d",
+                   payload.surface, payload.variant, payload.formatCount, payload.result);
+        }
+        break;
+    case HdrWsiRecord::CREATE_SWAPCHAIN:
+        if (HdrWsiRecord::CreateSwapchain payload; ReadPayload(data, payload)) {
+            printf("swapchain 0x%" PRIx64 " surface 0x%" PRIx64 " old 0x%" PRIx64 " format %u colorspace %u result %d",
+                   payload.swapchain, payload.surface, payload.oldSwapchain, payload.format, payload.colorSpace, payload.result);
+        }
+        break;
+    case HdrWsiRecord::DESTROY_SWAPCHAIN:
+        if (HdrWsiRecord::DestroySwapchain payload; ReadPayload(data, payload)) {
+            printf("swapchain 0x%" PRIx64, payload.swapchain);
+        }
+        break;
+    case HdrWsiRecord::SET_HDR_METADATA:
+        if (HdrWsiRecord::SetHdrMetadata payload; ReadPayload(data, payload)) {
+            printf("swapchain 0x%" PRIx64 " mastering %.4f-%.1f nits MaxCLL %.1f MaxFALL %.1f"
+                   " primaries (%.4f,%.4f) (%.4f,%.4f) (%.4f,%.4f) white (%.4f,%.4f)",
+                   payload.swapchain, payload.minLuminance, payload.maxLuminance,
+                   payload.maxContentLightLevel, payload.maxFrameAverageLightLevel,
+                   payload.displayPrimaryRed[0], payload.displayPrimaryRed[1],
+                   payload.displayPrimaryGreen[0], payload.displayPrimaryGreen[1],
+                   payload.displayPrimaryBlue[0], payload.displayPrimaryBlue[1],
+                   payload.whitePoint[0], payload.whitePoint[1]);
+        }
+        break;
+    case HdrWsiRecord::QUEUE_PRESENT:
+        if (HdrWsiRecord::QueuePresent payload; ReadPayload(data, payload)) {
+            printf("queue 0x%" PRIx64 " result %d swapchains", payload.queue, payload.result);
+            const size_t count = std::min<size_t>(payload.swapchainCount, (data.size() - sizeof(payload)) / sizeof(uint64_t));
+            for (size_t i = 0; i < count; i++) {
+                uint64_t swapchain;
+                memcpy(&swapchain, data.data() + sizeof(payload) + i * sizeof(uint64_t), sizeof(swapchain));
+                printf(" 0x%" PRIx64, swapchain);
+            }
+        }
+        break;
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    bool summaryOnly = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        if (opt == 's') {
+            summaryOnly = true;
+        } else {
+            optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-s] <file>\n"
+                        "  -s  only print a summary per call type and of the present intervals\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (!file) {
+        fprintf(stderr, "can't open %s\n", argv[optind]);
+        return 1;
+    }
+
+    HdrWsiRecord::FileHeader fileHeader;
+    if (fread(&fileHeader, sizeof(fileHeader), 1, file) != 1 || fileHeader.magic != HdrWsiRecord::s_magic) {
+        fprintf(stderr, "%s isn't an HDR WSI call log\n", argv[optind]);
+        return 1;
+    }
+    if (fileHeader.version != HdrWsiRecord::s_version) {
+        fprintf(stderr, "%s has version %u, expected %u\n", argv[optind], fileHeader.version, HdrWsiRecord::s_version);
+        return 1;
+    }
+    printf("calls of process %u\n", fileHeader.pid);
+
+    std::array<TypeSummary, HdrWsiRecord::TYPE_COUNT> summaries = {};
+    uint64_t lastPresentNs = 0;
+    uint64_t presentIntervals = 0;
+    uint64_t totalIntervalNs = 0;
+    uint64_t maxIntervalNs = 0;
+    uint64_t maxIntervalAtNs = 0;
+
+    HdrWsiRecord::RecordHeader header;
+    std::vector<std::byte> data;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        data.resize(header.size);
+        if (fread(data.data(), 1, data.size(), file) != data.size()) {
+            fprintf(stderr, "truncated record at %.6f ms\n", double(header.timeNs) / 1e6);
+            break;
+        }
+        if (header.type >= HdrWsiRecord::TYPE_COUNT) {
+            fprintf(stderr, "unknown record type %u at %.6f ms\n", header.type, double(header.timeNs) / 1e6);
+            continue;
+        }
+
+        auto &summary = summaries[header.type];
+        summary.calls++;
+        summary.totalNs += header.durationNs;
+        summary.maxNs = std::max(summary.maxNs, header.durationNs);
+
+        if (header.type == HdrWsiRecord::QUEUE_PRESENT) {
+            if (lastPresentNs) {
+                const uint64_t interval = header.timeNs - lastPresentNs;
+                presentIntervals++;
+                totalIntervalNs += interval;
+                if (interval > maxIntervalNs) {
+                    maxIntervalNs = interval;
+                    maxIntervalAtNs = header.timeNs;
+                }
+            }
+            lastPresentNs = header.timeNs;
+        }
+
+        if (!summaryOnly) {
+            PrintRecord(header, data);
+        }
+    }
+    fclose(file);
+
+    printf("\n%-38s %10s %12s %12s\n", "call", "count", "mean us", "max us");
+    for (uint32_t i = 0; i < HdrWsiRecord::TYPE_COUNT; i++) {
+        const auto &summary = summaries[i];
+        if (summary.calls) {
+            printf("%-38s %10" PRIu64 " %12.3f %12.3f\n", HdrWsiRecord::s_typeNames[i], summary.calls,
+                   double(summary.totalNs) / double(summary.calls) / 1e3, double(summary.maxNs) / 1e3);
+        }
+    }
+    if (presentIntervals) {
+        printf("present interval: mean %.3f ms, max %.3f ms at %.6f ms\n",
+               double(totalIntervalNs) / double(presentIntervals) / 1e6, double(maxIntervalNs) / 1e6, double(maxIntervalAtNs) / 1e6);
+    }
+    return 0;
+}
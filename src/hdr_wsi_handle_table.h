@@ -0,0 +1,173 @@
+#pragma once
+
+// The table the layer keeps its displays, surfaces and swapchains in. It's in
+// a header of its own so the benchmarks can compare it with a mutex map.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace HdrLayer
+{
+
+// Read-mostly map for objects that are looked up far more often than they are
+// created or destroyed. Lookups don't take a global lock: the handles live in
+// an immutable table that writers replace, and a replaced table is only freed
+// once no reader can still use it.
+//
+// Readers register in one of two counters, picked by the parity of the
+// current epoch, for the duration of the lookup only. Writers publish the new
+// table, advance the epoch and wait for the lookups of the previous parity to
+// finish, which never block.
+//
+// Entries are reference counted, so a removed entry stays alive until the
+// last object returned from get is gone. The data of each entry has its own
+// mutex, held by that object. Holding it across blocking work only delays
+// users of the same entry, not writers of the table.
+template <typename Key, typename Data>
+class HandleTable
+{
+    struct Entry {
+        std::mutex mutex;
+        Data data;
+    };
+    // sorted by key
+    using Table = std::vector<std::pair<Key, std::shared_ptr<Entry>>>;
+
+    class ReadSection
+    {
+    public:
+        ReadSection()
+        {
+            for (;;) {
+                const uint32_t epoch = s_epoch.load();
+                s_readers[epoch & 1].fetch_add(1);
+                if (s_epoch.load() == epoch) {
+                    m_parity = epoch & 1;
+                    return;
+                }
+                // a writer advanced the epoch in between and might not wait for us
+                s_readers[epoch & 1].fetch_sub(1);
+            }
+        }
+
+        ~ReadSection()
+        {
+            s_readers[m_parity].fetch_sub(1, std::memory_order_release);
+        }
+
+        ReadSection(const ReadSection &) = delete;
+        ReadSection &operator=(const ReadSection &) = delete;
+
+    private:
+        int m_parity;
+    };
+
+public:
+    class Object
+    {
+    public:
+        Object() = default;
+
+        Data *get() const { return m_entry ? &m_entry->data : nullptr; }
+        Data *operator->() const { return get(); }
+        bool has() const { return m_entry != nullptr; }
+        operator bool() const { return has(); }
+
+    private:
+        friend class HandleTable;
+
+        explicit Object(std::shared_ptr<Entry> entry)
+            : m_entry{std::move(entry)}
+        {
+            if (m_entry) {
+                m_lock = std::unique_lock{m_entry->mutex};
+            }
+        }
+
+        // destroyed in reverse order, the entry is unlocked before it's released
+        std::shared_ptr<Entry> m_entry;
+        std::unique_lock<std::mutex> m_lock;
+    };
+
+    static Object get(const Key &key)
+    {
+        std::shared_ptr<Entry> entry;
+        {
+            ReadSection section;
+            entry = Find(s_table.load(std::memory_order_acquire), key);
+        }
+        return Object{std::move(entry)};
+    }
+
+    static Object create(const Key &key, Data data)
+    {
+        {
+            std::unique_lock lock{s_writeMutex};
+            const Table *table = s_table.load();
+            Table newTable = table ? *table : Table{};
+            const auto it = std::ranges::lower_bound(newTable, key, {}, &Table::value_type::first);
+            if (it == newTable.end() || it->first != key) {
+                newTable.insert(it, {key, std::shared_ptr<Entry>(new Entry{.data = std::move(data)})});
+                Publish(std::move(newTable));
+                s_size.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        return get(key);
+    }
+
+    // Cheaper than a lookup, for skipping all work when the table is empty.
+    static bool empty()
+    {
+        return s_size.load(std::memory_order_relaxed) == 0;
+    }
+
+    static bool remove(const Key &key)
+    {
+        std::unique_lock lock{s_writeMutex};
+        const Table *table = s_table.load();
+        if (!Find(table, key)) {
+            return false;
+        }
+        Table newTable = *table;
+        std::erase_if(newTable, [&key](const auto &value) { return value.first == key; });
+        Publish(std::move(newTable));
+        s_size.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    static std::shared_ptr<Entry> Find(const Table *table, const Key &key)
+    {
+        if (!table) {
+            return nullptr;
+        }
+        const auto it = std::ranges::lower_bound(*table, key, {}, &Table::value_type::first);
+        return it != table->end() && it->first == key ? it->second : nullptr;
+    }
+
+    // Replaces the table, returns once no lookup uses the previous one.
+    static void Publish(Table table)
+    {
+        const Table *oldTable = s_table.exchange(new Table(std::move(table)));
+        const uint32_t epoch = s_epoch.fetch_add(1);
+        while (s_readers[epoch & 1].load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+        delete oldTable;
+    }
+
+    static inline std::mutex s_writeMutex;
+    static inline std::atomic<const Table *> s_table = nullptr;
+    static inline std::atomic<uint32_t> s_epoch = 0;
+    static inline std::array<std::atomic<uint32_t>, 2> s_readers = {};
+    static inline std::atomic<size_t> s_size = 0;
+};
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+// Format of the call log the layer writes with HDR_WSI_RECORD=<path>, shared
+// between the layer and hdr-wsi-dump. The file is a FileHeader followed by
+// records in the order the calls returned, each a RecordHeader and `size`
+// bytes of the payload of its type. Everything is in the byte order of the
+// recorded process.
+//
+// Only calls for HDR surfaces and their swapchains are recorded. With
+// HDR_WSI_LAZY_PROBE, a surface's creation is recorded before it's known
+// whether the compositor supports HDR on it.
+
+#include <cstdint>
+
+namespace HdrWsiRecord
+{
+
+// bumped on every format change
+static constexpr uint32_t s_version = 1;
+static constexpr uint32_t s_magic = 0x52524448; // "HDRR"
+
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t reserved;
+};
+
+enum Type : uint32_t {
+    CREATE_WAYLAND_SURFACE,
+    DESTROY_SURFACE,
+    GET_SURFACE_FORMATS,
+    CREATE_SWAPCHAIN,
+    DESTROY_SWAPCHAIN,
+    SET_HDR_METADATA,
+    QUEUE_PRESENT,
+    TYPE_COUNT,
+};
+
+inline constexpr const char *s_typeNames[TYPE_COUNT] = {
+    "vkCreateWaylandSurfaceKHR",
+    "vkDestroySurfaceKHR",
+    "vkGetPhysicalDeviceSurfaceFormatsKHR",
+    "vkCreateSwapchainKHR",
+    "vkDestroySwapchainKHR",
+    "vkSetHdrMetadataEXT",
+    "vkQueuePresentKHR",
+};
+
+struct RecordHeader {
+    uint32_t type;
+    uint32_t size;
+    // start of the call, relative to the layer being loaded
+    uint64_t timeNs;
+    // of the whole call, including the driver
+    uint64_t durationNs;
+    // numbered in the order threads first made a recorded call
+    uint32_t thread;
+    uint32_t reserved;
+};
+
+// Handles are stored as 64 bit integers, results as VkResult.
+
+struct CreateWaylandSurface {
+    uint64_t surface;
+    uint64_t display;
+    uint32_t wlSurfaceId;
+    int32_t result;
+};
+
+struct DestroySurface {
+    uint64_t surface;
+};
+
+struct GetSurfaceFormats {
+    uint64_t surface;
+    // 1 for vkGetPhysicalDeviceSurfaceFormatsKHR, 2 for the 2KHR variant
+    uint32_t variant;
+    // formats returned, or available if the application only queried the count
+    uint32_t formatCount;
+    int32_t result;
+    uint32_t reserved;
+};
+
+struct CreateSwapchain {
+    uint64_t swapchain;
+    uint64_t surface;
+    uint64_t oldSwapchain;
+    uint32_t format;
+    uint32_t colorSpace;
+    int32_t result;
+    uint32_t reserved;
+};
+
+struct DestroySwapchain {
+    uint64_t swapchain;
+};
+
+// one record per swapchain of the call
+struct SetHdrMetadata {
+    uint64_t swapchain;
+    float displayPrimaryRed[2];
+    float displayPrimaryGreen[2];
+    float displayPrimaryBlue[2];
+    float whitePoint[2];
+    float maxLuminance;
+    float minLuminance;
+    float maxContentLightLevel;
+    float maxFrameAverageLightLevel;
+};
+
+// followed by swapchainCount uint64_t swapchains, the HDR swapchains of the
+// present
+struct QueuePresent {
+    uint64_t queue;
+    uint32_t swapchainCount;
+    int32_t result;
+};
+
+}
@@ -0,0 +1,113 @@
+// hdr-wsi-stats: prints the statistics a process running the layer with
+// HDR_WSI_STATS=1 publishes, see hdr_wsi_stats.h.
+
+#include "hdr_wsi_stats.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const HdrWsiStats::Segment *MapSegment(uint32_t pid)
+{
+    char name[64];
+    HdrWsiStats::SegmentName(name, pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "no statistics for process %u, is it running with HDR_WSI_STATS=1?\n", pid);
+        return nullptr;
+    }
+    void *memory = mmap(nullptr, sizeof(HdrWsiStats::Segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "can't map %s\n", name);
+        return nullptr;
+    }
+
+    auto segment = static_cast<const HdrWsiStats::Segment *>(memory);
+    if (segment->magic != HdrWsiStats::s_magic || segment->version != HdrWsiStats::s_version) {
+        fprintf(stderr, "%s has an unknown layout (version %u, expected %u)\n", name, segment->version, HdrWsiStats::s_version);
+        munmap(memory, sizeof(HdrWsiStats::Segment));
+        return nullptr;
+    }
+    return segment;
+}
+
+static void PrintSegment(const HdrWsiStats::Segment *segment)
+{
+    const auto load = [](const std::atomic<uint64_t> &counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+
+    printf("pid %u: %" PRIu64 " HDR surfaces, %" PRIu64 " format queries\n",
+           segment->pid, load(segment->hdrSurfaces), load(segment->formatQueries));
+    printf("wayland: %" PRIu64 " requests, %" PRIu64 " compositor waits\n",
+           load(segment->requests), load(segment->compositorWaits));
+
+    printf("present overhead:");
+    for (uint32_t i = 0; i < HdrWsiStats::s_histogramBuckets; i++) {
+        const uint64_t count = load(segment->presentOverhead[i]);
+        if (!count) {
+            continue;
+        }
+        if (i + 1 < HdrWsiStats::s_histogramBuckets) {
+            printf(" <%uus:%" PRIu64, 1u << i, count);
+        } else {
+            printf(" >=%uus:%" PRIu64, 1u << (i - 1), count);
+        }
+    }
+    printf("\n");
+
+    for (uint32_t i = 0; i < HdrWsiStats::ENTRY_POINT_COUNT; i++) {
+        const uint64_t calls = load(segment->entryPoints[i].calls);
+        if (calls) {
+            printf("%-40s %10" PRIu64 " calls %10.0f ns/call\n",
+                   HdrWsiStats::s_entryPointNames[i], calls, double(load(segment->entryPoints[i].ns)) / double(calls));
+        }
+    }
+
+    printf("%-18s %-18s %-10s %10s %8s %8s %8s %12s %10s %14s\n",
+           "swapchain", "surface", "colorspace", "presents", "updates", "requests", "failed", "blocked ms", "suppressed", "latency frames");
+    for (const auto &slot : segment->swapchains) {
+        const uint64_t swapchain = slot.swapchain.load(std::memory_order_acquire);
+        if (!swapchain) {
+            continue;
+        }
+        char latency[32];
+        snprintf(latency, sizeof(latency), "%" PRIu64 "/%" PRIu64, load(slot.lastDescLatencyFrames), load(slot.maxDescLatencyFrames));
+        printf("0x%016" PRIx64 " 0x%016" PRIx64 " %-10u %10" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %12.3f %10" PRIu64 " %14s\n",
+               swapchain, load(slot.surface), slot.colorSpace.load(std::memory_order_relaxed),
+               load(slot.presents), load(slot.descriptionUpdates), load(slot.descriptionRequests),
+               load(slot.failedDescriptions), double(load(slot.blockedNs)) / 1e6, load(slot.suppressedMetadataUpdates),
+               latency);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <pid> [interval ms]\n", argv[0]);
+        return 1;
+    }
+
+    const auto segment = MapSegment(uint32_t(atoi(argv[1])));
+    if (!segment) {
+        return 1;
+    }
+
+    const int interval = argc > 2 ? atoi(argv[2]) : 0;
+    for (;;) {
+        PrintSegment(segment);
+        if (interval <= 0) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+// Layout of the statistics the layer publishes with HDR_WSI_STATS=1, shared
+// between the layer and hdr-wsi-stats. The segment is a POSIX shared memory
+// object named after the process, see SegmentName. The layer only updates it
+// with relaxed atomics, so readers can map it read-only and sample it at any
+// time. Swapchain slots are zeroed when their swapchain is destroyed, and
+// reused for later ones.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+namespace HdrWsiStats
+{
+
+// bumped on every layout change
+static constexpr uint32_t s_version = 5;
+static constexpr uint32_t s_magic = 0x53524448; // "HDRS"
+
+static constexpr uint32_t s_maxSwapchains = 64;
+// bucket i counts presents that took the layer less than 2^i microseconds,
+// the last one everything slower
+static constexpr uint32_t s_histogramBuckets = 16;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+// Entry points whose calls and time are counted. Only calls that involve HDR
+// surfaces or swapchains are, the others go straight to the driver.
+enum EntryPoint : uint32_t {
+    CREATE_WAYLAND_SURFACE,
+    GET_SURFACE_FORMATS,
+    GET_SURFACE_FORMATS2,
+    CREATE_SWAPCHAIN,
+    DESTROY_SWAPCHAIN,
+    SET_HDR_METADATA,
+    // presents that didn't change any image description, and those that did
+    QUEUE_PRESENT_CLEAN,
+    QUEUE_PRESENT_DIRTY,
+    ENTRY_POINT_COUNT,
+};
+
+inline constexpr const char *s_entryPointNames[ENTRY_POINT_COUNT] = {
+    "vkCreateWaylandSurfaceKHR",
+    "vkGetPhysicalDeviceSurfaceFormatsKHR",
+    "vkGetPhysicalDeviceSurfaceFormats2KHR",
+    "vkCreateSwapchainKHR",
+    "vkDestroySwapchainKHR",
+    "vkSetHdrMetadataEXT",
+    "vkQueuePresentKHR (clean)",
+    "vkQueuePresentKHR (dirty)",
+};
+
+struct EntryPointStats {
+    std::atomic<uint64_t> calls;
+    // including the driver, except for vkQueuePresentKHR
+    std::atomic<uint64_t> ns;
+};
+
+struct SwapchainStats {
+    // VkSwapchainKHR, 0 for unused slots
+    std::atomic<uint64_t> swapchain;
+    std::atomic<uint64_t> surface;
+    std::atomic<uint32_t> colorSpace;
+
+    std::atomic<uint64_t> presents;
+    // image descriptions (or frog metadata) applied to the surface
+    std::atomic<uint64_t> descriptionUpdates;
+    // image descriptions the compositor was asked to create
+    std::atomic<uint64_t> descriptionRequests;
+    // image descriptions that failed or timed out
+    std::atomic<uint64_t> failedDescriptions;
+    // time presents spent blocked waiting for the compositor's `ready`
+    std::atomic<uint64_t> blockedNs;
+    std::atomic<uint64_t> suppressedMetadataUpdates;
+    // presents from a description change until the compositor applied it,
+    // for the last change and the slowest one
+    std::atomic<uint64_t> lastDescLatencyFrames;
+    std::atomic<uint64_t> maxDescLatencyFrames;
+};
+
+struct Segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t maxSwapchains;
+
+    std::atomic<uint64_t> hdrSurfaces;
+    std::atomic<uint64_t> formatQueries;
+    // Wayland requests the layer sent, and how often it blocked reading the
+    // compositor's answers
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> compositorWaits;
+    // time spent in the layer's vkQueuePresentKHR, without the driver
+    std::atomic<uint64_t> presentOverhead[s_histogramBuckets];
+    EntryPointStats entryPoints[ENTRY_POINT_COUNT];
+
+    SwapchainStats swapchains[s_maxSwapchains];
+};
+
+// shm_open name of the segment of process pid
+inline void SegmentName(char (&name)[64], uint32_t pid)
+{
+    snprintf(name, sizeof(name), "/hdr-wsi-stats-%u", pid);
+}
+
+}
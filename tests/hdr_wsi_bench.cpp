@@ -0,0 +1,560 @@
+// Benchmarks of the layer against the mock compositor and the stub driver,
+// whose canned surface formats stand in for a real driver's.
+//
+// Times are the mean ns per call over all threads, measured around each call
+// so they include the few ns of reading the clock. Allocations are the
+// operator new calls each call made on its thread, the layer's included:
+// operator new is replaced below, and the executable exports it to the layer.
+// libwayland's mallocs aren't counted.
+//
+// Usage: hdr-wsi-bench <case>
+
+#include "layer_client.h"
+#include "mock_compositor.h"
+
+#include "../src/hdr_wsi_handle_table.h"
+
+#include <array>
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::literals;
+using namespace HdrWsiTest;
+
+static thread_local uint64_t t_allocations = 0;
+
+void *operator new(size_t size)
+{
+    t_allocations++;
+    if (void *memory = malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+static constexpr VkHdrMetadataEXT s_hdr10Metadata = {
+    .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+    .displayPrimaryRed = {0.708f, 0.292f},
+    .displayPrimaryGreen = {0.170f, 0.797f},
+    .displayPrimaryBlue = {0.131f, 0.046f},
+    .whitePoint = {0.3127f, 0.3290f},
+    .maxLuminance = 1000.0f,
+    .minLuminance = 0.001f,
+    .maxContentLightLevel = 800.0f,
+    .maxFrameAverageLightLevel = 300.0f,
+};
+
+// Alternates between two values of MaxCLL, so each call is a change.
+static VkHdrMetadataEXT Changed(int iteration)
+{
+    VkHdrMetadataEXT metadata = s_hdr10Metadata;
+    metadata.maxContentLightLevel = iteration % 2 ? 600.0f : 800.0f;
+    return metadata;
+}
+
+struct Fixture {
+    MockCompositor compositor;
+    LayerClient client;
+
+    explicit Fixture(CompositorConfig config)
+        : compositor(std::move(config))
+        , client(compositor.TakeClientFd())
+    {
+    }
+};
+
+// A wl_surface with its VkSurfaceKHR and an HDR10 swapchain.
+struct Window {
+    LayerClient &client;
+    wl_surface *wlSurface;
+    VkSurfaceKHR surface;
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+
+    explicit Window(LayerClient &client)
+        : client(client)
+        , wlSurface(client.CreateWlSurface())
+        , surface(client.CreateSurface(wlSurface))
+    {
+        if (client.CreateSwapchain(surface, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT, &swapchain) != VK_SUCCESS) {
+            fprintf(stderr, "hdr-wsi-bench: can't create a swapchain\n");
+            abort();
+        }
+    }
+
+    ~Window()
+    {
+        client.DestroySwapchain(swapchain);
+        client.DestroySurface(surface);
+        client.DestroyWlSurface(wlSurface);
+    }
+};
+
+struct Result {
+    double nsPerCall;
+    double allocationsPerCall;
+};
+
+// Runs call(thread, iteration) iterations times on each of threadCount threads
+// at once, after an untimed setup(thread, iteration).
+template <typename Setup, typename Call>
+static Result Measure(size_t threadCount, int iterations, const Setup &setup, const Call &call)
+{
+    std::atomic<uint64_t> ns = 0;
+    std::atomic<uint64_t> allocations = 0;
+    std::barrier start{ptrdiff_t(threadCount)};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            start.arrive_and_wait();
+            uint64_t threadNs = 0;
+            uint64_t threadAllocations = 0;
+            for (int i = 0; i < iterations; i++) {
+                setup(t, i);
+                const uint64_t allocationsBefore = t_allocations;
+                const auto begin = std::chrono::steady_clock::now();
+                call(t, i);
+                threadNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+                threadAllocations += t_allocations - allocationsBefore;
+            }
+            ns += threadNs;
+            allocations += threadAllocations;
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    const double calls = double(threadCount) * iterations;
+    return {double(ns) / calls, double(allocations) / calls};
+}
+
+template <typename Call>
+static Result Measure(size_t threadCount, int iterations, const Call &call)
+{
+    return Measure(threadCount, iterations, [](size_t, int) {}, call);
+}
+
+static void PrintHeader()
+{
+    printf("%-32s %10s %8s %12s %12s\n", "call", "swapchains", "threads", "ns/call", "allocs/call");
+}
+
+static void Print(const char *call, size_t swapchains, size_t threads, const Result &result)
+{
+    printf("%-32s %10zu %8zu %12.0f %12.2f\n", call, swapchains, threads, result.nsPerCall, result.allocationsPerCall);
+    fflush(stdout);
+}
+
+// The entry points in their steady state, with the swapchains split between
+// the threads. Each call is on one swapchain, the threads' swapchains in turn.
+static void BenchEntryPoints()
+{
+    constexpr int iterations = 1000;
+    constexpr std::array swapchainCounts = {1u, 4u, 16u, 64u};
+    constexpr std::array threadCounts = {1u, 2u, 4u, 8u, 16u};
+
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    EventLoop eventLoop(client);
+
+    PrintHeader();
+    for (const size_t swapchainCount : swapchainCounts) {
+        std::vector<std::unique_ptr<Window>> windows;
+        for (size_t i = 0; i < swapchainCount; i++) {
+            windows.push_back(std::make_unique<Window>(client));
+            client.SetHdrMetadata({&windows.back()->swapchain, 1}, s_hdr10Metadata);
+            // the first present waits for the first description
+            client.Present(windows.back()->swapchain);
+        }
+
+        for (const size_t threadCount : threadCounts) {
+            if (threadCount > swapchainCount) {
+                break;
+            }
+            const size_t perThread = swapchainCount / threadCount;
+            const auto window = [&](size_t t, int i) -> Window & {
+                return *windows[t * perThread + size_t(i) % perThread];
+            };
+
+            // swapchains the previous round left dirty or new become clean first
+            Measure(threadCount, int(perThread), [&](size_t t, int i) {
+                client.SetHdrMetadata({&window(t, i).swapchain, 1}, s_hdr10Metadata);
+                client.Present(window(t, i).swapchain);
+            });
+
+            Print("QueuePresentKHR clean", swapchainCount, threadCount, Measure(threadCount, iterations, [&](size_t t, int i) {
+                client.Present(window(t, i).swapchain);
+            }));
+            Print("QueuePresentKHR dirty", swapchainCount, threadCount, Measure(threadCount, iterations, [&](size_t t, int i) {
+                client.SetHdrMetadata({&window(t, i).swapchain, 1}, Changed(i / int(perThread)));
+            }, [&](size_t t, int i) {
+                client.Present(window(t, i).swapchain);
+            }));
+            Print("SetHdrMetadataEXT", swapchainCount, threadCount, Measure(threadCount, iterations, [&](size_t t, int i) {
+                client.SetHdrMetadata({&window(t, i).swapchain, 1}, Changed(i / int(perThread)));
+            }));
+            Print("SurfaceFormatsKHR", swapchainCount, threadCount, Measure(threadCount, iterations, [&](size_t t, int i) {
+                std::array<VkSurfaceFormatKHR, 16> formats;
+                client.SurfaceFormats(window(t, i).surface, formats);
+            }));
+            Print("SurfaceFormats2KHR", swapchainCount, threadCount, Measure(threadCount, iterations, [&](size_t t, int i) {
+                std::array<VkSurfaceFormat2KHR, 16> formats;
+                formats.fill({.sType = VK_STRUCTURE_TYPE_SURFACE_FORMAT_2_KHR});
+                client.SurfaceFormats2(window(t, i).surface, formats);
+            }));
+            // a new swapchain replacing the previous one, like on a resize
+            Print("Create+DestroySwapchain", swapchainCount, threadCount, Measure(threadCount, iterations / 10, [&](size_t t, int i) {
+                Window &churned = window(t, i);
+                VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+                client.CreateSwapchain(churned.surface, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT,
+                                       &swapchain, churned.swapchain);
+                client.DestroySwapchain(churned.swapchain);
+                churned.swapchain = swapchain;
+            }));
+        }
+    }
+}
+
+// Clean presents to surfaces of the same wl_display: from one thread, from two
+// threads with a surface each, and from those two while a third thread keeps
+// changing the description of a third surface, which locks the display. Clean
+// presents don't lock the display, so their ns/call should stay the same.
+static void BenchSharedDisplay()
+{
+    constexpr int iterations = 10000;
+
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    EventLoop eventLoop(client);
+
+    std::array<std::unique_ptr<Window>, 3> windows;
+    for (auto &window : windows) {
+        window = std::make_unique<Window>(client);
+        client.SetHdrMetadata({&window->swapchain, 1}, s_hdr10Metadata);
+        client.Present(window->swapchain);
+    }
+    const auto present = [&](size_t t, int) {
+        client.Present(windows[t]->swapchain);
+    };
+
+    PrintHeader();
+    Print("clean, one surface", 1, 1, Measure(1, iterations, present));
+    Print("clean, two surfaces", 2, 2, Measure(2, iterations, present));
+
+    std::atomic<bool> stop = false;
+    std::thread dirty([&] {
+        for (int i = 0; !stop; i++) {
+            client.SetHdrMetadata({&windows[2]->swapchain, 1}, Changed(i));
+            client.Present(windows[2]->swapchain);
+        }
+    });
+    Print("clean, next to dirty presents", 2, 2, Measure(2, iterations, present));
+    stop = true;
+    dirty.join();
+}
+
+// Metadata no swapchain had before, so that every update needs a new image
+// description instead of one the layer already has.
+static VkHdrMetadataEXT Unique()
+{
+    static float s_maxCll = 1000.0f;
+    VkHdrMetadataEXT metadata = s_hdr10Metadata;
+    metadata.maxContentLightLevel = s_maxCll++;
+    return metadata;
+}
+
+// Frames of N swapchains with changed metadata, like the views of a
+// multi-view application, presented in one vkQueuePresentKHR that waits for
+// all of their descriptions at once, and in one vkQueuePresentKHR each. The
+// compositor takes 2 ms for each description, and presents may wait for them.
+static void BenchBatchedPresent()
+{
+    constexpr int iterations = 20;
+    constexpr std::array swapchainCounts = {1u, 2u, 4u, 8u, 16u, 32u, 64u};
+
+    // read when the layer is loaded, by the first LayerClient
+    setenv("HDR_WSI_DESCRIPTION_WAIT_MS", "100", 1);
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    config.readyDelay = 2ms;
+    Fixture fixture(std::move(config));
+    LayerClient &client = fixture.client;
+    EventLoop eventLoop(client);
+
+    const auto update = [&client](std::span<const VkSwapchainKHR> swapchains) {
+        for (const VkSwapchainKHR swapchain : swapchains) {
+            client.SetHdrMetadata({&swapchain, 1}, Unique());
+        }
+    };
+
+    PrintHeader();
+    for (const size_t swapchainCount : swapchainCounts) {
+        std::vector<std::unique_ptr<Window>> windows;
+        std::vector<VkSwapchainKHR> swapchains;
+        for (size_t i = 0; i < swapchainCount; i++) {
+            windows.push_back(std::make_unique<Window>(client));
+            swapchains.push_back(windows.back()->swapchain);
+        }
+        update(swapchains);
+        client.Present(swapchains);
+
+        Print("batched frame", swapchainCount, 1, Measure(1, iterations, [&](size_t, int) {
+            update(swapchains);
+        }, [&](size_t, int) {
+            client.Present(swapchains);
+        }));
+        Print("per-swapchain frame", swapchainCount, 1, Measure(1, iterations, [&](size_t, int) {
+            update(swapchains);
+        }, [&](size_t, int) {
+            for (const VkSwapchainKHR swapchain : swapchains) {
+                client.Present(swapchain);
+            }
+        }));
+    }
+}
+
+// An application starting up against a compositor that takes 1 ms for each
+// batch of requests: it creates its surface, spends 5 ms on other work, like
+// creating its device, then queries the surface formats and creates its
+// swapchain. The color management probe is run again for each surface, since
+// the layer drops it with the display's last surface. Run with
+// HDR_WSI_LAZY_PROBE=0 and 1: only the lazy probe overlaps the other work.
+static void BenchStartup()
+{
+    constexpr int iterations = 20;
+    constexpr auto work = 5ms;
+
+    const char *lazyProbe = getenv("HDR_WSI_LAZY_PROBE");
+    const std::string_view mode = lazyProbe && lazyProbe == "1"sv ? "lazy" : "eager";
+    CompositorConfig config = CompositorConfig::All();
+    config.dispatchDelay = 1ms;
+    Fixture fixture(std::move(config));
+    LayerClient &client = fixture.client;
+
+    enum Step {
+        CREATE_SURFACE,
+        QUERY_FORMATS,
+        CREATE_SWAPCHAIN,
+        TOTAL,
+        STEP_COUNT,
+    };
+    std::array<std::chrono::nanoseconds, STEP_COUNT> ns = {};
+    std::array<uint64_t, STEP_COUNT> allocations = {};
+    for (int i = 0; i < iterations; i++) {
+        std::array<std::chrono::steady_clock::time_point, STEP_COUNT> times;
+        std::array<uint64_t, STEP_COUNT> allocationCounts;
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t allocationsStart = t_allocations;
+
+        wl_surface *wlSurface = client.CreateWlSurface();
+        const VkSurfaceKHR surface = client.CreateSurface(wlSurface);
+        times[CREATE_SURFACE] = std::chrono::steady_clock::now();
+        allocationCounts[CREATE_SURFACE] = t_allocations;
+
+        std::this_thread::sleep_for(work);
+        const auto worked = std::chrono::steady_clock::now();
+        const uint64_t allocationsWorked = t_allocations;
+
+        std::array<VkSurfaceFormatKHR, 16> formats;
+        client.SurfaceFormats(surface, formats);
+        times[QUERY_FORMATS] = std::chrono::steady_clock::now();
+        allocationCounts[QUERY_FORMATS] = t_allocations;
+
+        VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+        client.CreateSwapchain(surface, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT, &swapchain);
+        times[CREATE_SWAPCHAIN] = times[TOTAL] = std::chrono::steady_clock::now();
+        allocationCounts[CREATE_SWAPCHAIN] = allocationCounts[TOTAL] = t_allocations;
+
+        ns[CREATE_SURFACE] += times[CREATE_SURFACE] - start;
+        ns[QUERY_FORMATS] += times[QUERY_FORMATS] - worked;
+        ns[CREATE_SWAPCHAIN] += times[CREATE_SWAPCHAIN] - times[QUERY_FORMATS];
+        ns[TOTAL] += times[TOTAL] - start;
+        allocations[CREATE_SURFACE] += allocationCounts[CREATE_SURFACE] - allocationsStart;
+        allocations[QUERY_FORMATS] += allocationCounts[QUERY_FORMATS] - allocationsWorked;
+        allocations[CREATE_SWAPCHAIN] += allocationCounts[CREATE_SWAPCHAIN] - allocationCounts[QUERY_FORMATS];
+        allocations[TOTAL] += allocationCounts[TOTAL] - allocationsStart;
+
+        if (swapchain) {
+            client.DestroySwapchain(swapchain);
+        }
+        client.DestroySurface(surface);
+        client.DestroyWlSurface(wlSurface);
+        client.Roundtrip();
+    }
+
+    static constexpr std::array<const char *, STEP_COUNT> stepNames = {
+        "CreateWaylandSurfaceKHR",
+        "SurfaceFormatsKHR",
+        "CreateSwapchainKHR",
+        "startup, with 5 ms work",
+    };
+    PrintHeader();
+    for (int step = 0; step < STEP_COUNT; step++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%.*s %s", int(mode.size()), mode.data(), stepNames[step]);
+        Print(name, 1, 1, {double(ns[step].count()) / iterations, double(allocations[step]) / iterations});
+    }
+}
+
+// What the layer's tables were before HandleTable: one map behind one mutex,
+// held for as long as the object returned from get lives, like vkroots'
+// synchronized maps.
+template <typename Key, typename Data>
+class SynchronizedMap
+{
+public:
+    class Object
+    {
+    public:
+        Data *operator->() const { return m_data; }
+        operator bool() const { return m_data != nullptr; }
+
+    private:
+        friend class SynchronizedMap;
+
+        Object(std::unique_lock<std::mutex> lock, Data *data)
+            : m_lock{std::move(lock)}
+            , m_data{data}
+        {
+        }
+
+        std::unique_lock<std::mutex> m_lock;
+        Data *m_data;
+    };
+
+    static Object get(const Key &key)
+    {
+        std::unique_lock lock{s_mutex};
+        const auto it = s_map.find(key);
+        return Object{std::move(lock), it != s_map.end() ? &it->second : nullptr};
+    }
+
+    static Object create(const Key &key, Data data)
+    {
+        std::unique_lock lock{s_mutex};
+        const auto it = s_map.emplace(key, std::move(data)).first;
+        return Object{std::move(lock), &it->second};
+    }
+
+    static bool remove(const Key &key)
+    {
+        std::unique_lock lock{s_mutex};
+        return s_map.erase(key) != 0;
+    }
+
+private:
+    static inline std::mutex s_mutex;
+    static inline std::unordered_map<Key, Data> s_map;
+};
+
+struct LookupData {
+    uint64_t presents = 0;
+};
+
+// Lookups of objects that each thread has to itself, like presents of
+// different swapchains, optionally while another thread keeps adding and
+// removing one, like a swapchain being recreated.
+template <typename Map>
+static void BenchLookups(const char *name, size_t handleCount, size_t threadCount, bool churn)
+{
+    constexpr int iterations = 100000;
+
+    for (uint64_t handle = 1; handle <= handleCount; handle++) {
+        Map::create(handle, {});
+    }
+    std::atomic<bool> stop = false;
+    std::thread writer;
+    if (churn) {
+        writer = std::thread([&stop] {
+            while (!stop) {
+                Map::create(0, {});
+                Map::remove(0);
+            }
+        });
+    }
+
+    const size_t perThread = handleCount / threadCount;
+    Print(name, handleCount, threadCount, Measure(threadCount, iterations, [&](size_t t, int i) {
+        auto object = Map::get(1 + t * perThread + size_t(i) % perThread);
+        object->presents++;
+    }));
+
+    stop = true;
+    if (writer.joinable()) {
+        writer.join();
+    }
+    for (uint64_t handle = 1; handle <= handleCount; handle++) {
+        Map::remove(handle);
+    }
+}
+
+// HandleTable against the mutex map it replaced, as the number of objects and
+// threads using them grows. The "swapchains" column is the number of objects.
+static void BenchHandleTable()
+{
+    constexpr std::array handleCounts = {1u, 4u, 16u, 64u};
+    constexpr std::array threadCounts = {1u, 2u, 4u, 8u, 16u};
+
+    PrintHeader();
+    for (const size_t handleCount : handleCounts) {
+        for (const size_t threadCount : threadCounts) {
+            if (threadCount > handleCount) {
+                break;
+            }
+            BenchLookups<HdrLayer::HandleTable<uint64_t, LookupData>>("HandleTable", handleCount, threadCount, false);
+            BenchLookups<SynchronizedMap<uint64_t, LookupData>>("mutex map", handleCount, threadCount, false);
+            BenchLookups<HdrLayer::HandleTable<uint64_t, LookupData>>("HandleTable+churn", handleCount, threadCount, true);
+            BenchLookups<SynchronizedMap<uint64_t, LookupData>>("mutex map+churn", handleCount, threadCount, true);
+        }
+    }
+}
+
+struct BenchCase {
+    std::string_view name;
+    void (*run)();
+};
+
+static constexpr BenchCase s_benchCases[] = {
+    {"entry-points", BenchEntryPoints},
+    {"shared-display", BenchSharedDisplay},
+    {"handle-table", BenchHandleTable},
+    {"batched-present", BenchBatchedPresent},
+    {"startup", BenchStartup},
+};
+
+int main(int argc, char **argv)
+{
+    if (argc == 2) {
+        for (const BenchCase &benchCase : s_benchCases) {
+            if (benchCase.name == argv[1]) {
+                benchCase.run();
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+
+    fprintf(stderr, "Usage: %s <case>\n\nCases:\n", argv[0]);
+    for (const BenchCase &benchCase : s_benchCases) {
+        fprintf(stderr, "  %.*s\n", int(benchCase.name.size()), benchCase.name.data());
+    }
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,317 @@
+// hdr-wsi-replay: feeds a call log written by the layer with
+// HDR_WSI_RECORD=<path> (see hdr_wsi_record.h) back through the layer, against
+// the mock compositor and the stub driver of the tests.
+//
+// Calls are replayed on one thread in the order of the log, which is the order
+// they returned in, at their original times or as fast as possible. Handles
+// are mapped to the replay's own objects, calls on objects the log doesn't
+// know are skipped. The application's event loop is stood in for by a thread
+// doing roundtrips.
+
+#include "layer_client.h"
+#include "mock_compositor.h"
+
+#include "../src/hdr_wsi_record.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std::literals;
+using namespace HdrWsiTest;
+
+struct TypeSummary {
+    uint64_t calls = 0;
+    uint64_t recordedNs = 0;
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+    // swapchain creations and presents with another result than recorded
+    uint64_t mismatches = 0;
+};
+
+struct ReplaySurface {
+    wl_surface *wlSurface;
+    VkSurfaceKHR surface;
+};
+
+class Replayer
+{
+public:
+    explicit Replayer(LayerClient &client)
+        : m_client(client)
+    {
+    }
+
+    ~Replayer()
+    {
+        for (const auto &[id, swapchain] : m_swapchains) {
+            m_client.DestroySwapchain(swapchain);
+        }
+        for (const auto &[id, surface] : m_surfaces) {
+            m_client.DestroySurface(surface.surface);
+            m_client.DestroyWlSurface(surface.wlSurface);
+        }
+    }
+
+    // Returns whether the call was replayed, and in matches whether it had
+    // the recorded result.
+    bool Replay(const HdrWsiRecord::RecordHeader &header, const std::vector<std::byte> &data, bool &matches);
+
+    uint64_t Skipped() const { return m_skipped; }
+
+private:
+    std::optional<ReplaySurface> Surface(uint64_t id) const
+    {
+        const auto it = m_surfaces.find(id);
+        return it != m_surfaces.end() ? std::optional{it->second} : std::nullopt;
+    }
+
+    std::optional<VkSwapchainKHR> Swapchain(uint64_t id) const
+    {
+        const auto it = m_swapchains.find(id);
+        return it != m_swapchains.end() ? std::optional{it->second} : std::nullopt;
+    }
+
+    LayerClient &m_client;
+    std::map<uint64_t, ReplaySurface> m_surfaces;
+    std::map<uint64_t, VkSwapchainKHR> m_swapchains;
+    uint64_t m_skipped = 0;
+};
+
+template <typename Payload>
+static bool ReadPayload(const std::vector<std::byte> &data, Payload &payload)
+{
+    if (data.size() < sizeof(Payload)) {
+        return false;
+    }
+    memcpy(&payload, data.data(), sizeof(Payload));
+    return true;
+}
+
+bool Replayer::Replay(const HdrWsiRecord::RecordHeader &header, const std::vector<std::byte> &data, bool &matches)
+{
+    matches = true;
+    switch (header.type) {
+    case HdrWsiRecord::CREATE_WAYLAND_SURFACE:
+        if (HdrWsiRecord::CreateWaylandSurface payload; ReadPayload(data, payload) && payload.result == VK_SUCCESS) {
+            wl_surface *wlSurface = m_client.CreateWlSurface();
+            m_surfaces[payload.surface] = {wlSurface, m_client.CreateSurface(wlSurface)};
+            return true;
+        }
+        break;
+    case HdrWsiRecord::DESTROY_SURFACE:
+        if (HdrWsiRecord::DestroySurface payload; ReadPayload(data, payload)) {
+            if (const auto surface = Surface(payload.surface)) {
+                m_client.DestroySurface(surface->surface);
+                m_client.DestroyWlSurface(surface->wlSurface);
+                m_surfaces.erase(payload.surface);
+                return true;
+            }
+        }
+        break;
+    case HdrWsiRecord::GET_SURFACE_FORMATS:
+        if (HdrWsiRecord::GetSurfaceFormats payload; ReadPayload(data, payload)) {
+            if (const auto surface = Surface(payload.surface)) {
+                // the stub driver's formats aren't the recorded driver's
+                if (payload.variant == 2) {
+                    m_client.SurfaceFormats2(surface->surface);
+                } else {
+                    m_client.SurfaceFormats(surface->surface);
+                }
+                return true;
+            }
+        }
+        break;
+    case HdrWsiRecord::CREATE_SWAPCHAIN:
+        if (HdrWsiRecord::CreateSwapchain payload; ReadPayload(data, payload)) {
+            const auto surface = Surface(payload.surface);
+            if (!surface) {
+                break;
+            }
+            const VkSwapchainKHR oldSwapchain = Swapchain(payload.oldSwapchain).value_or(VK_NULL_HANDLE);
+            VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+            const VkResult result = m_client.CreateSwapchain(surface->surface, VkFormat(payload.format), VkColorSpaceKHR(payload.colorSpace),
+                                                             &swapchain, oldSwapchain);
+            matches = result == payload.result;
+            if (result == VK_SUCCESS) {
+                m_swapchains[payload.swapchain] = swapchain;
+            }
+            return true;
+        }
+        break;
+    case HdrWsiRecord::DESTROY_SWAPCHAIN:
+        if (HdrWsiRecord::DestroySwapchain payload; ReadPayload(data, payload)) {
+            if (const auto swapchain = Swapchain(payload.swapchain)) {
+                m_client.DestroySwapchain(*swapchain);
+                m_swapchains.erase(payload.swapchain);
+                return true;
+            }
+        }
+        break;
+    case HdrWsiRecord::SET_HDR_METADATA:
+        if (HdrWsiRecord::SetHdrMetadata payload; ReadPayload(data, payload)) {
+            if (const auto swapchain = Swapchain(payload.swapchain)) {
+                const VkHdrMetadataEXT metadata = {
+                    .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+                    .displayPrimaryRed = {payload.displayPrimaryRed[0], payload.displayPrimaryRed[1]},
+                    .displayPrimaryGreen = {payload.displayPrimaryGreen[0], payload.displayPrimaryGreen[1]},
+                    .displayPrimaryBlue = {payload.displayPrimaryBlue[0], payload.displayPrimaryBlue[1]},
+                    .whitePoint = {payload.whitePoint[0], payload.whitePoint[1]},
+                    .maxLuminance = payload.maxLuminance,
+                    .minLuminance = payload.minLuminance,
+                    .maxContentLightLevel = payload.maxContentLightLevel,
+                    .maxFrameAverageLightLevel = payload.maxFrameAverageLightLevel,
+                };
+                m_client.SetHdrMetadata({&*swapchain, 1}, metadata);
+                return true;
+            }
+        }
+        break;
+    case HdrWsiRecord::QUEUE_PRESENT:
+        if (HdrWsiRecord::QueuePresent payload; ReadPayload(data, payload)) {
+            const size_t count = std::min<size_t>(payload.swapchainCount, (data.size() - sizeof(payload)) / sizeof(uint64_t));
+            std::vector<VkSwapchainKHR> swapchains;
+            for (size_t i = 0; i < count; i++) {
+                uint64_t id;
+                memcpy(&id, data.data() + sizeof(payload) + i * sizeof(uint64_t), sizeof(id));
+                if (const auto swapchain = Swapchain(id)) {
+                    swapchains.push_back(*swapchain);
+                }
+            }
+            if (swapchains.empty()) {
+                break;
+            }
+            matches = m_client.Present(swapchains) == payload.result;
+            return true;
+        }
+        break;
+    }
+    m_skipped++;
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    bool maximumSpeed = false;
+    std::optional<Protocol> protocol;
+    bool usage = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "mp:")) != -1) {
+        if (opt == 'm') {
+            maximumSpeed = true;
+        } else if (opt == 'p' && optarg == "frog"sv) {
+            protocol = Protocol::Frog;
+        } else if (opt == 'p' && optarg == "xx"sv) {
+            protocol = Protocol::Xx;
+        } else if (opt == 'p' && optarg == "wp"sv) {
+            protocol = Protocol::Wp;
+        } else {
+            usage = true;
+        }
+    }
+    if (usage || optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-m] [-p frog|xx|wp] <file>\n"
+                        "  -m  replay as fast as possible instead of at the recorded times\n"
+                        "  -p  only advertise that color management protocol, instead of all of them\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (!file) {
+        fprintf(stderr, "can't open %s\n", argv[optind]);
+        return 1;
+    }
+
+    HdrWsiRecord::FileHeader fileHeader;
+    if (fread(&fileHeader, sizeof(fileHeader), 1, file) != 1 || fileHeader.magic != HdrWsiRecord::s_magic) {
+        fprintf(stderr, "%s isn't an HDR WSI call log\n", argv[optind]);
+        return 1;
+    }
+    if (fileHeader.version != HdrWsiRecord::s_version) {
+        fprintf(stderr, "%s has version %u, expected %u\n", argv[optind], fileHeader.version, HdrWsiRecord::s_version);
+        return 1;
+    }
+
+    // read by the layer when it's loaded, by the LayerClient: the replay must
+    // not record itself, possibly over the log it replays
+    unsetenv("HDR_WSI_RECORD");
+
+    MockCompositor compositor(protocol ? CompositorConfig::Only(*protocol) : CompositorConfig::All());
+    LayerClient client(compositor.TakeClientFd());
+    std::array<TypeSummary, HdrWsiRecord::TYPE_COUNT> summaries = {};
+    uint64_t firstNs = 0;
+    uint64_t lastNs = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        EventLoop eventLoop(client);
+        Replayer replayer(client);
+
+        HdrWsiRecord::RecordHeader header;
+        std::vector<std::byte> data;
+        bool first = true;
+        while (fread(&header, sizeof(header), 1, file) == 1) {
+            data.resize(header.size);
+            if (fread(data.data(), 1, data.size(), file) != data.size()) {
+                fprintf(stderr, "truncated record at %.6f ms\n", double(header.timeNs) / 1e6);
+                break;
+            }
+            if (header.type >= HdrWsiRecord::TYPE_COUNT) {
+                fprintf(stderr, "unknown record type %u at %.6f ms\n", header.type, double(header.timeNs) / 1e6);
+                continue;
+            }
+
+            if (first) {
+                first = false;
+                firstNs = header.timeNs;
+                start = std::chrono::steady_clock::now();
+            } else if (!maximumSpeed) {
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(header.timeNs - firstNs));
+            }
+            lastNs = header.timeNs + header.durationNs;
+
+            const auto callStart = std::chrono::steady_clock::now();
+            bool matches;
+            if (!replayer.Replay(header, data, matches)) {
+                continue;
+            }
+            const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - callStart).count();
+
+            auto &summary = summaries[header.type];
+            summary.calls++;
+            summary.recordedNs += header.durationNs;
+            summary.totalNs += ns;
+            summary.maxNs = std::max(summary.maxNs, ns);
+            summary.mismatches += matches ? 0 : 1;
+        }
+        fclose(file);
+
+        if (replayer.Skipped()) {
+            printf("skipped %" PRIu64 " calls on objects the log didn't create\n", replayer.Skipped());
+        }
+    }
+    const double replayMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-38s %10s %12s %12s %12s %10s\n", "call", "count", "recorded us", "mean us", "max us", "mismatches");
+    for (uint32_t i = 0; i < HdrWsiRecord::TYPE_COUNT; i++) {
+        const auto &summary = summaries[i];
+        if (summary.calls) {
+            printf("%-38s %10" PRIu64 " %12.3f %12.3f %12.3f %10" PRIu64 "\n", HdrWsiRecord::s_typeNames[i], summary.calls,
+                   double(summary.recordedNs) / double(summary.calls) / 1e3, double(summary.totalNs) / double(summary.calls) / 1e3,
+                   double(summary.maxNs) / 1e3, summary.mismatches);
+        }
+    }
+    printf("replayed %.3f ms of calls of process %u in %.3f ms, %" PRIu64 " protocol errors\n",
+           double(lastNs - firstNs) / 1e6, fileHeader.pid, replayMs, compositor.ProtocolErrors());
+    return compositor.ProtocolErrors() ? 1 : 0;
+}
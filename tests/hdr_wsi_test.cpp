@@ -0,0 +1,1002 @@
+// Runs the layer against the mock compositor, one test case per process
+// since the layer's state is per process.
+//
+// Usage: hdr-wsi-test <case>
+
+#include "layer_client.h"
+#include "mock_compositor.h"
+
+#include "frog-color-management-v1-protocol.h"
+#include "xx-color-management-v4-protocol.h"
+#include "color-management-v1-protocol.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std::literals;
+using namespace HdrWsiTest;
+
+static int s_failures = 0;
+
+static bool Check(bool ok, const char *expression, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "hdr_wsi_test.cpp:%d: check failed: %s\n", line, expression);
+        s_failures++;
+    }
+    return ok;
+}
+
+#define CHECK(expression) Check(bool(expression), #expression, __LINE__)
+
+static constexpr VkHdrMetadataEXT s_hdr10Metadata = {
+    .sType = VK_STRUCTURE_TYPE_HDR_METADATA_EXT,
+    .displayPrimaryRed = {0.708f, 0.292f},
+    .displayPrimaryGreen = {0.170f, 0.797f},
+    .displayPrimaryBlue = {0.131f, 0.046f},
+    .whitePoint = {0.3127f, 0.3290f},
+    .maxLuminance = 1000.0f,
+    .minLuminance = 0.001f,
+    .maxContentLightLevel = 800.0f,
+    .maxFrameAverageLightLevel = 300.0f,
+};
+
+static VkHdrMetadataEXT WithMaxCll(float maxCll)
+{
+    VkHdrMetadataEXT metadata = s_hdr10Metadata;
+    metadata.maxContentLightLevel = maxCll;
+    return metadata;
+}
+
+struct Fixture {
+    MockCompositor compositor;
+    LayerClient client;
+
+    explicit Fixture(CompositorConfig config, DriverConfig driver = {})
+        : compositor(std::move(config))
+        , client(compositor.TakeClientFd(), std::move(driver))
+    {
+    }
+};
+
+// A wl_surface with its VkSurfaceKHR and a swapchain, if the layer or the
+// driver allowed one with format and colorSpace.
+struct Window {
+    LayerClient &client;
+    wl_surface *wlSurface;
+    VkSurfaceKHR surface;
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+    VkResult result;
+
+    Window(LayerClient &client, VkFormat format, VkColorSpaceKHR colorSpace)
+        : client(client)
+        , wlSurface(client.CreateWlSurface())
+        , surface(client.CreateSurface(wlSurface))
+    {
+        result = client.CreateSwapchain(surface, format, colorSpace, &swapchain);
+    }
+
+    ~Window()
+    {
+        if (swapchain) {
+            client.DestroySwapchain(swapchain);
+        }
+        client.DestroySurface(surface);
+        client.DestroyWlSurface(wlSurface);
+    }
+
+    uint32_t Id() const { return LayerClient::Id(wlSurface); }
+};
+
+static Window Hdr10Window(LayerClient &client)
+{
+    return Window(client, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT);
+}
+
+static bool operator==(const VkSurfaceFormatKHR &a, const VkSurfaceFormatKHR &b)
+{
+    return a.format == b.format && a.colorSpace == b.colorSpace;
+}
+
+static bool HasFormat(const std::vector<VkSurfaceFormatKHR> &formats, VkFormat format, VkColorSpaceKHR colorSpace)
+{
+    return std::ranges::any_of(formats, [=](const VkSurfaceFormatKHR &surfaceFormat) {
+        return surfaceFormat.format == format && surfaceFormat.colorSpace == colorSpace;
+    });
+}
+
+static std::chrono::milliseconds TimePresent(LayerClient &client, VkSwapchainKHR swapchain)
+{
+    const auto start = std::chrono::steady_clock::now();
+    CHECK(client.Present(swapchain) == VK_SUCCESS);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+}
+
+// The protocol the layer picks with everything in config, and the formats it
+// advertises for it.
+static void SelectProtocol(CompositorConfig config, std::optional<Protocol> expected)
+{
+    Fixture fixture(std::move(config));
+    LayerClient &client = fixture.client;
+    {
+        Window window(client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        const auto formats = client.SurfaceFormats(window.surface);
+        client.Roundtrip();
+
+        const auto state = fixture.compositor.Surface(window.Id());
+        CHECK(state && state->protocol == expected);
+        CHECK(HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT) == expected.has_value());
+        CHECK(HasFormat(formats, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR));
+        CHECK(client.SurfaceFormats2(window.surface) == formats);
+        if (!expected) {
+            CHECK(formats.size() == DriverConfig{}.formats.size());
+        }
+    }
+    CHECK(fixture.compositor.ProtocolErrors() == 0);
+}
+
+static void TestSelectAll()
+{
+    SelectProtocol(CompositorConfig::All(), Protocol::Frog);
+}
+
+static void TestSelectWpXx()
+{
+    CompositorConfig config = CompositorConfig::All();
+    config.frog = false;
+    SelectProtocol(config, Protocol::Wp);
+}
+
+static void TestSelectXx()
+{
+    SelectProtocol(CompositorConfig::Only(Protocol::Xx), Protocol::Xx);
+}
+
+static void TestSelectNone()
+{
+    CompositorConfig config = CompositorConfig::All();
+    config.frog = config.xx = config.wp = false;
+    SelectProtocol(config, std::nullopt);
+}
+
+// Without parametric descriptions there's nothing to describe HDR with.
+static void TestSelectNoParametric()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    std::erase(config.wpFeatures, WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC);
+    SelectProtocol(config, std::nullopt);
+}
+
+static void TestFormatsNoPq()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    std::erase(config.wpTransferFunctions, WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ);
+    Fixture fixture(config);
+    {
+        Window window(fixture.client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        const auto formats = fixture.client.SurfaceFormats(window.surface);
+        CHECK(!HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT));
+        CHECK(HasFormat(formats, VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_EXTENDED_SRGB_LINEAR_EXT));
+        CHECK(fixture.client.SurfaceFormats2(window.surface) == formats);
+    }
+}
+
+static void TestFormatsNoScrgb()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    std::erase(config.wpFeatures, WP_COLOR_MANAGER_V1_FEATURE_WINDOWS_SCRGB);
+    std::erase(config.wpTransferFunctions, WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR);
+    Fixture fixture(config);
+    {
+        Window window(fixture.client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        const auto formats = fixture.client.SurfaceFormats(window.surface);
+        CHECK(HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT));
+        CHECK(!HasFormat(formats, VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_EXTENDED_SRGB_LINEAR_EXT));
+    }
+}
+
+// Even with a slow compositor, the first frame of an HDR10 swapchain is
+// shown with its description.
+static void FirstPresent(Protocol protocol)
+{
+    CompositorConfig config = CompositorConfig::Only(protocol);
+    config.readyDelay = 100ms;
+    Fixture fixture(config);
+    LayerClient &client = fixture.client;
+    {
+        Window window = Hdr10Window(client);
+        CHECK(window.result == VK_SUCCESS);
+        CHECK(LayerClient::DriverColorSpace(window.swapchain) == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        CHECK(client.Present(window.swapchain) == VK_SUCCESS);
+        client.Roundtrip();
+
+        const auto state = fixture.compositor.Surface(window.Id());
+        if (CHECK(state && state->description)) {
+            CHECK(state->protocol == protocol);
+            CHECK(state->commits == 1);
+            CHECK(state->untaggedCommits == 0);
+            const DescriptionParams &description = *state->description;
+            switch (protocol) {
+            case Protocol::Frog:
+                CHECK(description.transferFunctionNamed == FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_ST2084_PQ);
+                CHECK(description.primariesNamed == FROG_COLOR_MANAGED_SURFACE_PRIMARIES_REC2020);
+                break;
+            case Protocol::Xx:
+                CHECK(description.transferFunctionNamed == XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_ST2084_PQ);
+                CHECK(description.primariesNamed == XX_COLOR_MANAGER_V4_PRIMARIES_BT2020);
+                break;
+            case Protocol::Wp:
+                CHECK(description.transferFunctionNamed == WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ);
+                CHECK(description.primariesNamed == WP_COLOR_MANAGER_V1_PRIMARIES_BT2020);
+                break;
+            }
+            CHECK(description.maxCll == 800u);
+            CHECK(description.maxFall == 300u);
+        }
+    }
+    CHECK(fixture.compositor.ProtocolErrors() == 0);
+}
+
+static void TestFirstPresentFrog()
+{
+    FirstPresent(Protocol::Frog);
+}
+
+static void TestFirstPresentXx()
+{
+    FirstPresent(Protocol::Xx);
+}
+
+static void TestFirstPresentWp()
+{
+    FirstPresent(Protocol::Wp);
+}
+
+// What presents cost in requests and roundtrips once the swapchain is set up:
+// nothing at all for presents without a metadata change, and no roundtrips
+// or blocking for those with one.
+static void TestBudget()
+{
+    static constexpr uint64_t s_frames = 100;
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    {
+        Window window = Hdr10Window(client);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        CHECK(client.Present(window.swapchain) == VK_SUCCESS);
+        client.Roundtrip();
+
+        const HdrWsiStats::Segment *stats = LayerClient::Stats();
+        if (!CHECK(stats)) {
+            return;
+        }
+
+        RequestCounts before = fixture.compositor.Requests();
+        uint64_t waitsBefore = stats->compositorWaits.load();
+        for (uint64_t i = 0; i < s_frames; i++) {
+            CHECK(client.Present(window.swapchain) == VK_SUCCESS);
+            client.Roundtrip();
+        }
+        RequestCounts clean = fixture.compositor.Requests() - before;
+        CHECK(clean.ColorManagement() == 0);
+        // only the test's own roundtrips
+        CHECK(clean.Syncs() == s_frames);
+        CHECK(clean["wl_surface.commit"] == s_frames);
+        CHECK(stats->compositorWaits.load() == waitsBefore);
+
+        // alternating between two descriptions, both cached after the first
+        // change to each
+        before = fixture.compositor.Requests();
+        waitsBefore = stats->compositorWaits.load();
+        for (uint64_t i = 0; i < s_frames; i++) {
+            client.SetHdrMetadata({&window.swapchain, 1}, WithMaxCll(i % 2 ? 800.0f : 400.0f));
+            CHECK(client.Present(window.swapchain) == VK_SUCCESS);
+            client.Roundtrip();
+        }
+        RequestCounts dirty = fixture.compositor.Requests() - before;
+        CHECK(dirty.Syncs() == s_frames);
+        // a set_image_description per frame, and creating the new description
+        CHECK(dirty.ColorManagement() <= s_frames + 16);
+        CHECK(stats->compositorWaits.load() == waitsBefore);
+        if (dirty.ColorManagement() > s_frames + 16) {
+            for (const auto &[name, count] : dirty.requests) {
+                fprintf(stderr, "  %s: %" PRIu64 "\n", name.c_str(), count);
+            }
+        }
+    }
+    CHECK(fixture.compositor.ProtocolErrors() == 0);
+}
+
+// A metadata change the compositor is slow to create a description for
+// doesn't block presents, the surface keeps the previous description until
+// the new one is ready.
+static void TestDelayedDescription()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    config.readyDelay = 500ms;
+    Fixture fixture(config);
+    LayerClient &client = fixture.client;
+    {
+        Window window = Hdr10Window(client);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        CHECK(client.Present(window.swapchain) == VK_SUCCESS);
+        client.Roundtrip();
+
+        client.SetHdrMetadata({&window.swapchain, 1}, WithMaxCll(400.0f));
+        CHECK(TimePresent(client, window.swapchain) < 200ms);
+        CHECK(TimePresent(client, window.swapchain) < 200ms);
+        client.Roundtrip();
+        auto state = fixture.compositor.Surface(window.Id());
+        if (CHECK(state && state->description)) {
+            CHECK(state->description->maxCll == 800u);
+            CHECK(state->untaggedCommits == 0);
+        }
+
+        std::this_thread::sleep_for(700ms);
+        client.Roundtrip();
+        CHECK(TimePresent(client, window.swapchain) < 200ms);
+        client.Roundtrip();
+        state = fixture.compositor.Surface(window.Id());
+        if (CHECK(state && state->description)) {
+            CHECK(state->description->maxCll == 400u);
+            CHECK(state->untaggedCommits == 0);
+        }
+    }
+    CHECK(fixture.compositor.ProtocolErrors() == 0);
+}
+
+// Descriptions the compositor fails are given up on without blocking later
+// presents.
+static void TestFailedDescription()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    config.failDescriptions = true;
+    Fixture fixture(config);
+    LayerClient &client = fixture.client;
+    {
+        Window window = Hdr10Window(client);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        CHECK(client.Present(window.swapchain) == VK_SUCCESS);
+        client.Roundtrip();
+        CHECK(TimePresent(client, window.swapchain) < 200ms);
+        client.Roundtrip();
+
+        const auto state = fixture.compositor.Surface(window.Id());
+        CHECK(state && !state->description);
+    }
+    CHECK(fixture.compositor.ProtocolErrors() == 0);
+}
+
+// Drivers with VK_COLOR_SPACE_PASS_THROUGH_EXT get that instead of sRGB, so
+// they don't touch the layer's HDR content.
+static void TestPassthrough()
+{
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp), DriverConfig{.passthrough = true});
+    {
+        Window window = Hdr10Window(fixture.client);
+        CHECK(window.result == VK_SUCCESS);
+        CHECK(LayerClient::DriverColorSpace(window.swapchain) == VK_COLOR_SPACE_PASS_THROUGH_EXT);
+    }
+}
+
+// Lets the layer pick up everything the compositor sent: its events are only
+// read by the application's roundtrips, and handled by the layer's presents.
+static void Settle(LayerClient &client, VkSwapchainKHR swapchain)
+{
+    for (int i = 0; i < 4; i++) {
+        client.Roundtrip();
+        CHECK(client.Present(swapchain) == VK_SUCCESS);
+    }
+    client.Roundtrip();
+}
+
+// The maximum mastering luminance the surface is tagged with, which is the
+// preferred description's for swapchains without metadata of their own.
+static std::optional<uint32_t> MasteringMax(MockCompositor &compositor, uint32_t id)
+{
+    const auto state = compositor.Surface(id);
+    if (!state || !state->description || !state->description->masteringLuminance) {
+        return std::nullopt;
+    }
+    return (*state->description->masteringLuminance)[1];
+}
+
+// scRGB swapchains use the compositor's windows_scrgb description, whatever
+// their metadata: it can't carry any, so changing it creates nothing new.
+static void TestScrgb()
+{
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    for (VkColorSpaceKHR colorSpace : {VK_COLOR_SPACE_EXTENDED_SRGB_LINEAR_EXT, VK_COLOR_SPACE_BT709_LINEAR_EXT}) {
+        Window window(client, VK_FORMAT_R16G16B16A16_SFLOAT, colorSpace);
+        CHECK(window.result == VK_SUCCESS);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        Settle(client, window.swapchain);
+        auto state = compositor.Surface(window.Id());
+        CHECK(state && state->description && state->description->windowsScrgb);
+
+        const RequestCounts before = compositor.Requests();
+        for (float maxCll : {400.0f, 600.0f, 800.0f}) {
+            client.SetHdrMetadata({&window.swapchain, 1}, WithMaxCll(maxCll));
+            Settle(client, window.swapchain);
+        }
+        const RequestCounts updates = compositor.Requests() - before;
+        CHECK(updates["wp_color_manager_v1.create_windows_scrgb"] == 0);
+        CHECK(updates["wp_color_manager_v1.create_parametric_creator"] == 0);
+        state = compositor.Surface(window.Id());
+        CHECK(state && state->description && state->description->windowsScrgb);
+        CHECK(state && state->untaggedCommits == 0);
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+static VkHdrMetadataEXT WithMaxLuminance(float maxLuminance)
+{
+    VkHdrMetadataEXT metadata = s_hdr10Metadata;
+    metadata.maxLuminance = maxLuminance;
+    return metadata;
+}
+
+// Metadata updates that wouldn't change what the compositor shows don't get
+// a description of their own: the same metadata again, content light levels
+// within HDR_WSI_METADATA_HYSTERESIS, and changes coming faster than
+// HDR_WSI_METADATA_MIN_INTERVAL_MS, which are applied once it passed.
+static void TestMetadataSuppression()
+{
+    static constexpr auto s_minInterval = 500ms;
+    // read when the layer is loaded, by the first LayerClient
+    setenv("HDR_WSI_METADATA_HYSTERESIS", "10", 1);
+    setenv("HDR_WSI_METADATA_MIN_INTERVAL_MS", std::to_string(s_minInterval.count()).c_str(), 1);
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        Window window = Hdr10Window(client);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 1000u);
+
+        RequestCounts before = compositor.Requests();
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        Settle(client, window.swapchain);
+        client.SetHdrMetadata({&window.swapchain, 1}, WithMaxCll(840.0f));
+        Settle(client, window.swapchain);
+        CHECK((compositor.Requests() - before).ColorManagement() == 0);
+        auto state = compositor.Surface(window.Id());
+        CHECK(state && state->description && state->description->maxCll == 800u);
+
+        std::this_thread::sleep_for(s_minInterval + 100ms);
+        client.SetHdrMetadata({&window.swapchain, 1}, WithMaxLuminance(600.0f));
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 600u);
+
+        // right after the change above, only the newest of these is applied,
+        // once the interval passed
+        before = compositor.Requests();
+        client.SetHdrMetadata({&window.swapchain, 1}, WithMaxLuminance(400.0f));
+        Settle(client, window.swapchain);
+        client.SetHdrMetadata({&window.swapchain, 1}, WithMaxLuminance(500.0f));
+        Settle(client, window.swapchain);
+        CHECK((compositor.Requests() - before).ColorManagement() == 0);
+        CHECK(MasteringMax(compositor, window.Id()) == 600u);
+
+        std::this_thread::sleep_for(s_minInterval + 100ms);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 500u);
+        state = compositor.Surface(window.Id());
+        CHECK(state && state->untaggedCommits == 0);
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+// The description the surface of a new swapchain with format and colorSpace
+// is tagged with.
+static std::optional<DescriptionParams> Tag(Fixture &fixture, VkFormat format, VkColorSpaceKHR colorSpace)
+{
+    Window window(fixture.client, format, colorSpace);
+    if (!CHECK(window.result == VK_SUCCESS)) {
+        return std::nullopt;
+    }
+    Settle(fixture.client, window.swapchain);
+    const auto state = fixture.compositor.Surface(window.Id());
+    CHECK(state && state->untaggedCommits == 0);
+    return state ? state->description : std::nullopt;
+}
+
+// CIE xy chromaticities in the units of set_primaries.
+static std::array<int32_t, 8> PrimaryValues(const std::array<float, 8> &chromaticities, double unit)
+{
+    std::array<int32_t, 8> values;
+    std::ranges::transform(chromaticities, values.begin(), [unit](float value) {
+        return int32_t(std::round(value * unit));
+    });
+    return values;
+}
+
+static constexpr std::array<float, 8> s_displayP3 = {0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.3127f, 0.3290f};
+static constexpr std::array<float, 8> s_dciP3 = {0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.314f, 0.351f};
+// DCI-P3's gamma 2.6 in the units of set_tf_power
+static constexpr uint32_t s_dciP3TfPower = 26'000;
+
+// Named primaries or a transfer function in the enum of protocol.
+static uint32_t Named(Protocol protocol, uint32_t xx, uint32_t wp)
+{
+    return protocol == Protocol::Xx ? xx : wp;
+}
+
+// HLG and the P3 colorspaces are tagged with their named primaries and
+// transfer functions. DCI-P3's gamma has no name, it's always a set_tf_power.
+static void Colorspaces(Protocol protocol)
+{
+    Fixture fixture(CompositorConfig::Only(protocol));
+
+    auto description = Tag(fixture, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_HLG_EXT);
+    if (CHECK(description)) {
+        CHECK(description->primariesNamed == Named(protocol, XX_COLOR_MANAGER_V4_PRIMARIES_BT2020, WP_COLOR_MANAGER_V1_PRIMARIES_BT2020));
+        CHECK(description->transferFunctionNamed == Named(protocol, XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_HLG, WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_HLG));
+    }
+
+    description = Tag(fixture, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DISPLAY_P3_NONLINEAR_EXT);
+    if (CHECK(description)) {
+        CHECK(description->primariesNamed == Named(protocol, XX_COLOR_MANAGER_V4_PRIMARIES_DISPLAY_P3, WP_COLOR_MANAGER_V1_PRIMARIES_DISPLAY_P3));
+        CHECK(description->transferFunctionNamed == Named(protocol, XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_SRGB, WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_SRGB));
+    }
+
+    description = Tag(fixture, VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_DISPLAY_P3_LINEAR_EXT);
+    if (CHECK(description)) {
+        CHECK(description->primariesNamed == Named(protocol, XX_COLOR_MANAGER_V4_PRIMARIES_DISPLAY_P3, WP_COLOR_MANAGER_V1_PRIMARIES_DISPLAY_P3));
+        CHECK(description->transferFunctionNamed == Named(protocol, XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_LINEAR, WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_EXT_LINEAR));
+    }
+
+    description = Tag(fixture, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DCI_P3_NONLINEAR_EXT);
+    if (CHECK(description)) {
+        CHECK(description->primariesNamed == Named(protocol, XX_COLOR_MANAGER_V4_PRIMARIES_DCI_P3, WP_COLOR_MANAGER_V1_PRIMARIES_DCI_P3));
+        CHECK(!description->transferFunctionNamed);
+        CHECK(description->tfPower == s_dciP3TfPower);
+    }
+    CHECK(fixture.compositor.ProtocolErrors() == 0);
+}
+
+static void TestColorspacesXx()
+{
+    Colorspaces(Protocol::Xx);
+}
+
+static void TestColorspacesWp()
+{
+    Colorspaces(Protocol::Wp);
+}
+
+// Without the named P3 primaries the P3 colorspaces are described with
+// set_primaries, and without that too they aren't exposed.
+static void TestColorspacesCustomPrimaries()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    std::erase(config.wpPrimaries, WP_COLOR_MANAGER_V1_PRIMARIES_DISPLAY_P3);
+    std::erase(config.wpPrimaries, WP_COLOR_MANAGER_V1_PRIMARIES_DCI_P3);
+    {
+        Fixture fixture(config);
+        auto description = Tag(fixture, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DISPLAY_P3_NONLINEAR_EXT);
+        if (CHECK(description)) {
+            CHECK(!description->primariesNamed);
+            CHECK(description->primaries == PrimaryValues(s_displayP3, 1'000'000.0));
+            CHECK(description->transferFunctionNamed == WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_SRGB);
+        }
+
+        description = Tag(fixture, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DCI_P3_NONLINEAR_EXT);
+        if (CHECK(description)) {
+            CHECK(!description->primariesNamed);
+            CHECK(description->primaries == PrimaryValues(s_dciP3, 1'000'000.0));
+            CHECK(description->tfPower == s_dciP3TfPower);
+        }
+        CHECK(fixture.compositor.ProtocolErrors() == 0);
+    }
+
+    std::erase(config.wpFeatures, WP_COLOR_MANAGER_V1_FEATURE_SET_PRIMARIES);
+    Fixture fixture(config);
+    {
+        Window window(fixture.client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        const auto formats = fixture.client.SurfaceFormats(window.surface);
+        CHECK(!HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DISPLAY_P3_NONLINEAR_EXT));
+        CHECK(!HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DCI_P3_NONLINEAR_EXT));
+        CHECK(HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_HLG_EXT));
+    }
+}
+
+// frog-color-management-v1 has no names for HLG and P3, so it only gets the
+// colorspaces it can describe.
+static void TestColorspacesFrog()
+{
+    Fixture fixture(CompositorConfig::Only(Protocol::Frog));
+    {
+        Window window(fixture.client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        const auto formats = fixture.client.SurfaceFormats(window.surface);
+        CHECK(HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT));
+        CHECK(!HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_HLG_EXT));
+        CHECK(!HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DISPLAY_P3_NONLINEAR_EXT));
+        CHECK(!HasFormat(formats, VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_DISPLAY_P3_LINEAR_EXT));
+        CHECK(!HasFormat(formats, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_DCI_P3_NONLINEAR_EXT));
+    }
+}
+
+// Points HDR_WSI_ICC_PROFILE at a profile of size bytes. It's read when the
+// layer is loaded, by the first LayerClient. The compositor doesn't parse
+// profiles, so it's all zeros.
+static std::string UseIccProfile(off_t size)
+{
+    char path[] = "/tmp/hdr-wsi-test-icc-XXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0 && ftruncate(fd, size) == 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    setenv("HDR_WSI_ICC_PROFILE", path, 1);
+    return path;
+}
+
+// The untagged sRGB swapchains are tagged with the ICC profile instead. All
+// surfaces of a display share its description, so it's only sent once.
+static void TestIccProfile()
+{
+    const std::string path = UseIccProfile(4096);
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        Window first(client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        Window second(client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        for (const Window *window : {&first, &second}) {
+            CHECK(window->result == VK_SUCCESS);
+            Settle(client, window->swapchain);
+            const auto state = compositor.Surface(window->Id());
+            CHECK(state && state->description && state->description->icc);
+            CHECK(state && state->untaggedCommits == 0);
+        }
+        CHECK(compositor.Requests()["wp_color_manager_v1.create_icc_creator"] == 1);
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+    unlink(path.c_str());
+}
+
+// sRGB swapchains stay untagged if the profile can't be used.
+static void IccProfileUnused(CompositorConfig config, off_t size)
+{
+    const std::string path = UseIccProfile(size);
+    Fixture fixture(std::move(config));
+    {
+        Window window(fixture.client, VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR);
+        CHECK(window.result == VK_SUCCESS);
+        Settle(fixture.client, window.swapchain);
+        const auto state = fixture.compositor.Surface(window.Id());
+        CHECK(state && !state->description);
+        CHECK(fixture.compositor.Requests()["wp_color_manager_v1.create_icc_creator"] == 0);
+    }
+    CHECK(fixture.compositor.ProtocolErrors() == 0);
+    unlink(path.c_str());
+}
+
+static void TestIccProfileNoFeature()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    std::erase(config.wpFeatures, WP_COLOR_MANAGER_V1_FEATURE_ICC_V2_V4);
+    IccProfileUnused(config, 4096);
+}
+
+static void TestIccProfileTooLarge()
+{
+    IccProfileUnused(CompositorConfig::Only(Protocol::Wp), (4 << 20) + 1);
+}
+
+// Replaces the window's swapchain like a resize does, with it as oldSwapchain.
+static void Recreate(Window &window, VkFormat format, VkColorSpaceKHR colorSpace)
+{
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+    CHECK(window.client.CreateSwapchain(window.surface, format, colorSpace, &swapchain, window.swapchain) == VK_SUCCESS);
+    window.client.DestroySwapchain(window.swapchain);
+    window.swapchain = swapchain;
+}
+
+// A swapchain recreated with the same colorspace takes over the state of the
+// old one, the surface keeps its description without a single request.
+static void TestRecreateSameColorspace()
+{
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        Window window = Hdr10Window(client);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        Settle(client, window.swapchain);
+
+        const RequestCounts before = compositor.Requests();
+        for (int i = 0; i < 3; i++) {
+            Recreate(window, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT);
+            Settle(client, window.swapchain);
+        }
+        CHECK((compositor.Requests() - before).ColorManagement() == 0);
+        const auto state = compositor.Surface(window.Id());
+        if (CHECK(state && state->description)) {
+            CHECK(state->description->maxCll == 800u);
+            CHECK(state->untaggedCommits == 0);
+        }
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+// With another colorspace the new swapchain starts over, and its first
+// present retags the surface.
+static void TestRecreateChangedColorspace()
+{
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        Window window = Hdr10Window(client);
+        client.SetHdrMetadata({&window.swapchain, 1}, s_hdr10Metadata);
+        Settle(client, window.swapchain);
+
+        Recreate(window, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_HLG_EXT);
+        CHECK(client.Present(window.swapchain) == VK_SUCCESS);
+        client.Roundtrip();
+        const auto state = compositor.Surface(window.Id());
+        if (CHECK(state && state->description)) {
+            CHECK(state->description->transferFunctionNamed == WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_HLG);
+            CHECK(state->untaggedCommits == 0);
+        }
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+// Surfaces moving between outputs are retagged with the description of the
+// output they're on. The parametric protocols track the outputs' descriptions
+// so color-management-v1 doesn't need to read them on each move.
+static void Retag(Protocol protocol)
+{
+    CompositorConfig config = CompositorConfig::Only(protocol);
+    config.preferred.maxLuminance = 600.0f;
+    config.outputs = {DisplayInfo{.maxLuminance = 1000.0f}, DisplayInfo{.maxLuminance = 400.0f}};
+    Fixture fixture(config);
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        Window window = Hdr10Window(client);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 600u);
+        CHECK(compositor.ColorOutputs() == (protocol == Protocol::Frog ? 0u : 2u));
+
+        const RequestCounts before = compositor.Requests();
+        compositor.MoveSurface(window.Id(), 0);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 1000u);
+
+        compositor.MoveSurface(window.Id(), 1);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 400u);
+
+        compositor.MoveSurface(window.Id(), 0);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 1000u);
+
+        const RequestCounts moves = compositor.Requests() - before;
+        if (protocol == Protocol::Wp) {
+            CHECK(moves["wp_color_management_surface_feedback_v1.get_preferred"] == 0);
+            CHECK(moves["wp_image_description_v1.get_information"] == 0);
+        }
+        const auto state = compositor.Surface(window.Id());
+        CHECK(state && state->untaggedCommits == 0);
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+static void TestRetagFrog()
+{
+    Retag(Protocol::Frog);
+}
+
+static void TestRetagXx()
+{
+    Retag(Protocol::Xx);
+}
+
+static void TestRetagWp()
+{
+    Retag(Protocol::Wp);
+}
+
+// A change of the description of the output a surface is on.
+static void TestOutputChanged()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    config.outputs = {DisplayInfo{.maxLuminance = 1000.0f}};
+    Fixture fixture(config);
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        Window window = Hdr10Window(client);
+        compositor.MoveSurface(window.Id(), 0);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 1000u);
+
+        compositor.SetOutputInfo(0, DisplayInfo{.maxLuminance = 800.0f});
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 800u);
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+// Outputs added later are tracked too, and removed ones dropped with
+// global_remove.
+static void TestOutputHotplug()
+{
+    CompositorConfig config = CompositorConfig::Only(Protocol::Wp);
+    config.preferred.maxLuminance = 600.0f;
+    config.outputs = {DisplayInfo{.maxLuminance = 1000.0f}};
+    Fixture fixture(config);
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        Window window = Hdr10Window(client);
+        Settle(client, window.swapchain);
+        CHECK(compositor.ColorOutputs() == 1);
+
+        const size_t added = compositor.AddOutput(DisplayInfo{.maxLuminance = 400.0f});
+        Settle(client, window.swapchain);
+        CHECK(compositor.ColorOutputs() == 2);
+
+        compositor.MoveSurface(window.Id(), added);
+        Settle(client, window.swapchain);
+        CHECK(MasteringMax(compositor, window.Id()) == 400u);
+
+        // the surface goes back to the default preferred description
+        compositor.RemoveOutput(added);
+        Settle(client, window.swapchain);
+        CHECK(compositor.ColorOutputs() == 1);
+        CHECK(MasteringMax(compositor, window.Id()) == 600u);
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+// vkSetHdrMetadataEXT and vkQueuePresentKHR from many threads at once, each
+// presenting its own swapchains while another one keeps changing the metadata
+// of all of them. The stub driver doesn't need the external synchronization of
+// the queue, so nothing serializes the threads before the layer.
+static void TestStress()
+{
+    constexpr size_t threadCount = 8;
+    constexpr size_t windowsPerThread = 4;
+    constexpr int frames = 200;
+
+    Fixture fixture(CompositorConfig::Only(Protocol::Wp));
+    LayerClient &client = fixture.client;
+    MockCompositor &compositor = fixture.compositor;
+    {
+        std::vector<std::unique_ptr<Window>> windows;
+        std::vector<VkSwapchainKHR> swapchains;
+        for (size_t i = 0; i < threadCount * windowsPerThread; i++) {
+            windows.push_back(std::make_unique<Window>(client, VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_HDR10_ST2084_EXT));
+            CHECK(windows.back()->result == VK_SUCCESS);
+            swapchains.push_back(windows.back()->swapchain);
+        }
+
+        std::atomic<int> failedPresents = 0;
+        std::atomic<size_t> running = threadCount;
+        std::vector<std::thread> presenters;
+        for (size_t t = 0; t < threadCount; t++) {
+            presenters.emplace_back([&, t] {
+                const std::span<const VkSwapchainKHR> own(swapchains.data() + t * windowsPerThread, windowsPerThread);
+                for (int frame = 0; frame < frames; frame++) {
+                    client.SetHdrMetadata(own, WithMaxCll(float(100 + frame % 50 * 10)));
+                    if (client.Present(own) != VK_SUCCESS) {
+                        failedPresents++;
+                    }
+                }
+                running--;
+            });
+        }
+        std::thread meddler([&] {
+            for (int i = 0; running > 0; i++) {
+                client.SetHdrMetadata(swapchains, WithMaxCll(float(600 + i % 2 * 100)));
+            }
+        });
+        // the layer's events are only read by roundtrips, like an
+        // application's event loop does
+        while (running > 0) {
+            client.Roundtrip();
+        }
+        for (std::thread &presenter : presenters) {
+            presenter.join();
+        }
+        meddler.join();
+        CHECK(failedPresents == 0);
+
+        // every surface ends up with the last metadata of its swapchain
+        for (size_t i = 0; i < swapchains.size(); i++) {
+            client.SetHdrMetadata({&swapchains[i], 1}, WithMaxCll(float(900 + i)));
+        }
+        for (int i = 0; i < 4; i++) {
+            client.Roundtrip();
+            CHECK(client.Present(swapchains) == VK_SUCCESS);
+        }
+        client.Roundtrip();
+        for (size_t i = 0; i < windows.size(); i++) {
+            const auto state = compositor.Surface(windows[i]->Id());
+            CHECK(state && state->description && state->description->maxCll == 900 + i);
+            CHECK(state && state->untaggedCommits == 0);
+        }
+    }
+    CHECK(compositor.ProtocolErrors() == 0);
+}
+
+struct TestCase {
+    std::string_view name;
+    void (*run)();
+};
+
+static constexpr TestCase s_testCases[] = {
+    {"select-all", TestSelectAll},
+    {"select-wp-xx", TestSelectWpXx},
+    {"select-xx", TestSelectXx},
+    {"select-none", TestSelectNone},
+    {"select-no-parametric", TestSelectNoParametric},
+    {"formats-no-pq", TestFormatsNoPq},
+    {"formats-no-scrgb", TestFormatsNoScrgb},
+    {"first-present-frog", TestFirstPresentFrog},
+    {"first-present-xx", TestFirstPresentXx},
+    {"first-present-wp", TestFirstPresentWp},
+    {"budget", TestBudget},
+    {"delayed-description", TestDelayedDescription},
+    {"failed-description", TestFailedDescription},
+    {"passthrough", TestPassthrough},
+    {"scrgb", TestScrgb},
+    {"colorspaces-xx", TestColorspacesXx},
+    {"colorspaces-wp", TestColorspacesWp},
+    {"colorspaces-custom-primaries", TestColorspacesCustomPrimaries},
+    {"colorspaces-frog", TestColorspacesFrog},
+    {"icc-profile", TestIccProfile},
+    {"icc-profile-no-feature", TestIccProfileNoFeature},
+    {"icc-profile-too-large", TestIccProfileTooLarge},
+    {"metadata-suppression", TestMetadataSuppression},
+    {"recreate-same-colorspace", TestRecreateSameColorspace},
+    {"recreate-changed-colorspace", TestRecreateChangedColorspace},
+    {"retag-frog", TestRetagFrog},
+    {"retag-xx", TestRetagXx},
+    {"retag-wp", TestRetagWp},
+    {"output-changed", TestOutputChanged},
+    {"output-hotplug", TestOutputHotplug},
+    {"stress", TestStress},
+};
+
+int main(int argc, char **argv)
+{
+    if (argc == 2) {
+        for (const TestCase &testCase : s_testCases) {
+            if (testCase.name == argv[1]) {
+                testCase.run();
+                return s_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+            }
+        }
+    }
+
+    fprintf(stderr, "Usage: %s <case>\n\nCases:\n", argv[0]);
+    for (const TestCase &testCase : s_testCases) {
+        fprintf(stderr, "  %.*s\n", int(testCase.name.size()), testCase.name.data());
+    }
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,669 @@
+#include "layer_client.h"
+
+#include <vulkan/vk_layer.h>
+#include <wayland-client.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace HdrWsiTest
+{
+
+using namespace std::literals;
+
+namespace
+{
+
+// Dispatchable handles start with the loader's dispatch pointer, which the
+// layer never looks at.
+struct StubDispatchable {
+    void *loaderData = nullptr;
+};
+
+struct StubSurface {
+    wl_display *display;
+    wl_surface *surface;
+};
+
+struct StubSwapchain {
+    StubSurface *surface;
+    VkFormat format;
+    VkColorSpaceKHR colorSpace;
+};
+
+// There's one driver per process, like the layer's own state.
+struct StubDriver {
+    DriverConfig config;
+    StubDispatchable instance;
+    StubDispatchable physicalDevice;
+    StubDispatchable device;
+    StubDispatchable queue;
+};
+
+static StubDriver s_driver;
+
+static void Fail(const char *what)
+{
+    fprintf(stderr, "layer client: %s\n", what);
+    abort();
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubCreateInstance(const VkInstanceCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkInstance *pInstance)
+{
+    *pInstance = reinterpret_cast<VkInstance>(&s_driver.instance);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubDestroyInstance(VkInstance instance, const VkAllocationCallbacks *pAllocator)
+{
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubEnumeratePhysicalDevices(VkInstance instance, uint32_t *pPhysicalDeviceCount, VkPhysicalDevice *pPhysicalDevices)
+{
+    if (!pPhysicalDevices) {
+        *pPhysicalDeviceCount = 1;
+        return VK_SUCCESS;
+    }
+    if (*pPhysicalDeviceCount < 1) {
+        return VK_INCOMPLETE;
+    }
+    s_driver.physicalDevice.loaderData = s_driver.instance.loaderData;
+    pPhysicalDevices[0] = reinterpret_cast<VkPhysicalDevice>(&s_driver.physicalDevice);
+    *pPhysicalDeviceCount = 1;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubGetPhysicalDeviceProperties(VkPhysicalDevice physicalDevice, VkPhysicalDeviceProperties *pProperties)
+{
+    *pProperties = {};
+    pProperties->apiVersion = VK_API_VERSION_1_3;
+    pProperties->deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU;
+    snprintf(pProperties->deviceName, sizeof(pProperties->deviceName), "hdr-wsi stub");
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubGetPhysicalDeviceQueueFamilyProperties(VkPhysicalDevice physicalDevice, uint32_t *pQueueFamilyPropertyCount, VkQueueFamilyProperties *pQueueFamilyProperties)
+{
+    if (!pQueueFamilyProperties) {
+        *pQueueFamilyPropertyCount = 1;
+        return;
+    }
+    if (*pQueueFamilyPropertyCount >= 1) {
+        pQueueFamilyProperties[0] = {
+            .queueFlags = VK_QUEUE_GRAPHICS_BIT,
+            .queueCount = 1,
+        };
+        *pQueueFamilyPropertyCount = 1;
+    }
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubEnumerateDeviceExtensionProperties(VkPhysicalDevice physicalDevice, const char *pLayerName, uint32_t *pPropertyCount, VkExtensionProperties *pProperties)
+{
+    static constexpr std::array<VkExtensionProperties, 1> s_extensions = {{
+        {VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_SWAPCHAIN_SPEC_VERSION},
+    }};
+    if (!pProperties) {
+        *pPropertyCount = uint32_t(s_extensions.size());
+        return VK_SUCCESS;
+    }
+    const uint32_t count = std::min(*pPropertyCount, uint32_t(s_extensions.size()));
+    std::copy_n(s_extensions.begin(), count, pProperties);
+    *pPropertyCount = count;
+    return count < s_extensions.size() ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+static std::vector<VkSurfaceFormatKHR> DriverFormats()
+{
+    std::vector<VkSurfaceFormatKHR> formats = s_driver.config.formats;
+    if (s_driver.config.passthrough) {
+        for (const VkSurfaceFormatKHR &format : s_driver.config.formats) {
+            formats.push_back({format.format, VK_COLOR_SPACE_PASS_THROUGH_EXT});
+        }
+    }
+    return formats;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubGetPhysicalDeviceSurfaceFormatsKHR(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, uint32_t *pSurfaceFormatCount, VkSurfaceFormatKHR *pSurfaceFormats)
+{
+    const std::vector<VkSurfaceFormatKHR> formats = DriverFormats();
+    if (!pSurfaceFormats) {
+        *pSurfaceFormatCount = uint32_t(formats.size());
+        return VK_SUCCESS;
+    }
+    const uint32_t count = std::min(*pSurfaceFormatCount, uint32_t(formats.size()));
+    std::copy_n(formats.begin(), count, pSurfaceFormats);
+    *pSurfaceFormatCount = count;
+    return count < formats.size() ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubGetPhysicalDeviceSurfaceFormats2KHR(VkPhysicalDevice physicalDevice, const VkPhysicalDeviceSurfaceInfo2KHR *pSurfaceInfo, uint32_t *pSurfaceFormatCount, VkSurfaceFormat2KHR *pSurfaceFormats)
+{
+    const std::vector<VkSurfaceFormatKHR> formats = DriverFormats();
+    if (!pSurfaceFormats) {
+        *pSurfaceFormatCount = uint32_t(formats.size());
+        return VK_SUCCESS;
+    }
+    const uint32_t count = std::min(*pSurfaceFormatCount, uint32_t(formats.size()));
+    for (uint32_t i = 0; i < count; i++) {
+        pSurfaceFormats[i].surfaceFormat = formats[i];
+    }
+    *pSurfaceFormatCount = count;
+    return count < formats.size() ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubCreateWaylandSurfaceKHR(VkInstance instance, const VkWaylandSurfaceCreateInfoKHR *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkSurfaceKHR *pSurface)
+{
+    *pSurface = reinterpret_cast<VkSurfaceKHR>(new StubSurface{pCreateInfo->display, pCreateInfo->surface});
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubDestroySurfaceKHR(VkInstance instance, VkSurfaceKHR surface, const VkAllocationCallbacks *pAllocator)
+{
+    delete reinterpret_cast<StubSurface *>(surface);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubCreateDevice(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkDevice *pDevice)
+{
+    *pDevice = reinterpret_cast<VkDevice>(&s_driver.device);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubDestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubGetDeviceQueue(VkDevice device, uint32_t queueFamilyIndex, uint32_t queueIndex, VkQueue *pQueue)
+{
+    s_driver.queue.loaderData = s_driver.device.loaderData;
+    *pQueue = reinterpret_cast<VkQueue>(&s_driver.queue);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubCreateSwapchainKHR(VkDevice device, const VkSwapchainCreateInfoKHR *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkSwapchainKHR *pSwapchain)
+{
+    const std::vector<VkSurfaceFormatKHR> formats = DriverFormats();
+    const bool supported = std::ranges::any_of(formats, [pCreateInfo](const VkSurfaceFormatKHR &format) {
+        return format.format == pCreateInfo->imageFormat && format.colorSpace == pCreateInfo->imageColorSpace;
+    });
+    if (!supported) {
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+    *pSwapchain = reinterpret_cast<VkSwapchainKHR>(new StubSwapchain{
+        reinterpret_cast<StubSurface *>(pCreateInfo->surface),
+        pCreateInfo->imageFormat,
+        pCreateInfo->imageColorSpace,
+    });
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubDestroySwapchainKHR(VkDevice device, VkSwapchainKHR swapchain, const VkAllocationCallbacks *pAllocator)
+{
+    delete reinterpret_cast<StubSwapchain *>(swapchain);
+}
+
+static VKAPI_ATTR void VKAPI_CALL StubSetHdrMetadataEXT(VkDevice device, uint32_t swapchainCount, const VkSwapchainKHR *pSwapchains, const VkHdrMetadataEXT *pMetadata)
+{
+}
+
+// Like a driver's WSI, commits a new buffer to each surface.
+static VKAPI_ATTR VkResult VKAPI_CALL StubQueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
+{
+    wl_display *display = nullptr;
+    for (uint32_t i = 0; i < pPresentInfo->swapchainCount; i++) {
+        StubSurface *surface = reinterpret_cast<StubSwapchain *>(pPresentInfo->pSwapchains[i])->surface;
+        wl_surface_commit(surface->surface);
+        display = surface->display;
+    }
+    if (display) {
+        wl_display_flush(display);
+    }
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetInstanceProcAddr(VkInstance instance, const char *pName);
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetDeviceProcAddr(VkDevice device, const char *pName);
+
+template <typename Function>
+static std::pair<std::string_view, PFN_vkVoidFunction> Entry(std::string_view name, Function function)
+{
+    return {name, reinterpret_cast<PFN_vkVoidFunction>(function)};
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetDeviceProcAddr(VkDevice device, const char *pName)
+{
+    static const std::array s_functions = {
+        Entry("vkGetDeviceProcAddr", StubGetDeviceProcAddr),
+        Entry("vkDestroyDevice", StubDestroyDevice),
+        Entry("vkGetDeviceQueue", StubGetDeviceQueue),
+        Entry("vkCreateSwapchainKHR", StubCreateSwapchainKHR),
+        Entry("vkDestroySwapchainKHR", StubDestroySwapchainKHR),
+        Entry("vkSetHdrMetadataEXT", StubSetHdrMetadataEXT),
+        Entry("vkQueuePresentKHR", StubQueuePresentKHR),
+    };
+    for (const auto &[name, function] : s_functions) {
+        if (name == pName) {
+            return function;
+        }
+    }
+    return nullptr;
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL StubGetInstanceProcAddr(VkInstance instance, const char *pName)
+{
+    static const std::array s_functions = {
+        Entry("vkGetInstanceProcAddr", StubGetInstanceProcAddr),
+        Entry("vkCreateInstance", StubCreateInstance),
+        Entry("vkDestroyInstance", StubDestroyInstance),
+        Entry("vkEnumeratePhysicalDevices", StubEnumeratePhysicalDevices),
+        Entry("vkGetPhysicalDeviceProperties", StubGetPhysicalDeviceProperties),
+        Entry("vkGetPhysicalDeviceQueueFamilyProperties", StubGetPhysicalDeviceQueueFamilyProperties),
+        Entry("vkEnumerateDeviceExtensionProperties", StubEnumerateDeviceExtensionProperties),
+        Entry("vkGetPhysicalDeviceSurfaceFormatsKHR", StubGetPhysicalDeviceSurfaceFormatsKHR),
+        Entry("vkGetPhysicalDeviceSurfaceFormats2KHR", StubGetPhysicalDeviceSurfaceFormats2KHR),
+        Entry("vkCreateWaylandSurfaceKHR", StubCreateWaylandSurfaceKHR),
+        Entry("vkDestroySurfaceKHR", StubDestroySurfaceKHR),
+        Entry("vkCreateDevice", StubCreateDevice),
+    };
+    for (const auto &[name, function] : s_functions) {
+        if (name == pName) {
+            return function;
+        }
+    }
+    return StubGetDeviceProcAddr(VK_NULL_HANDLE, pName);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubSetInstanceLoaderData(VkInstance instance, void *object)
+{
+    static_cast<StubDispatchable *>(object)->loaderData = reinterpret_cast<StubDispatchable *>(instance)->loaderData;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL StubSetDeviceLoaderData(VkDevice device, void *object)
+{
+    static_cast<StubDispatchable *>(object)->loaderData = reinterpret_cast<StubDispatchable *>(device)->loaderData;
+    return VK_SUCCESS;
+}
+
+struct Layer {
+    PFN_vkGetInstanceProcAddr getInstanceProcAddr;
+    PFN_vkGetDeviceProcAddr getDeviceProcAddr;
+};
+
+// The layer's state is per process, so it's loaded once and never unloaded.
+static const Layer &LoadLayer()
+{
+    static const Layer s_layer = [] {
+        void *library = dlopen(HDR_WSI_LAYER_PATH, RTLD_NOW | RTLD_LOCAL);
+        if (!library) {
+            Fail(dlerror());
+        }
+        Layer layer = {};
+        auto negotiate = reinterpret_cast<PFN_vkNegotiateLoaderLayerInterfaceVersion>(dlsym(library, "vkNegotiateLoaderLayerInterfaceVersion"));
+        VkNegotiateLayerInterface interface = {
+            .sType = LAYER_NEGOTIATE_INTERFACE_STRUCT,
+            .loaderLayerInterfaceVersion = 2,
+        };
+        if (negotiate && negotiate(&interface) == VK_SUCCESS) {
+            layer.getInstanceProcAddr = interface.pfnGetInstanceProcAddr;
+            layer.getDeviceProcAddr = interface.pfnGetDeviceProcAddr;
+        } else {
+            layer.getInstanceProcAddr = reinterpret_cast<PFN_vkGetInstanceProcAddr>(dlsym(library, "vkGetInstanceProcAddr"));
+            layer.getDeviceProcAddr = reinterpret_cast<PFN_vkGetDeviceProcAddr>(dlsym(library, "vkGetDeviceProcAddr"));
+        }
+        if (!layer.getInstanceProcAddr || !layer.getDeviceProcAddr) {
+            Fail("the layer has no entry points");
+        }
+        return layer;
+    }();
+    return s_layer;
+}
+
+template <typename Function>
+static Function InstanceFunction(VkInstance instance, const char *name)
+{
+    auto function = reinterpret_cast<Function>(LoadLayer().getInstanceProcAddr(instance, name));
+    if (!function) {
+        Fail(name);
+    }
+    return function;
+}
+
+template <typename Function>
+static Function DeviceFunction(VkDevice device, const char *name)
+{
+    auto function = reinterpret_cast<Function>(LoadLayer().getDeviceProcAddr(device, name));
+    if (!function) {
+        Fail(name);
+    }
+    return function;
+}
+
+static const wl_registry_listener s_registryListener = {
+    .global = [](void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
+        if (interface == "wl_compositor"sv) {
+            *static_cast<wl_compositor **>(data) = static_cast<wl_compositor *>(wl_registry_bind(registry, name, &wl_compositor_interface, 4));
+        }
+    },
+    .global_remove = [](void *data, wl_registry *registry, uint32_t name) {
+    },
+};
+
+}
+
+LayerClient::LayerClient(int fd, DriverConfig driver)
+{
+    s_driver.config = std::move(driver);
+
+    m_display = wl_display_connect_to_fd(fd);
+    if (!m_display) {
+        Fail("can't connect to the compositor");
+    }
+    m_registry = wl_display_get_registry(m_display);
+    wl_registry_add_listener(m_registry, &s_registryListener, &m_compositor);
+    wl_display_roundtrip(m_display);
+    if (!m_compositor) {
+        Fail("no wl_compositor");
+    }
+
+    // what the loader does for an instance with one layer above the driver
+    VkLayerInstanceLink instanceLink = {
+        .pfnNextGetInstanceProcAddr = StubGetInstanceProcAddr,
+    };
+    VkLayerInstanceCreateInfo instanceLoaderData = {
+        .sType = VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO,
+        .function = VK_LOADER_DATA_CALLBACK,
+        .u = {.pfnSetInstanceLoaderData = StubSetInstanceLoaderData},
+    };
+    VkLayerInstanceCreateInfo instanceLayerInfo = {
+        .sType = VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO,
+        .pNext = &instanceLoaderData,
+        .function = VK_LAYER_LINK_INFO,
+        .u = {.pLayerInfo = &instanceLink},
+    };
+    const VkApplicationInfo applicationInfo = {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pApplicationName = "hdr-wsi-test",
+        .apiVersion = VK_API_VERSION_1_3,
+    };
+    const std::array instanceExtensions = {
+        VK_KHR_SURFACE_EXTENSION_NAME,
+        VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME,
+        VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME,
+    };
+    const VkInstanceCreateInfo instanceInfo = {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pNext = &instanceLayerInfo,
+        .pApplicationInfo = &applicationInfo,
+        .enabledExtensionCount = uint32_t(instanceExtensions.size()),
+        .ppEnabledExtensionNames = instanceExtensions.data(),
+    };
+    if (InstanceFunction<PFN_vkCreateInstance>(VK_NULL_HANDLE, "vkCreateInstance")(&instanceInfo, nullptr, &m_instance) != VK_SUCCESS) {
+        Fail("vkCreateInstance");
+    }
+
+    m_destroyInstance = InstanceFunction<PFN_vkDestroyInstance>(m_instance, "vkDestroyInstance");
+    m_createWaylandSurface = InstanceFunction<PFN_vkCreateWaylandSurfaceKHR>(m_instance, "vkCreateWaylandSurfaceKHR");
+    m_destroySurface = InstanceFunction<PFN_vkDestroySurfaceKHR>(m_instance, "vkDestroySurfaceKHR");
+    m_getSurfaceFormats = InstanceFunction<PFN_vkGetPhysicalDeviceSurfaceFormatsKHR>(m_instance, "vkGetPhysicalDeviceSurfaceFormatsKHR");
+    m_getSurfaceFormats2 = InstanceFunction<PFN_vkGetPhysicalDeviceSurfaceFormats2KHR>(m_instance, "vkGetPhysicalDeviceSurfaceFormats2KHR");
+
+    uint32_t count = 1;
+    if (InstanceFunction<PFN_vkEnumeratePhysicalDevices>(m_instance, "vkEnumeratePhysicalDevices")(m_instance, &count, &m_physicalDevice) != VK_SUCCESS) {
+        Fail("vkEnumeratePhysicalDevices");
+    }
+
+    VkLayerDeviceLink deviceLink = {
+        .pfnNextGetInstanceProcAddr = StubGetInstanceProcAddr,
+        .pfnNextGetDeviceProcAddr = StubGetDeviceProcAddr,
+    };
+    VkLayerDeviceCreateInfo deviceLoaderData = {
+        .sType = VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO,
+        .function = VK_LOADER_DATA_CALLBACK,
+        .u = {.pfnSetDeviceLoaderData = StubSetDeviceLoaderData},
+    };
+    VkLayerDeviceCreateInfo deviceLayerInfo = {
+        .sType = VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO,
+        .pNext = &deviceLoaderData,
+        .function = VK_LAYER_LINK_INFO,
+        .u = {.pLayerInfo = &deviceLink},
+    };
+    const float priority = 1.0f;
+    const VkDeviceQueueCreateInfo queueInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = 0,
+        .queueCount = 1,
+        .pQueuePriorities = &priority,
+    };
+    const std::array deviceExtensions = {
+        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+        VK_EXT_HDR_METADATA_EXTENSION_NAME,
+    };
+    const VkDeviceCreateInfo deviceInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pNext = &deviceLayerInfo,
+        .queueCreateInfoCount = 1,
+        .pQueueCreateInfos = &queueInfo,
+        .enabledExtensionCount = uint32_t(deviceExtensions.size()),
+        .ppEnabledExtensionNames = deviceExtensions.data(),
+    };
+    if (InstanceFunction<PFN_vkCreateDevice>(m_instance, "vkCreateDevice")(m_physicalDevice, &deviceInfo, nullptr, &m_device) != VK_SUCCESS) {
+        Fail("vkCreateDevice");
+    }
+
+    m_destroyDevice = DeviceFunction<PFN_vkDestroyDevice>(m_device, "vkDestroyDevice");
+    m_createSwapchain = DeviceFunction<PFN_vkCreateSwapchainKHR>(m_device, "vkCreateSwapchainKHR");
+    m_destroySwapchain = DeviceFunction<PFN_vkDestroySwapchainKHR>(m_device, "vkDestroySwapchainKHR");
+    m_setHdrMetadata = DeviceFunction<PFN_vkSetHdrMetadataEXT>(m_device, "vkSetHdrMetadataEXT");
+    m_queuePresent = DeviceFunction<PFN_vkQueuePresentKHR>(m_device, "vkQueuePresentKHR");
+    DeviceFunction<PFN_vkGetDeviceQueue>(m_device, "vkGetDeviceQueue")(m_device, 0, 0, &m_queue);
+}
+
+LayerClient::~LayerClient()
+{
+    m_destroyDevice(m_device, nullptr);
+    m_destroyInstance(m_instance, nullptr);
+    wl_compositor_destroy(m_compositor);
+    wl_registry_destroy(m_registry);
+    wl_display_disconnect(m_display);
+}
+
+void LayerClient::Roundtrip()
+{
+    if (wl_display_roundtrip(m_display) < 0) {
+        Fail("lost the connection to the compositor");
+    }
+}
+
+wl_surface *LayerClient::CreateWlSurface()
+{
+    return wl_compositor_create_surface(m_compositor);
+}
+
+uint32_t LayerClient::Id(wl_surface *surface)
+{
+    return wl_proxy_get_id(reinterpret_cast<wl_proxy *>(surface));
+}
+
+void LayerClient::DestroyWlSurface(wl_surface *surface)
+{
+    wl_surface_destroy(surface);
+}
+
+VkSurfaceKHR LayerClient::CreateSurface(wl_surface *surface)
+{
+    const VkWaylandSurfaceCreateInfoKHR createInfo = {
+        .sType = VK_STRUCTURE_TYPE_WAYLAND_SURFACE_CREATE_INFO_KHR,
+        .display = m_display,
+        .surface = surface,
+    };
+    VkSurfaceKHR vkSurface = VK_NULL_HANDLE;
+    if (m_createWaylandSurface(m_instance, &createInfo, nullptr, &vkSurface) != VK_SUCCESS) {
+        Fail("vkCreateWaylandSurfaceKHR");
+    }
+    return vkSurface;
+}
+
+void LayerClient::DestroySurface(VkSurfaceKHR surface)
+{
+    m_destroySurface(m_instance, surface, nullptr);
+}
+
+std::vector<VkSurfaceFormatKHR> LayerClient::SurfaceFormats(VkSurfaceKHR surface)
+{
+    uint32_t count = 0;
+    m_getSurfaceFormats(m_physicalDevice, surface, &count, nullptr);
+    std::vector<VkSurfaceFormatKHR> formats(count);
+    if (m_getSurfaceFormats(m_physicalDevice, surface, &count, formats.data()) != VK_SUCCESS) {
+        Fail("vkGetPhysicalDeviceSurfaceFormatsKHR");
+    }
+    formats.resize(count);
+    return formats;
+}
+
+std::vector<VkSurfaceFormatKHR> LayerClient::SurfaceFormats2(VkSurfaceKHR surface)
+{
+    const VkPhysicalDeviceSurfaceInfo2KHR surfaceInfo = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SURFACE_INFO_2_KHR,
+        .surface = surface,
+    };
+    uint32_t count = 0;
+    m_getSurfaceFormats2(m_physicalDevice, &surfaceInfo, &count, nullptr);
+    std::vector<VkSurfaceFormat2KHR> formats(count, {.sType = VK_STRUCTURE_TYPE_SURFACE_FORMAT_2_KHR});
+    if (m_getSurfaceFormats2(m_physicalDevice, &surfaceInfo, &count, formats.data()) != VK_SUCCESS) {
+        Fail("vkGetPhysicalDeviceSurfaceFormats2KHR");
+    }
+    std::vector<VkSurfaceFormatKHR> surfaceFormats;
+    for (uint32_t i = 0; i < count; i++) {
+        surfaceFormats.push_back(formats[i].surfaceFormat);
+    }
+    return surfaceFormats;
+}
+
+uint32_t LayerClient::SurfaceFormats(VkSurfaceKHR surface, std::span<VkSurfaceFormatKHR> formats)
+{
+    uint32_t count = uint32_t(formats.size());
+    const VkResult result = m_getSurfaceFormats(m_physicalDevice, surface, &count, formats.data());
+    if (result != VK_SUCCESS && result != VK_INCOMPLETE) {
+        Fail("vkGetPhysicalDeviceSurfaceFormatsKHR");
+    }
+    return count;
+}
+
+uint32_t LayerClient::SurfaceFormats2(VkSurfaceKHR surface, std::span<VkSurfaceFormat2KHR> formats)
+{
+    const VkPhysicalDeviceSurfaceInfo2KHR surfaceInfo = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SURFACE_INFO_2_KHR,
+        .surface = surface,
+    };
+    uint32_t count = uint32_t(formats.size());
+    const VkResult result = m_getSurfaceFormats2(m_physicalDevice, &surfaceInfo, &count, formats.data());
+    if (result != VK_SUCCESS && result != VK_INCOMPLETE) {
+        Fail("vkGetPhysicalDeviceSurfaceFormats2KHR");
+    }
+    return count;
+}
+
+VkResult LayerClient::CreateSwapchain(VkSurfaceKHR surface, VkFormat format, VkColorSpaceKHR colorSpace,
+                                      VkSwapchainKHR *swapchain, VkSwapchainKHR oldSwapchain)
+{
+    const VkSwapchainCreateInfoKHR createInfo = {
+        .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+        .surface = surface,
+        .minImageCount = 3,
+        .imageFormat = format,
+        .imageColorSpace = colorSpace,
+        .imageExtent = {3840, 2160},
+        .imageArrayLayers = 1,
+        .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+        .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+        .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+        .presentMode = VK_PRESENT_MODE_FIFO_KHR,
+        .clipped = VK_TRUE,
+        .oldSwapchain = oldSwapchain,
+    };
+    return m_createSwapchain(m_device, &createInfo, nullptr, swapchain);
+}
+
+void LayerClient::DestroySwapchain(VkSwapchainKHR swapchain)
+{
+    m_destroySwapchain(m_device, swapchain, nullptr);
+}
+
+void LayerClient::SetHdrMetadata(std::span<const VkSwapchainKHR> swapchains, const VkHdrMetadataEXT &metadata)
+{
+    if (swapchains.size() == 1) {
+        m_setHdrMetadata(m_device, 1, swapchains.data(), &metadata);
+        return;
+    }
+    const std::vector<VkHdrMetadataEXT> metadatas(swapchains.size(), metadata);
+    m_setHdrMetadata(m_device, uint32_t(swapchains.size()), swapchains.data(), metadatas.data());
+}
+
+VkResult LayerClient::Present(std::span<const VkSwapchainKHR> swapchains)
+{
+    const uint32_t imageIndex = 0;
+    std::vector<uint32_t> imageIndices;
+    if (swapchains.size() > 1) {
+        imageIndices.resize(swapchains.size(), 0);
+    }
+    const VkPresentInfoKHR presentInfo = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .swapchainCount = uint32_t(swapchains.size()),
+        .pSwapchains = swapchains.data(),
+        .pImageIndices = swapchains.size() > 1 ? imageIndices.data() : &imageIndex,
+    };
+    return m_queuePresent(m_queue, &presentInfo);
+}
+
+VkColorSpaceKHR LayerClient::DriverColorSpace(VkSwapchainKHR swapchain)
+{
+    return reinterpret_cast<StubSwapchain *>(swapchain)->colorSpace;
+}
+
+const HdrWsiStats::Segment *LayerClient::Stats()
+{
+    // the layer creates the segment with its first HDR swapchain
+    static const HdrWsiStats::Segment *s_segment = nullptr;
+    if (s_segment) {
+        return s_segment;
+    }
+    char name[64];
+    HdrWsiStats::SegmentName(name, uint32_t(getpid()));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    void *memory = mmap(nullptr, sizeof(HdrWsiStats::Segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory != MAP_FAILED) {
+        s_segment = static_cast<const HdrWsiStats::Segment *>(memory);
+    }
+    return s_segment;
+}
+
+EventLoop::EventLoop(LayerClient &client)
+    : m_thread([this, &client] {
+        while (!m_stop) {
+            client.Roundtrip();
+        }
+    })
+{
+}
+
+EventLoop::~EventLoop()
+{
+    m_stop = true;
+    m_thread.join();
+}
+
+}
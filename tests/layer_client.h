@@ -0,0 +1,118 @@
+#pragma once
+
+// The application side of the tests: a Wayland client connected to the mock
+// compositor, and the layer loaded the way the Vulkan loader loads it, on top
+// of a stub driver. The stub driver commits the wl_surface on every present
+// like a real one, and remembers the colorspace each swapchain was created
+// with.
+
+#define VK_USE_PLATFORM_WAYLAND_KHR
+#include <vulkan/vulkan.h>
+
+#include "../src/hdr_wsi_stats.h"
+
+#include <atomic>
+#include <span>
+#include <thread>
+#include <vector>
+
+struct wl_compositor;
+struct wl_display;
+struct wl_registry;
+struct wl_surface;
+
+namespace HdrWsiTest
+{
+
+struct DriverConfig {
+    // what vkGetPhysicalDeviceSurfaceFormatsKHR returns without the layer
+    std::vector<VkSurfaceFormatKHR> formats = {
+        {VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_B8G8R8A8_SRGB, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_A2B10G10R10_UNORM_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_A2R10G10B10_UNORM_PACK32, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+        {VK_FORMAT_R16G16B16A16_SFLOAT, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+    };
+    // whether the driver supports VK_EXT_swapchain_colorspace's pass-through
+    bool passthrough = false;
+};
+
+class LayerClient
+{
+public:
+    // fd is the client end of the compositor's connection.
+    LayerClient(int fd, DriverConfig driver = {});
+    ~LayerClient();
+
+    LayerClient(const LayerClient &) = delete;
+    LayerClient &operator=(const LayerClient &) = delete;
+
+    wl_display *Display() const { return m_display; }
+    void Roundtrip();
+
+    wl_surface *CreateWlSurface();
+    static uint32_t Id(wl_surface *surface);
+    void DestroyWlSurface(wl_surface *surface);
+
+    VkSurfaceKHR CreateSurface(wl_surface *surface);
+    void DestroySurface(VkSurfaceKHR surface);
+    std::vector<VkSurfaceFormatKHR> SurfaceFormats(VkSurfaceKHR surface);
+    std::vector<VkSurfaceFormatKHR> SurfaceFormats2(VkSurfaceKHR surface);
+    // Without allocating, for the benchmarks. Return how many were written.
+    uint32_t SurfaceFormats(VkSurfaceKHR surface, std::span<VkSurfaceFormatKHR> formats);
+    uint32_t SurfaceFormats2(VkSurfaceKHR surface, std::span<VkSurfaceFormat2KHR> formats);
+
+    VkResult CreateSwapchain(VkSurfaceKHR surface, VkFormat format, VkColorSpaceKHR colorSpace,
+                             VkSwapchainKHR *swapchain, VkSwapchainKHR oldSwapchain = VK_NULL_HANDLE);
+    void DestroySwapchain(VkSwapchainKHR swapchain);
+    // These don't allocate for a single swapchain, so that the benchmarks only
+    // count the layer's allocations.
+    void SetHdrMetadata(std::span<const VkSwapchainKHR> swapchains, const VkHdrMetadataEXT &metadata);
+    VkResult Present(std::span<const VkSwapchainKHR> swapchains);
+    VkResult Present(VkSwapchainKHR swapchain) { return Present({&swapchain, 1}); }
+
+    // The colorspace the layer created the swapchain with in the driver.
+    static VkColorSpaceKHR DriverColorSpace(VkSwapchainKHR swapchain);
+
+    // The layer's HDR_WSI_STATS segment, nullptr without HDR_WSI_STATS=1.
+    static const HdrWsiStats::Segment *Stats();
+
+private:
+    wl_display *m_display = nullptr;
+    wl_registry *m_registry = nullptr;
+    wl_compositor *m_compositor = nullptr;
+
+    VkInstance m_instance = VK_NULL_HANDLE;
+    VkPhysicalDevice m_physicalDevice = VK_NULL_HANDLE;
+    VkDevice m_device = VK_NULL_HANDLE;
+    VkQueue m_queue = VK_NULL_HANDLE;
+
+    PFN_vkDestroyInstance m_destroyInstance = nullptr;
+    PFN_vkCreateWaylandSurfaceKHR m_createWaylandSurface = nullptr;
+    PFN_vkDestroySurfaceKHR m_destroySurface = nullptr;
+    PFN_vkGetPhysicalDeviceSurfaceFormatsKHR m_getSurfaceFormats = nullptr;
+    PFN_vkGetPhysicalDeviceSurfaceFormats2KHR m_getSurfaceFormats2 = nullptr;
+    PFN_vkDestroyDevice m_destroyDevice = nullptr;
+    PFN_vkCreateSwapchainKHR m_createSwapchain = nullptr;
+    PFN_vkDestroySwapchainKHR m_destroySwapchain = nullptr;
+    PFN_vkSetHdrMetadataEXT m_setHdrMetadata = nullptr;
+    PFN_vkQueuePresentKHR m_queuePresent = nullptr;
+};
+
+// The application's event loop, roundtrips on its own thread while it exists:
+// the compositor's events for the layer are only read by roundtrips.
+class EventLoop
+{
+public:
+    explicit EventLoop(LayerClient &client);
+    ~EventLoop();
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+private:
+    std::atomic<bool> m_stop = false;
+    std::thread m_thread;
+};
+
+}
@@ -0,0 +1,1149 @@
+#include "mock_compositor.h"
+
+#include "frog-color-management-v1-protocol.h"
+#include "xx-color-management-v4-protocol.h"
+#include "color-management-v1-protocol.h"
+
+#include <wayland-server.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <utility>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace HdrWsiTest
+{
+
+using Output = MockCompositor::Output;
+using SurfaceData = MockCompositor::SurfaceData;
+using Description = MockCompositor::Description;
+
+// A color management object of a surface: the color surface or a feedback
+// surface. It outlives the wl_surface if the client destroys that first.
+struct SurfaceObject {
+    MockCompositor *compositor;
+    // nullptr once the wl_surface is gone
+    SurfaceData *surface;
+    Protocol protocol;
+    wl_resource *resource;
+};
+
+struct MockCompositor::SurfaceData {
+    MockCompositor *compositor;
+    wl_resource *resource;
+    SurfaceState state;
+    SurfaceObject *colorSurface = nullptr;
+    std::vector<SurfaceObject *> feedbacks;
+    // a description change, applied on commit, nullopt inside unsets it
+    std::optional<std::optional<DescriptionParams>> pending;
+    // what frog-color-management-v1 has set so far
+    DescriptionParams frog;
+};
+
+struct MockCompositor::Output {
+    MockCompositor *compositor;
+    size_t index;
+    wl_global *global = nullptr;
+    DisplayInfo info;
+    uint32_t identity = 0;
+    bool removed = false;
+    std::vector<wl_resource *> resources;
+    std::vector<std::pair<wl_resource *, Protocol>> colorOutputs;
+};
+
+struct MockCompositor::Description {
+    MockCompositor *compositor;
+    wl_resource *resource;
+    DescriptionParams params;
+    // of preferred and output descriptions, the only ones get_information
+    // works on
+    std::optional<DisplayInfo> info;
+    uint32_t identity = 0;
+    bool ready = false;
+    wl_event_source *readyTimer = nullptr;
+};
+
+struct ParamsCreator {
+    MockCompositor *compositor;
+    DescriptionParams params;
+};
+
+struct ClientListener {
+    wl_listener listener;
+    MockCompositor *compositor;
+};
+
+namespace
+{
+
+static constexpr std::array<float, 8> s_bt2020Primaries = {0.708f, 0.292f, 0.170f, 0.797f, 0.131f, 0.046f, 0.3127f, 0.3290f};
+
+static bool Contains(const std::vector<uint32_t> &values, uint32_t value)
+{
+    return std::ranges::find(values, value) != values.end();
+}
+
+static void DestroyResource(wl_client *client, wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+// The parts of xx-color-management-v4 and color-management-v1 that differ
+// only in their names. The request handlers of both share the rest.
+struct XxTraits {
+    static constexpr Protocol protocol = Protocol::Xx;
+    static constexpr double primaryUnit = 10'000.0;
+    static constexpr uint32_t primariesBt2020 = XX_COLOR_MANAGER_V4_PRIMARIES_BT2020;
+    static constexpr uint32_t tfPq = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_ST2084_PQ;
+    static constexpr uint32_t featureIcc = XX_COLOR_MANAGER_V4_FEATURE_ICC_V2_V4;
+    static constexpr uint32_t featureParametric = XX_COLOR_MANAGER_V4_FEATURE_PARAMETRIC;
+    static constexpr uint32_t featureSetPrimaries = XX_COLOR_MANAGER_V4_FEATURE_SET_PRIMARIES;
+    static constexpr uint32_t featureSetTfPower = XX_COLOR_MANAGER_V4_FEATURE_SET_TF_POWER;
+    static constexpr uint32_t featureLuminances = XX_COLOR_MANAGER_V4_FEATURE_SET_LUMINANCES;
+    static constexpr uint32_t featureMasteringPrimaries = XX_COLOR_MANAGER_V4_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES;
+    static constexpr auto features = &CompositorConfig::xxFeatures;
+    static constexpr auto primaries = &CompositorConfig::xxPrimaries;
+    static constexpr auto transferFunctions = &CompositorConfig::xxTransferFunctions;
+
+    static constexpr uint32_t errorUnsupportedFeature = XX_COLOR_MANAGER_V4_ERROR_UNSUPPORTED_FEATURE;
+    static constexpr uint32_t errorSurfaceExists = XX_COLOR_MANAGER_V4_ERROR_SURFACE_EXISTS;
+    static constexpr uint32_t errorImageDescription = XX_COLOR_MANAGEMENT_SURFACE_V4_ERROR_IMAGE_DESCRIPTION;
+    static constexpr uint32_t errorInert = XX_COLOR_MANAGEMENT_FEEDBACK_SURFACE_V4_ERROR_INERT;
+    static constexpr uint32_t errorNotReady = XX_IMAGE_DESCRIPTION_V4_ERROR_NOT_READY;
+    static constexpr uint32_t errorNoInformation = XX_IMAGE_DESCRIPTION_V4_ERROR_NO_INFORMATION;
+    static constexpr uint32_t errorIncompleteSet = XX_IMAGE_DESCRIPTION_CREATOR_PARAMS_V4_ERROR_INCOMPLETE_SET;
+    static constexpr uint32_t errorParamsUnsupportedFeature = XX_IMAGE_DESCRIPTION_CREATOR_PARAMS_V4_ERROR_UNSUPPORTED_FEATURE;
+    static constexpr uint32_t errorInvalidTf = XX_IMAGE_DESCRIPTION_CREATOR_PARAMS_V4_ERROR_INVALID_TF;
+    static constexpr uint32_t errorInvalidPrimaries = XX_IMAGE_DESCRIPTION_CREATOR_PARAMS_V4_ERROR_INVALID_PRIMARIES;
+    static constexpr uint32_t errorIccIncompleteSet = XX_IMAGE_DESCRIPTION_CREATOR_ICC_V4_ERROR_INCOMPLETE_SET;
+    static constexpr uint32_t causeUnsupported = XX_IMAGE_DESCRIPTION_V4_CAUSE_UNSUPPORTED;
+
+    static constexpr const wl_interface *managerInterface = &xx_color_manager_v4_interface;
+    static constexpr const wl_interface *outputInterface = &xx_color_management_output_v4_interface;
+    static constexpr const wl_interface *surfaceInterface = &xx_color_management_surface_v4_interface;
+    static constexpr const wl_interface *feedbackInterface = &xx_color_management_feedback_surface_v4_interface;
+    static constexpr const wl_interface *paramsInterface = &xx_image_description_creator_params_v4_interface;
+    static constexpr const wl_interface *iccInterface = &xx_image_description_creator_icc_v4_interface;
+    static constexpr const wl_interface *descriptionInterface = &xx_image_description_v4_interface;
+    static constexpr const wl_interface *infoInterface = &xx_image_description_info_v4_interface;
+
+    using OutputImpl = struct xx_color_management_output_v4_interface;
+    using SurfaceImpl = struct xx_color_management_surface_v4_interface;
+    using FeedbackImpl = struct xx_color_management_feedback_surface_v4_interface;
+    using ParamsImpl = struct xx_image_description_creator_params_v4_interface;
+    using IccImpl = struct xx_image_description_creator_icc_v4_interface;
+    using DescriptionImpl = struct xx_image_description_v4_interface;
+    static const struct xx_color_manager_v4_interface managerImpl;
+
+    static constexpr auto sendSupportedIntent = xx_color_manager_v4_send_supported_intent;
+    static constexpr auto sendSupportedFeature = xx_color_manager_v4_send_supported_feature;
+    static constexpr auto sendSupportedTf = xx_color_manager_v4_send_supported_tf_named;
+    static constexpr auto sendSupportedPrimaries = xx_color_manager_v4_send_supported_primaries_named;
+    static constexpr auto sendImageDescriptionChanged = xx_color_management_output_v4_send_image_description_changed;
+    static constexpr auto sendReady = xx_image_description_v4_send_ready;
+    static constexpr auto sendFailed = xx_image_description_v4_send_failed;
+    static constexpr auto sendPrimaries = xx_image_description_info_v4_send_primaries;
+    static constexpr auto sendPrimariesNamed = xx_image_description_info_v4_send_primaries_named;
+    static constexpr auto sendTfNamed = xx_image_description_info_v4_send_tf_named;
+    static constexpr auto sendLuminances = xx_image_description_info_v4_send_luminances;
+    static constexpr auto sendTargetPrimaries = xx_image_description_info_v4_send_target_primaries;
+    static constexpr auto sendTargetLuminance = xx_image_description_info_v4_send_target_luminance;
+    static constexpr auto sendTargetMaxCll = xx_image_description_info_v4_send_target_max_cll;
+    static constexpr auto sendTargetMaxFall = xx_image_description_info_v4_send_target_max_fall;
+    static constexpr auto sendInfoDone = xx_image_description_info_v4_send_done;
+};
+
+struct WpTraits {
+    static constexpr Protocol protocol = Protocol::Wp;
+    static constexpr double primaryUnit = 1'000'000.0;
+    static constexpr uint32_t primariesBt2020 = WP_COLOR_MANAGER_V1_PRIMARIES_BT2020;
+    static constexpr uint32_t tfPq = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_ST2084_PQ;
+    static constexpr uint32_t featureIcc = WP_COLOR_MANAGER_V1_FEATURE_ICC_V2_V4;
+    static constexpr uint32_t featureParametric = WP_COLOR_MANAGER_V1_FEATURE_PARAMETRIC;
+    static constexpr uint32_t featureSetPrimaries = WP_COLOR_MANAGER_V1_FEATURE_SET_PRIMARIES;
+    static constexpr uint32_t featureSetTfPower = WP_COLOR_MANAGER_V1_FEATURE_SET_TF_POWER;
+    static constexpr uint32_t featureLuminances = WP_COLOR_MANAGER_V1_FEATURE_SET_LUMINANCES;
+    static constexpr uint32_t featureMasteringPrimaries = WP_COLOR_MANAGER_V1_FEATURE_SET_MASTERING_DISPLAY_PRIMARIES;
+    static constexpr auto features = &CompositorConfig::wpFeatures;
+    static constexpr auto primaries = &CompositorConfig::wpPrimaries;
+    static constexpr auto transferFunctions = &CompositorConfig::wpTransferFunctions;
+
+    static constexpr uint32_t errorUnsupportedFeature = WP_COLOR_MANAGER_V1_ERROR_UNSUPPORTED_FEATURE;
+    static constexpr uint32_t errorSurfaceExists = WP_COLOR_MANAGER_V1_ERROR_SURFACE_EXISTS;
+    static constexpr uint32_t errorImageDescription = WP_COLOR_MANAGEMENT_SURFACE_V1_ERROR_IMAGE_DESCRIPTION;
+    static constexpr uint32_t errorInert = WP_COLOR_MANAGEMENT_SURFACE_FEEDBACK_V1_ERROR_INERT;
+    static constexpr uint32_t errorNotReady = WP_IMAGE_DESCRIPTION_V1_ERROR_NOT_READY;
+    static constexpr uint32_t errorNoInformation = WP_IMAGE_DESCRIPTION_V1_ERROR_NO_INFORMATION;
+    static constexpr uint32_t errorIncompleteSet = WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_INCOMPLETE_SET;
+    static constexpr uint32_t errorParamsUnsupportedFeature = WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_UNSUPPORTED_FEATURE;
+    static constexpr uint32_t errorInvalidTf = WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_INVALID_TF;
+    static constexpr uint32_t errorInvalidPrimaries = WP_IMAGE_DESCRIPTION_CREATOR_PARAMS_V1_ERROR_INVALID_PRIMARIES_NAMED;
+    static constexpr uint32_t errorIccIncompleteSet = WP_IMAGE_DESCRIPTION_CREATOR_ICC_V1_ERROR_INCOMPLETE_SET;
+    static constexpr uint32_t causeUnsupported = WP_IMAGE_DESCRIPTION_V1_CAUSE_UNSUPPORTED;
+
+    static constexpr const wl_interface *managerInterface = &wp_color_manager_v1_interface;
+    static constexpr const wl_interface *outputInterface = &wp_color_management_output_v1_interface;
+    static constexpr const wl_interface *surfaceInterface = &wp_color_management_surface_v1_interface;
+    static constexpr const wl_interface *feedbackInterface = &wp_color_management_surface_feedback_v1_interface;
+    static constexpr const wl_interface *paramsInterface = &wp_image_description_creator_params_v1_interface;
+    static constexpr const wl_interface *iccInterface = &wp_image_description_creator_icc_v1_interface;
+    static constexpr const wl_interface *descriptionInterface = &wp_image_description_v1_interface;
+    static constexpr const wl_interface *infoInterface = &wp_image_description_info_v1_interface;
+
+    using OutputImpl = struct wp_color_management_output_v1_interface;
+    using SurfaceImpl = struct wp_color_management_surface_v1_interface;
+    using FeedbackImpl = struct wp_color_management_surface_feedback_v1_interface;
+    using ParamsImpl = struct wp_image_description_creator_params_v1_interface;
+    using IccImpl = struct wp_image_description_creator_icc_v1_interface;
+    using DescriptionImpl = struct wp_image_description_v1_interface;
+    static const struct wp_color_manager_v1_interface managerImpl;
+
+    static constexpr auto sendSupportedIntent = wp_color_manager_v1_send_supported_intent;
+    static constexpr auto sendSupportedFeature = wp_color_manager_v1_send_supported_feature;
+    static constexpr auto sendSupportedTf = wp_color_manager_v1_send_supported_tf_named;
+    static constexpr auto sendSupportedPrimaries = wp_color_manager_v1_send_supported_primaries_named;
+    static constexpr auto sendImageDescriptionChanged = wp_color_management_output_v1_send_image_description_changed;
+    static constexpr auto sendReady = wp_image_description_v1_send_ready;
+    static constexpr auto sendFailed = wp_image_description_v1_send_failed;
+    static constexpr auto sendPrimaries = wp_image_description_info_v1_send_primaries;
+    static constexpr auto sendPrimariesNamed = wp_image_description_info_v1_send_primaries_named;
+    static constexpr auto sendTfNamed = wp_image_description_info_v1_send_tf_named;
+    static constexpr auto sendLuminances = wp_image_description_info_v1_send_luminances;
+    static constexpr auto sendTargetPrimaries = wp_image_description_info_v1_send_target_primaries;
+    static constexpr auto sendTargetLuminance = wp_image_description_info_v1_send_target_luminance;
+    static constexpr auto sendTargetMaxCll = wp_image_description_info_v1_send_target_max_cll;
+    static constexpr auto sendTargetMaxFall = wp_image_description_info_v1_send_target_max_fall;
+    static constexpr auto sendInfoDone = wp_image_description_info_v1_send_done;
+};
+
+template <typename P>
+static bool HasFeature(MockCompositor *compositor, uint32_t feature)
+{
+    return Contains(compositor->Config().*P::features, feature);
+}
+
+// Sends a preferred or output description, as a compositor driving a PQ
+// output would: a BT.2020 container with the display's own volume as target.
+template <typename P>
+static void SendInfo(wl_resource *info, const DisplayInfo &display)
+{
+    const auto primary = [](float value) {
+        return int32_t(std::lround(value * P::primaryUnit));
+    };
+    const auto &container = s_bt2020Primaries;
+    const auto &target = display.primaries;
+    P::sendPrimaries(info,
+                     primary(container[0]), primary(container[1]),
+                     primary(container[2]), primary(container[3]),
+                     primary(container[4]), primary(container[5]),
+                     primary(container[6]), primary(container[7]));
+    P::sendPrimariesNamed(info, P::primariesBt2020);
+    P::sendTfNamed(info, P::tfPq);
+    P::sendLuminances(info, uint32_t(std::lround(display.minLuminance * 10'000.0)), 10'000, 203);
+    P::sendTargetPrimaries(info,
+                           primary(target[0]), primary(target[1]),
+                           primary(target[2]), primary(target[3]),
+                           primary(target[4]), primary(target[5]),
+                           primary(target[6]), primary(target[7]));
+    P::sendTargetLuminance(info, uint32_t(std::lround(display.minLuminance * 10'000.0)), uint32_t(std::lround(display.maxLuminance)));
+    P::sendTargetMaxCll(info, uint32_t(std::lround(display.maxCll)));
+    P::sendTargetMaxFall(info, uint32_t(std::lround(display.maxFall)));
+    // done is a destructor event
+    P::sendInfoDone(info);
+    wl_resource_destroy(info);
+}
+
+template <typename P>
+static const typename P::DescriptionImpl s_descriptionImpl = {
+    .destroy = DestroyResource,
+    .get_information = [](wl_client *client, wl_resource *resource, uint32_t id) {
+        auto description = static_cast<Description *>(wl_resource_get_user_data(resource));
+        wl_resource *info = wl_resource_create(client, P::infoInterface, wl_resource_get_version(resource), id);
+        wl_resource_set_implementation(info, nullptr, nullptr, nullptr);
+        if (!description->ready) {
+            description->compositor->PostError(resource, P::errorNotReady, "image description isn't ready");
+        } else if (!description->info) {
+            description->compositor->PostError(resource, P::errorNoInformation, "image description was created by the client");
+        } else {
+            SendInfo<P>(info, *description->info);
+        }
+    },
+};
+
+template <typename P>
+static Description *CreateDescription(MockCompositor *compositor, wl_client *client, int version, uint32_t id)
+{
+    wl_resource *resource = wl_resource_create(client, P::descriptionInterface, version, id);
+    auto description = new Description{
+        .compositor = compositor,
+        .resource = resource,
+    };
+    wl_resource_set_implementation(resource, &s_descriptionImpl<P>, description, [](wl_resource *resource) {
+        auto description = static_cast<Description *>(wl_resource_get_user_data(resource));
+        if (description->readyTimer) {
+            wl_event_source_remove(description->readyTimer);
+        }
+        delete description;
+    });
+    return description;
+}
+
+// A preferred or output description, which is ready right away.
+template <typename P>
+static void SendKnownDescription(Description *description, const DisplayInfo &info, uint32_t identity)
+{
+    description->info = info;
+    description->identity = identity;
+    description->ready = true;
+    P::sendReady(description->resource, identity);
+}
+
+template <typename P>
+static void SendReady(Description *description)
+{
+    if (auto timer = std::exchange(description->readyTimer, nullptr)) {
+        wl_event_source_remove(timer);
+    }
+    MockCompositor *compositor = description->compositor;
+    if (compositor->Config().failDescriptions) {
+        P::sendFailed(description->resource, P::causeUnsupported, "failing as configured");
+        return;
+    }
+    description->ready = true;
+    description->identity = compositor->NextIdentity();
+    P::sendReady(description->resource, description->identity);
+}
+
+// Sends ready for a created description, after the configured delay.
+template <typename P>
+static void ScheduleReady(Description *description)
+{
+    const auto delay = description->compositor->Config().readyDelay;
+    if (delay.count() == 0) {
+        SendReady<P>(description);
+        return;
+    }
+    description->readyTimer = wl_event_loop_add_timer(description->compositor->Loop(), [](void *data) -> int {
+        SendReady<P>(static_cast<Description *>(data));
+        return 0;
+    }, description);
+    wl_event_source_timer_update(description->readyTimer, int(delay.count()));
+}
+
+template <typename P>
+static const typename P::OutputImpl s_outputImpl = {
+    .destroy = DestroyResource,
+    .get_image_description = [](wl_client *client, wl_resource *resource, uint32_t id) {
+        auto output = static_cast<Output *>(wl_resource_get_user_data(resource));
+        auto description = CreateDescription<P>(output->compositor, client, wl_resource_get_version(resource), id);
+        SendKnownDescription<P>(description, output->info, output->identity);
+    },
+};
+
+static SurfaceObject *CreateSurfaceObject(MockCompositor *compositor, SurfaceData *surface, Protocol protocol, wl_resource *resource, const void *implementation)
+{
+    auto object = new SurfaceObject{
+        .compositor = compositor,
+        .surface = surface,
+        .protocol = protocol,
+        .resource = resource,
+    };
+    wl_resource_set_implementation(resource, implementation, object, [](wl_resource *resource) {
+        auto object = static_cast<SurfaceObject *>(wl_resource_get_user_data(resource));
+        if (SurfaceData *surface = object->surface) {
+            if (surface->colorSurface == object) {
+                // the description goes away with the next commit
+                surface->colorSurface = nullptr;
+                surface->pending.emplace(std::nullopt);
+            }
+            std::erase(surface->feedbacks, object);
+        }
+        delete object;
+    });
+    return object;
+}
+
+template <typename P>
+static const typename P::SurfaceImpl s_surfaceImpl = {
+    .destroy = DestroyResource,
+    .set_image_description = [](wl_client *, wl_resource *resource, wl_resource *imageDescription, uint32_t renderIntent) {
+        auto object = static_cast<SurfaceObject *>(wl_resource_get_user_data(resource));
+        auto description = static_cast<Description *>(wl_resource_get_user_data(imageDescription));
+        if (!description->ready) {
+            object->compositor->PostError(resource, P::errorImageDescription, "image description isn't ready");
+            return;
+        }
+        if (object->surface) {
+            object->surface->pending.emplace(description->params);
+        }
+    },
+    .unset_image_description = [](wl_client *, wl_resource *resource) {
+        auto object = static_cast<SurfaceObject *>(wl_resource_get_user_data(resource));
+        if (object->surface) {
+            object->surface->pending.emplace(std::nullopt);
+        }
+    },
+};
+
+template <typename P>
+static void GetPreferred(wl_client *client, wl_resource *resource, uint32_t id)
+{
+    auto object = static_cast<SurfaceObject *>(wl_resource_get_user_data(resource));
+    auto description = CreateDescription<P>(object->compositor, client, wl_resource_get_version(resource), id);
+    if (!object->surface) {
+        object->compositor->PostError(resource, P::errorInert, "the surface is gone");
+        return;
+    }
+    SendKnownDescription<P>(description, object->compositor->Preferred(*object->surface), object->compositor->PreferredIdentity(*object->surface));
+}
+
+template <typename P>
+static const typename P::FeedbackImpl s_feedbackImpl = [] {
+    if constexpr (P::protocol == Protocol::Wp) {
+        return typename P::FeedbackImpl{
+            .destroy = DestroyResource,
+            .get_preferred = GetPreferred<P>,
+            .get_preferred_parametric = GetPreferred<P>,
+        };
+    } else {
+        return typename P::FeedbackImpl{
+            .destroy = DestroyResource,
+            .get_preferred = GetPreferred<P>,
+        };
+    }
+}();
+
+template <typename P>
+static ParamsCreator *GetCreator(wl_resource *resource)
+{
+    return static_cast<ParamsCreator *>(wl_resource_get_user_data(resource));
+}
+
+template <typename P>
+static const typename P::ParamsImpl s_paramsImpl = {
+    .create = [](wl_client *client, wl_resource *resource, uint32_t id) {
+        auto creator = GetCreator<P>(resource);
+        auto description = CreateDescription<P>(creator->compositor, client, wl_resource_get_version(resource), id);
+        description->params = creator->params;
+        const DescriptionParams &params = creator->params;
+        if ((!params.primariesNamed && !params.primaries) || (!params.transferFunctionNamed && !params.tfPower)) {
+            creator->compositor->PostError(resource, P::errorIncompleteSet, "primaries or transfer function missing");
+        } else {
+            ScheduleReady<P>(description);
+        }
+        // create is a destructor
+        wl_resource_destroy(resource);
+    },
+    .set_tf_named = [](wl_client *, wl_resource *resource, uint32_t tf) {
+        auto creator = GetCreator<P>(resource);
+        if (!Contains(creator->compositor->Config().*P::transferFunctions, tf)) {
+            creator->compositor->PostError(resource, P::errorInvalidTf, "unsupported transfer function");
+            return;
+        }
+        creator->params.transferFunctionNamed = tf;
+    },
+    .set_tf_power = [](wl_client *, wl_resource *resource, uint32_t eexp) {
+        auto creator = GetCreator<P>(resource);
+        if (!HasFeature<P>(creator->compositor, P::featureSetTfPower)) {
+            creator->compositor->PostError(resource, P::errorParamsUnsupportedFeature, "set_tf_power isn't supported");
+            return;
+        }
+        creator->params.tfPower = eexp;
+    },
+    .set_primaries_named = [](wl_client *, wl_resource *resource, uint32_t primaries) {
+        auto creator = GetCreator<P>(resource);
+        if (!Contains(creator->compositor->Config().*P::primaries, primaries)) {
+            creator->compositor->PostError(resource, P::errorInvalidPrimaries, "unsupported primaries");
+            return;
+        }
+        creator->params.primariesNamed = primaries;
+    },
+    .set_primaries = [](wl_client *, wl_resource *resource, int32_t r_x, int32_t r_y, int32_t g_x, int32_t g_y, int32_t b_x, int32_t b_y, int32_t w_x, int32_t w_y) {
+        auto creator = GetCreator<P>(resource);
+        if (!HasFeature<P>(creator->compositor, P::featureSetPrimaries)) {
+            creator->compositor->PostError(resource, P::errorParamsUnsupportedFeature, "set_primaries isn't supported");
+            return;
+        }
+        creator->params.primaries = std::array{r_x, r_y, g_x, g_y, b_x, b_y, w_x, w_y};
+    },
+    .set_luminances = [](wl_client *, wl_resource *resource, uint32_t min_lum, uint32_t max_lum, uint32_t reference_lum) {
+        auto creator = GetCreator<P>(resource);
+        if (!HasFeature<P>(creator->compositor, P::featureLuminances)) {
+            creator->compositor->PostError(resource, P::errorParamsUnsupportedFeature, "set_luminances isn't supported");
+            return;
+        }
+        creator->params.luminances = std::array{min_lum, max_lum, reference_lum};
+    },
+    .set_mastering_display_primaries = [](wl_client *, wl_resource *resource, int32_t r_x, int32_t r_y, int32_t g_x, int32_t g_y, int32_t b_x, int32_t b_y, int32_t w_x, int32_t w_y) {
+        auto creator = GetCreator<P>(resource);
+        if (!HasFeature<P>(creator->compositor, P::featureMasteringPrimaries)) {
+            creator->compositor->PostError(resource, P::errorParamsUnsupportedFeature, "set_mastering_display_primaries isn't supported");
+            return;
+        }
+        creator->params.masteringPrimaries = std::array{r_x, r_y, g_x, g_y, b_x, b_y, w_x, w_y};
+    },
+    .set_mastering_luminance = [](wl_client *, wl_resource *resource, uint32_t min_lum, uint32_t max_lum) {
+        GetCreator<P>(resource)->params.masteringLuminance = std::array{min_lum, max_lum};
+    },
+    .set_max_cll = [](wl_client *, wl_resource *resource, uint32_t max_cll) {
+        GetCreator<P>(resource)->params.maxCll = max_cll;
+    },
+    .set_max_fall = [](wl_client *, wl_resource *resource, uint32_t max_fall) {
+        GetCreator<P>(resource)->params.maxFall = max_fall;
+    },
+};
+
+template <typename P>
+static const typename P::IccImpl s_iccImpl = {
+    .create = [](wl_client *client, wl_resource *resource, uint32_t id) {
+        auto creator = GetCreator<P>(resource);
+        auto description = CreateDescription<P>(creator->compositor, client, wl_resource_get_version(resource), id);
+        description->params = creator->params;
+        if (!creator->params.icc) {
+            creator->compositor->PostError(resource, P::errorIccIncompleteSet, "ICC file missing");
+        } else {
+            ScheduleReady<P>(description);
+        }
+        wl_resource_destroy(resource);
+    },
+    .set_icc_file = [](wl_client *, wl_resource *resource, int32_t icc_profile, uint32_t offset, uint32_t length) {
+        close(icc_profile);
+        GetCreator<P>(resource)->params.icc = true;
+    },
+};
+
+template <typename P>
+static void CreateCreator(wl_client *client, wl_resource *manager, uint32_t id, const wl_interface *interface, const void *implementation, uint32_t feature)
+{
+    auto compositor = static_cast<MockCompositor *>(wl_resource_get_user_data(manager));
+    wl_resource *resource = wl_resource_create(client, interface, wl_resource_get_version(manager), id);
+    auto creator = new ParamsCreator{.compositor = compositor};
+    wl_resource_set_implementation(resource, implementation, creator, [](wl_resource *resource) {
+        delete static_cast<ParamsCreator *>(wl_resource_get_user_data(resource));
+    });
+    if (!HasFeature<P>(compositor, feature)) {
+        compositor->PostError(manager, P::errorUnsupportedFeature, "creator isn't supported");
+    }
+}
+
+template <typename P>
+static void CreateParametricCreator(wl_client *client, wl_resource *manager, uint32_t id)
+{
+    CreateCreator<P>(client, manager, id, P::paramsInterface, &s_paramsImpl<P>, P::featureParametric);
+}
+
+template <typename P>
+static void CreateIccCreator(wl_client *client, wl_resource *manager, uint32_t id)
+{
+    CreateCreator<P>(client, manager, id, P::iccInterface, &s_iccImpl<P>, P::featureIcc);
+}
+
+template <typename P>
+static void GetOutput(wl_client *client, wl_resource *manager, uint32_t id, wl_resource *outputResource)
+{
+    auto output = static_cast<Output *>(wl_resource_get_user_data(outputResource));
+    wl_resource *resource = wl_resource_create(client, P::outputInterface, wl_resource_get_version(manager), id);
+    wl_resource_set_implementation(resource, &s_outputImpl<P>, output, [](wl_resource *resource) {
+        auto output = static_cast<Output *>(wl_resource_get_user_data(resource));
+        std::erase_if(output->colorOutputs, [resource](const auto &colorOutput) {
+            return colorOutput.first == resource;
+        });
+    });
+    output->colorOutputs.emplace_back(resource, P::protocol);
+}
+
+template <typename P>
+static void GetSurface(wl_client *client, wl_resource *manager, uint32_t id, wl_resource *surfaceResource)
+{
+    auto compositor = static_cast<MockCompositor *>(wl_resource_get_user_data(manager));
+    auto surface = static_cast<SurfaceData *>(wl_resource_get_user_data(surfaceResource));
+    wl_resource *resource = wl_resource_create(client, P::surfaceInterface, wl_resource_get_version(manager), id);
+    auto object = CreateSurfaceObject(compositor, surface, P::protocol, resource, &s_surfaceImpl<P>);
+    if (surface->colorSurface) {
+        object->surface = nullptr;
+        compositor->PostError(manager, P::errorSurfaceExists, "the surface already has a color management surface");
+        return;
+    }
+    surface->colorSurface = object;
+    surface->state.protocol = P::protocol;
+}
+
+template <typename P>
+static void GetFeedback(wl_client *client, wl_resource *manager, uint32_t id, wl_resource *surfaceResource)
+{
+    auto compositor = static_cast<MockCompositor *>(wl_resource_get_user_data(manager));
+    auto surface = static_cast<SurfaceData *>(wl_resource_get_user_data(surfaceResource));
+    wl_resource *resource = wl_resource_create(client, P::feedbackInterface, wl_resource_get_version(manager), id);
+    surface->feedbacks.push_back(CreateSurfaceObject(compositor, surface, P::protocol, resource, &s_feedbackImpl<P>));
+}
+
+template <typename P>
+static void BindManager(wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+    auto compositor = static_cast<MockCompositor *>(data);
+    wl_resource *resource = wl_resource_create(client, P::managerInterface, int(version), id);
+    wl_resource_set_implementation(resource, &P::managerImpl, compositor, nullptr);
+
+    const CompositorConfig &config = compositor->Config();
+    P::sendSupportedIntent(resource, 0);
+    for (uint32_t feature : config.*P::features) {
+        P::sendSupportedFeature(resource, feature);
+    }
+    for (uint32_t tf : config.*P::transferFunctions) {
+        P::sendSupportedTf(resource, tf);
+    }
+    for (uint32_t primaries : config.*P::primaries) {
+        P::sendSupportedPrimaries(resource, primaries);
+    }
+    if constexpr (P::protocol == Protocol::Wp) {
+        wp_color_manager_v1_send_done(resource);
+    }
+}
+
+const struct xx_color_manager_v4_interface XxTraits::managerImpl = {
+    .destroy = DestroyResource,
+    .get_output = GetOutput<XxTraits>,
+    .get_surface = GetSurface<XxTraits>,
+    .get_feedback_surface = GetFeedback<XxTraits>,
+    .new_icc_creator = CreateIccCreator<XxTraits>,
+    .new_parametric_creator = CreateParametricCreator<XxTraits>,
+};
+
+const struct wp_color_manager_v1_interface WpTraits::managerImpl = {
+    .destroy = DestroyResource,
+    .get_output = GetOutput<WpTraits>,
+    .get_surface = GetSurface<WpTraits>,
+    .get_surface_feedback = GetFeedback<WpTraits>,
+    .create_icc_creator = CreateIccCreator<WpTraits>,
+    .create_parametric_creator = CreateParametricCreator<WpTraits>,
+    .create_windows_scrgb = [](wl_client *client, wl_resource *manager, uint32_t id) {
+        auto compositor = static_cast<MockCompositor *>(wl_resource_get_user_data(manager));
+        auto description = CreateDescription<WpTraits>(compositor, client, wl_resource_get_version(manager), id);
+        description->params.windowsScrgb = true;
+        if (!HasFeature<WpTraits>(compositor, WP_COLOR_MANAGER_V1_FEATURE_WINDOWS_SCRGB)) {
+            compositor->PostError(manager, WP_COLOR_MANAGER_V1_ERROR_UNSUPPORTED_FEATURE, "windows_scrgb isn't supported");
+            return;
+        }
+        ScheduleReady<WpTraits>(description);
+    },
+};
+
+// frog-color-management-v1 has no description objects, the surface's state
+// is double-buffered like the parametric descriptions.
+static void SetFrogState(wl_resource *resource, void (*update)(DescriptionParams &params, const uint32_t *values), std::initializer_list<uint32_t> values)
+{
+    auto object = static_cast<SurfaceObject *>(wl_resource_get_user_data(resource));
+    SurfaceData *surface = object->surface;
+    if (!surface) {
+        return;
+    }
+    update(surface->frog, std::data(values));
+    const bool tagged = surface->frog.transferFunctionNamed.value_or(FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED)
+        != FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_UNDEFINED;
+    if (tagged) {
+        surface->pending.emplace(surface->frog);
+    } else {
+        surface->pending.emplace(std::nullopt);
+    }
+}
+
+static const struct frog_color_managed_surface_interface s_frogSurfaceImpl = {
+    .destroy = DestroyResource,
+    .set_known_transfer_function = [](wl_client *, wl_resource *resource, uint32_t transfer_function) {
+        SetFrogState(resource, [](DescriptionParams &params, const uint32_t *values) {
+            params.transferFunctionNamed = values[0];
+        }, {transfer_function});
+    },
+    .set_known_container_color_volume = [](wl_client *, wl_resource *resource, uint32_t primaries) {
+        SetFrogState(resource, [](DescriptionParams &params, const uint32_t *values) {
+            params.primariesNamed = values[0];
+        }, {primaries});
+    },
+    .set_render_intent = [](wl_client *, wl_resource *, uint32_t) {},
+    .set_hdr_metadata = [](wl_client *, wl_resource *resource,
+                           uint32_t red_x, uint32_t red_y, uint32_t green_x, uint32_t green_y,
+                           uint32_t blue_x, uint32_t blue_y, uint32_t white_x, uint32_t white_y,
+                           uint32_t max_luminance, uint32_t min_luminance, uint32_t max_cll, uint32_t max_fall) {
+        SetFrogState(resource, [](DescriptionParams &params, const uint32_t *values) {
+            params.masteringPrimaries = std::array<int32_t, 8>{};
+            std::copy_n(values, 8, params.masteringPrimaries->begin());
+            params.masteringLuminance = std::array{values[9], values[8]};
+            params.maxCll = values[10];
+            params.maxFall = values[11];
+        }, {red_x, red_y, green_x, green_y, blue_x, blue_y, white_x, white_y, max_luminance, min_luminance, max_cll, max_fall});
+    },
+};
+
+static void SendFrogPreferred(wl_resource *resource, const DisplayInfo &display)
+{
+    const auto primary = [&display](size_t i) {
+        return uint32_t(std::lround(display.primaries[i] * 10'000.0));
+    };
+    frog_color_managed_surface_send_preferred_metadata(resource,
+                                                       FROG_COLOR_MANAGED_SURFACE_TRANSFER_FUNCTION_ST2084_PQ,
+                                                       primary(0), primary(1), primary(2), primary(3),
+                                                       primary(4), primary(5), primary(6), primary(7),
+                                                       uint32_t(std::lround(display.maxLuminance)),
+                                                       uint32_t(std::lround(display.minLuminance * 10'000.0)),
+                                                       uint32_t(std::lround(display.maxFall)));
+}
+
+static const struct frog_color_management_factory_v1_interface s_frogFactoryImpl = {
+    .destroy = DestroyResource,
+    .get_color_managed_surface = [](wl_client *client, wl_resource *factory, wl_resource *surfaceResource, uint32_t id) {
+        auto compositor = static_cast<MockCompositor *>(wl_resource_get_user_data(factory));
+        auto surface = static_cast<SurfaceData *>(wl_resource_get_user_data(surfaceResource));
+        wl_resource *resource = wl_resource_create(client, &frog_color_managed_surface_interface, wl_resource_get_version(factory), id);
+        auto object = CreateSurfaceObject(compositor, surface, Protocol::Frog, resource, &s_frogSurfaceImpl);
+        if (surface->colorSurface) {
+            // frog has no error for this, the later surface stays inert
+            object->surface = nullptr;
+            return;
+        }
+        surface->colorSurface = object;
+        surface->state.protocol = Protocol::Frog;
+        SendFrogPreferred(resource, compositor->Preferred(*surface));
+    },
+};
+
+static void BindFrog(wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+    wl_resource *resource = wl_resource_create(client, &frog_color_management_factory_v1_interface, int(version), id);
+    wl_resource_set_implementation(resource, &s_frogFactoryImpl, data, nullptr);
+}
+
+static const struct wl_region_interface s_regionImpl = {
+    .destroy = DestroyResource,
+    .add = [](wl_client *, wl_resource *, int32_t, int32_t, int32_t, int32_t) {},
+    .subtract = [](wl_client *, wl_resource *, int32_t, int32_t, int32_t, int32_t) {},
+};
+
+static const struct wl_surface_interface s_surfaceCoreImpl = {
+    .destroy = DestroyResource,
+    .attach = [](wl_client *, wl_resource *, wl_resource *, int32_t, int32_t) {},
+    .damage = [](wl_client *, wl_resource *, int32_t, int32_t, int32_t, int32_t) {},
+    .frame = [](wl_client *client, wl_resource *resource, uint32_t id) {
+        wl_resource *callback = wl_resource_create(client, &wl_callback_interface, 1, id);
+        wl_resource_set_implementation(callback, nullptr, nullptr, nullptr);
+        wl_callback_send_done(callback, 0);
+        wl_resource_destroy(callback);
+    },
+    .set_opaque_region = [](wl_client *, wl_resource *, wl_resource *) {},
+    .set_input_region = [](wl_client *, wl_resource *, wl_resource *) {},
+    .commit = [](wl_client *, wl_resource *resource) {
+        auto surface = static_cast<SurfaceData *>(wl_resource_get_user_data(resource));
+        SurfaceState &state = surface->state;
+        if (surface->pending) {
+            if (state.description != *surface->pending) {
+                state.descriptionChanges++;
+            }
+            state.description = *std::exchange(surface->pending, std::nullopt);
+        }
+        state.commits++;
+        if (surface->colorSurface && !state.description) {
+            state.untaggedCommits++;
+        }
+    },
+    .set_buffer_transform = [](wl_client *, wl_resource *, int32_t) {},
+    .set_buffer_scale = [](wl_client *, wl_resource *, int32_t) {},
+    .damage_buffer = [](wl_client *, wl_resource *, int32_t, int32_t, int32_t, int32_t) {},
+};
+
+static const struct wl_compositor_interface s_compositorImpl = {
+    .create_surface = [](wl_client *client, wl_resource *compositorResource, uint32_t id) {
+        auto compositor = static_cast<MockCompositor *>(wl_resource_get_user_data(compositorResource));
+        wl_resource *resource = wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(compositorResource), id);
+        auto surface = new SurfaceData{
+            .compositor = compositor,
+            .resource = resource,
+            .state = {.id = id},
+        };
+        wl_resource_set_implementation(resource, &s_surfaceCoreImpl, surface, [](wl_resource *resource) {
+            auto surface = static_cast<SurfaceData *>(wl_resource_get_user_data(resource));
+            surface->compositor->Surfaces().erase(surface->state.id);
+            if (surface->colorSurface) {
+                surface->colorSurface->surface = nullptr;
+            }
+            for (SurfaceObject *feedback : surface->feedbacks) {
+                feedback->surface = nullptr;
+            }
+            delete surface;
+        });
+        compositor->Surfaces()[id] = surface;
+    },
+    .create_region = [](wl_client *client, wl_resource *compositorResource, uint32_t id) {
+        wl_resource *resource = wl_resource_create(client, &wl_region_interface, 1, id);
+        wl_resource_set_implementation(resource, &s_regionImpl, nullptr, nullptr);
+    },
+};
+
+static void BindCompositor(wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+    wl_resource *resource = wl_resource_create(client, &wl_compositor_interface, int(version), id);
+    wl_resource_set_implementation(resource, &s_compositorImpl, data, nullptr);
+}
+
+static const struct wl_output_interface s_outputCoreImpl = {
+    .release = DestroyResource,
+};
+
+static void BindOutput(wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+    auto output = static_cast<Output *>(data);
+    wl_resource *resource = wl_resource_create(client, &wl_output_interface, int(version), id);
+    wl_resource_set_implementation(resource, &s_outputCoreImpl, output, [](wl_resource *resource) {
+        auto output = static_cast<Output *>(wl_resource_get_user_data(resource));
+        std::erase(output->resources, resource);
+    });
+    output->resources.push_back(resource);
+
+    wl_output_send_geometry(resource, 0, 0, 600, 340, WL_OUTPUT_SUBPIXEL_UNKNOWN, "mock", "mock", WL_OUTPUT_TRANSFORM_NORMAL);
+    wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED, 3840, 2160, 60'000);
+    if (version >= 2) {
+        wl_output_send_scale(resource, 1);
+        wl_output_send_done(resource);
+    }
+}
+
+}
+
+CompositorConfig CompositorConfig::All()
+{
+    CompositorConfig config = {
+        .frog = true,
+        .xx = true,
+        .wp = true,
+    };
+    for (uint32_t feature = XX_COLOR_MANAGER_V4_FEATURE_ICC_V2_V4; feature <= XX_COLOR_MANAGER_V4_FEATURE_EXTENDED_TARGET_VOLUME; feature++) {
+        config.xxFeatures.push_back(feature);
+    }
+    for (uint32_t primaries = XX_COLOR_MANAGER_V4_PRIMARIES_SRGB; primaries <= XX_COLOR_MANAGER_V4_PRIMARIES_ADOBE_RGB; primaries++) {
+        config.xxPrimaries.push_back(primaries);
+    }
+    for (uint32_t tf = XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_BT709; tf <= XX_COLOR_MANAGER_V4_TRANSFER_FUNCTION_HLG; tf++) {
+        config.xxTransferFunctions.push_back(tf);
+    }
+    for (uint32_t feature = WP_COLOR_MANAGER_V1_FEATURE_ICC_V2_V4; feature <= WP_COLOR_MANAGER_V1_FEATURE_WINDOWS_SCRGB; feature++) {
+        config.wpFeatures.push_back(feature);
+    }
+    for (uint32_t primaries = WP_COLOR_MANAGER_V1_PRIMARIES_SRGB; primaries <= WP_COLOR_MANAGER_V1_PRIMARIES_ADOBE_RGB; primaries++) {
+        config.wpPrimaries.push_back(primaries);
+    }
+    for (uint32_t tf = WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_BT1886; tf <= WP_COLOR_MANAGER_V1_TRANSFER_FUNCTION_HLG; tf++) {
+        config.wpTransferFunctions.push_back(tf);
+    }
+    return config;
+}
+
+CompositorConfig CompositorConfig::Only(Protocol protocol)
+{
+    CompositorConfig config = All();
+    config.frog = protocol == Protocol::Frog;
+    config.xx = protocol == Protocol::Xx;
+    config.wp = protocol == Protocol::Wp;
+    return config;
+}
+
+uint64_t RequestCounts::operator[](const std::string &name) const
+{
+    const auto it = requests.find(name);
+    return it != requests.end() ? it->second : 0;
+}
+
+uint64_t RequestCounts::ColorManagement() const
+{
+    uint64_t count = 0;
+    for (const auto &[name, calls] : requests) {
+        if (name.starts_with("frog_") || name.starts_with("xx_") || name.starts_with("wp_color_") || name.starts_with("wp_image_")) {
+            count += calls;
+        }
+    }
+    return count;
+}
+
+RequestCounts RequestCounts::operator-(const RequestCounts &other) const
+{
+    RequestCounts difference = *this;
+    for (const auto &[name, calls] : other.requests) {
+        difference.requests[name] -= calls;
+    }
+    return difference;
+}
+
+MockCompositor::MockCompositor(CompositorConfig config)
+    : m_config{std::move(config)}
+    , m_clientListener{std::make_unique<ClientListener>()}
+{
+    m_display = wl_display_create();
+    m_loop = wl_display_get_event_loop(m_display);
+    m_logger = wl_display_add_protocol_logger(m_display, [](void *data, wl_protocol_logger_type type, const wl_protocol_logger_message *message) {
+        if (type != WL_PROTOCOL_LOGGER_REQUEST) {
+            return;
+        }
+        auto compositor = static_cast<MockCompositor *>(data);
+        compositor->m_requests.requests[std::string(wl_resource_get_class(message->resource)) + "." + message->message->name]++;
+    }, this);
+
+    m_globals.push_back(wl_global_create(m_display, &wl_compositor_interface, 4, this, BindCompositor));
+    if (m_config.frog) {
+        m_globals.push_back(wl_global_create(m_display, &frog_color_management_factory_v1_interface, 1, this, BindFrog));
+    }
+    if (m_config.xx) {
+        m_globals.push_back(wl_global_create(m_display, &xx_color_manager_v4_interface, 1, this, BindManager<XxTraits>));
+    }
+    if (m_config.wp) {
+        m_globals.push_back(wl_global_create(m_display, &wp_color_manager_v1_interface, 1, this, BindManager<WpTraits>));
+    }
+    m_preferredIdentity = NextIdentity();
+    for (const DisplayInfo &info : m_config.outputs) {
+        AddOutputLocked(info);
+    }
+
+    m_taskFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    m_taskSource = wl_event_loop_add_fd(m_loop, m_taskFd, WL_EVENT_READABLE, [](int fd, uint32_t mask, void *data) -> int {
+        auto compositor = static_cast<MockCompositor *>(data);
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) < 0) {
+            return 0;
+        }
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard lock{compositor->m_taskMutex};
+            tasks.swap(compositor->m_tasks);
+        }
+        for (const auto &task : tasks) {
+            task();
+        }
+        return 0;
+    }, this);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        perror("socketpair");
+        abort();
+    }
+    m_client = wl_client_create(m_display, fds[0]);
+    m_clientFd = fds[1];
+    m_clientListener->compositor = this;
+    m_clientListener->listener.notify = [](wl_listener *listener, void *data) {
+        ClientListener *clientListener = wl_container_of(listener, clientListener, listener);
+        clientListener->compositor->m_client = nullptr;
+    };
+    wl_client_add_destroy_listener(m_client, &m_clientListener->listener);
+
+    m_thread = std::thread([this] { Main(); });
+}
+
+MockCompositor::~MockCompositor()
+{
+    Run([this] { m_quit = true; });
+    m_thread.join();
+
+    if (m_clientFd >= 0) {
+        close(m_clientFd);
+    }
+    // the resources reference the outputs, which go away with the compositor
+    if (m_client) {
+        wl_client_destroy(m_client);
+    }
+    wl_event_source_remove(m_taskSource);
+    close(m_taskFd);
+    wl_protocol_logger_destroy(m_logger);
+    wl_display_destroy(m_display);
+}
+
+void MockCompositor::Main()
+{
+    pollfd pfd = {
+        .fd = wl_event_loop_get_fd(m_loop),
+        .events = POLLIN,
+    };
+    while (!m_quit) {
+        if (m_config.dispatchDelay.count() > 0) {
+            poll(&pfd, 1, -1);
+            std::this_thread::sleep_for(m_config.dispatchDelay);
+        }
+        wl_event_loop_dispatch(m_loop, -1);
+        wl_display_flush_clients(m_display);
+    }
+}
+
+int MockCompositor::TakeClientFd()
+{
+    return std::exchange(m_clientFd, -1);
+}
+
+void MockCompositor::Run(const std::function<void()> &task)
+{
+    std::promise<void> done;
+    {
+        std::lock_guard lock{m_taskMutex};
+        m_tasks.push_back([&task, &done] {
+            task();
+            done.set_value();
+        });
+    }
+    const uint64_t one = 1;
+    if (write(m_taskFd, &one, sizeof(one)) < 0) {
+        perror("eventfd write");
+        abort();
+    }
+    done.get_future().wait();
+}
+
+RequestCounts MockCompositor::Requests()
+{
+    RequestCounts requests;
+    Run([&] { requests = m_requests; });
+    return requests;
+}
+
+std::optional<SurfaceState> MockCompositor::Surface(uint32_t id)
+{
+    std::optional<SurfaceState> state;
+    Run([&] {
+        if (auto it = m_surfaces.find(id); it != m_surfaces.end()) {
+            state = it->second->state;
+        }
+    });
+    return state;
+}
+
+uint64_t MockCompositor::ProtocolErrors()
+{
+    uint64_t errors;
+    Run([&] { errors = m_protocolErrors; });
+    return errors;
+}
+
+size_t MockCompositor::ColorOutputs()
+{
+    size_t count = 0;
+    Run([&] {
+        for (const auto &output : m_outputs) {
+            count += output->colorOutputs.size();
+        }
+    });
+    return count;
+}
+
+void MockCompositor::MoveSurface(uint32_t id, size_t output)
+{
+    Run([&] {
+        auto it = m_surfaces.find(id);
+        if (it == m_surfaces.end()) {
+            return;
+        }
+        SurfaceData &surface = *it->second;
+        if (surface.state.output) {
+            for (wl_resource *resource : m_outputs[*surface.state.output]->resources) {
+                wl_surface_send_leave(surface.resource, resource);
+            }
+        }
+        surface.state.output = output;
+        for (wl_resource *resource : m_outputs[output]->resources) {
+            wl_surface_send_enter(surface.resource, resource);
+        }
+        SendPreferredChanged(surface);
+    });
+}
+
+void MockCompositor::SetOutputInfo(size_t index, const DisplayInfo &info)
+{
+    Run([&] {
+        Output &output = *m_outputs[index];
+        output.info = info;
+        output.identity = NextIdentity();
+        for (const auto &[resource, protocol] : output.colorOutputs) {
+            if (protocol == Protocol::Xx) {
+                XxTraits::sendImageDescriptionChanged(resource);
+            } else {
+                WpTraits::sendImageDescriptionChanged(resource);
+            }
+        }
+        for (const auto &[id, surface] : m_surfaces) {
+            if (surface->state.output == index) {
+                SendPreferredChanged(*surface);
+            }
+        }
+    });
+}
+
+size_t MockCompositor::AddOutput(const DisplayInfo &info)
+{
+    size_t index;
+    Run([&] { index = AddOutputLocked(info); });
+    return index;
+}
+
+size_t MockCompositor::AddOutputLocked(const DisplayInfo &info)
+{
+    auto &output = m_outputs.emplace_back(std::make_unique<Output>(Output{
+        .compositor = this,
+        .index = m_outputs.size(),
+        .info = info,
+        .identity = NextIdentity(),
+    }));
+    output->global = wl_global_create(m_display, &wl_output_interface, 3, output.get(), BindOutput);
+    return output->index;
+}
+
+void MockCompositor::RemoveOutput(size_t index)
+{
+    Run([&] {
+        Output &output = *m_outputs[index];
+        wl_global_remove(output.global);
+        output.removed = true;
+        // surfaces on it go back to the default preferred description
+        for (const auto &[id, surface] : m_surfaces) {
+            if (surface->state.output != index) {
+                continue;
+            }
+            for (wl_resource *resource : output.resources) {
+                wl_surface_send_leave(surface->resource, resource);
+            }
+            surface->state.output.reset();
+            SendPreferredChanged(*surface);
+        }
+    });
+}
+
+const DisplayInfo &MockCompositor::Preferred(const SurfaceData &surface) const
+{
+    return surface.state.output ? m_outputs[*surface.state.output]->info : m_config.preferred;
+}
+
+uint32_t MockCompositor::PreferredIdentity(const SurfaceData &surface) const
+{
+    return surface.state.output ? m_outputs[*surface.state.output]->identity : m_preferredIdentity;
+}
+
+void MockCompositor::PostError(wl_resource *resource, uint32_t code, const char *message)
+{
+    fprintf(stderr, "mock compositor: protocol error on %s: %s\n", wl_resource_get_class(resource), message);
+    m_protocolErrors++;
+    wl_resource_post_error(resource, code, "%s", message);
+}
+
+void MockCompositor::SendPreferredChanged(SurfaceData &surface)
+{
+    for (SurfaceObject *feedback : surface.feedbacks) {
+        if (feedback->protocol == Protocol::Xx) {
+            xx_color_management_feedback_surface_v4_send_preferred_changed(feedback->resource);
+        } else {
+            wp_color_management_surface_feedback_v1_send_preferred_changed(feedback->resource, PreferredIdentity(surface));
+        }
+    }
+    if (surface.colorSurface && surface.colorSurface->protocol == Protocol::Frog) {
+        SendFrogPreferred(surface.colorSurface->resource, Preferred(surface));
+    }
+}
+
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+// A Wayland compositor with just enough of the core protocol and the three
+// color management protocols to run the layer against, in the same process.
+// It runs on its own thread and talks to a single client over a socketpair.
+// Everything it records is read through Run, on its thread.
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct wl_client;
+struct wl_display;
+struct wl_event_loop;
+struct wl_event_source;
+struct wl_global;
+struct wl_protocol_logger;
+struct wl_resource;
+
+namespace HdrWsiTest
+{
+
+struct ClientListener;
+
+enum class Protocol {
+    Frog,
+    Xx,
+    Wp,
+};
+
+// A display the compositor describes to clients, as preferred description of
+// the surfaces on it and as output description. Chromaticities are CIE xy
+// (red, green, blue, white), luminances in cd/m².
+struct DisplayInfo {
+    std::array<float, 8> primaries = {0.680f, 0.320f, 0.265f, 0.690f, 0.150f, 0.060f, 0.3127f, 0.3290f};
+    float minLuminance = 0.005f;
+    float maxLuminance = 1000.0f;
+    float maxCll = 1000.0f;
+    float maxFall = 400.0f;
+};
+
+struct CompositorConfig {
+    // which color management globals are advertised
+    bool frog = false;
+    bool xx = false;
+    bool wp = false;
+    // supported_* events of xx_color_manager_v4 and wp_color_manager_v1, in
+    // the enum values of each protocol
+    std::vector<uint32_t> xxFeatures;
+    std::vector<uint32_t> xxPrimaries;
+    std::vector<uint32_t> xxTransferFunctions;
+    std::vector<uint32_t> wpFeatures;
+    std::vector<uint32_t> wpPrimaries;
+    std::vector<uint32_t> wpTransferFunctions;
+
+    // how long created image descriptions take to become ready
+    std::chrono::milliseconds readyDelay{0};
+    // send `failed` for created image descriptions instead
+    bool failDescriptions = false;
+    // slept before handling each batch of requests, like a busy compositor
+    std::chrono::microseconds dispatchDelay{0};
+
+    // the preferred description of surfaces that aren't on any output
+    DisplayInfo preferred;
+    // one wl_output global each
+    std::vector<DisplayInfo> outputs;
+
+    // Every protocol with all of its features, primaries and transfer functions.
+    static CompositorConfig All();
+    // Only one of them, with everything it supports.
+    static CompositorConfig Only(Protocol protocol);
+};
+
+// What a surface's image description was made of, in the units of the
+// protocol it was created with.
+struct DescriptionParams {
+    std::optional<uint32_t> primariesNamed;
+    std::optional<uint32_t> transferFunctionNamed;
+    std::optional<std::array<int32_t, 8>> primaries;
+    std::optional<uint32_t> tfPower;
+    std::optional<std::array<uint32_t, 3>> luminances;
+    std::optional<std::array<int32_t, 8>> masteringPrimaries;
+    std::optional<std::array<uint32_t, 2>> masteringLuminance;
+    std::optional<uint32_t> maxCll;
+    std::optional<uint32_t> maxFall;
+    bool icc = false;
+    bool windowsScrgb = false;
+
+    bool operator==(const DescriptionParams &other) const = default;
+};
+
+struct SurfaceState {
+    // of the client's wl_surface
+    uint32_t id = 0;
+    std::optional<Protocol> protocol;
+    uint64_t commits = 0;
+    // commits of a color managed surface without an image description
+    uint64_t untaggedCommits = 0;
+    // the description as of the last commit
+    std::optional<DescriptionParams> description;
+    uint64_t descriptionChanges = 0;
+    // the output the surface is on
+    std::optional<size_t> output;
+};
+
+// Requests the compositor received, by "interface.request".
+struct RequestCounts {
+    std::map<std::string, uint64_t> requests;
+
+    uint64_t operator[](const std::string &name) const;
+    // requests of the color management protocols
+    uint64_t ColorManagement() const;
+    // wl_display.sync, which every roundtrip sends
+    uint64_t Syncs() const { return (*this)["wl_display.sync"]; }
+    RequestCounts operator-(const RequestCounts &other) const;
+};
+
+class MockCompositor
+{
+public:
+    explicit MockCompositor(CompositorConfig config);
+    ~MockCompositor();
+
+    MockCompositor(const MockCompositor &) = delete;
+    MockCompositor &operator=(const MockCompositor &) = delete;
+
+    // The client end of the connection, for wl_display_connect_to_fd. Can
+    // only be taken once.
+    int TakeClientFd();
+
+    // Runs task on the compositor's thread, and returns once it ran.
+    void Run(const std::function<void()> &task);
+
+    RequestCounts Requests();
+    std::optional<SurfaceState> Surface(uint32_t id);
+    // protocol errors sent to the client
+    uint64_t ProtocolErrors();
+    // color management output objects the client has
+    size_t ColorOutputs();
+
+    // Sends wl_surface.leave and enter, makes the output's description the
+    // surface's preferred one and sends preferred_changed.
+    void MoveSurface(uint32_t id, size_t output);
+    // Changes an output's description, and with it the preferred description
+    // of the surfaces on it.
+    void SetOutputInfo(size_t output, const DisplayInfo &info);
+    size_t AddOutput(const DisplayInfo &info);
+    // wl_global_remove, the global itself stays until the compositor is gone
+    void RemoveOutput(size_t output);
+
+    // Called on the compositor thread by the protocol implementations.
+    struct Output;
+    struct SurfaceData;
+    struct Description;
+    const CompositorConfig &Config() const { return m_config; }
+    const DisplayInfo &Preferred(const SurfaceData &surface) const;
+    uint32_t PreferredIdentity(const SurfaceData &surface) const;
+    void PostError(wl_resource *resource, uint32_t code, const char *message);
+    std::map<uint32_t, SurfaceData *> &Surfaces() { return m_surfaces; }
+    uint32_t NextIdentity() { return ++m_lastIdentity; }
+    wl_event_loop *Loop() const { return m_loop; }
+
+private:
+    void Main();
+    size_t AddOutputLocked(const DisplayInfo &info);
+    void SendPreferredChanged(SurfaceData &surface);
+
+    CompositorConfig m_config;
+    wl_display *m_display = nullptr;
+    wl_event_loop *m_loop = nullptr;
+    wl_protocol_logger *m_logger = nullptr;
+    // nullptr once libwayland-server destroyed it, after a protocol error
+    wl_client *m_client = nullptr;
+    std::unique_ptr<ClientListener> m_clientListener;
+    int m_clientFd = -1;
+    std::vector<wl_global *> m_globals;
+
+    int m_taskFd = -1;
+    wl_event_source *m_taskSource = nullptr;
+    std::mutex m_taskMutex;
+    std::vector<std::function<void()>> m_tasks;
+    bool m_quit = false;
+
+    // only used on the compositor thread
+    RequestCounts m_requests;
+    uint64_t m_protocolErrors = 0;
+    uint32_t m_lastIdentity = 0;
+    uint32_t m_preferredIdentity = 0;
+    std::vector<std::unique_ptr<Output>> m_outputs;
+    std::map<uint32_t, SurfaceData *> m_surfaces;
+
+    std::thread m_thread;
+};
+
+}